@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "affinity.h"
+
+// Server threads start on the general CPUs, which exclude the isolated ones. A thread running a
+// latency-sensitive session moves onto the isolated CPUs for as long as the session needs them.
+// Children are placed by a fork handler: the parent notes which CPU it forks on, and the child
+// narrows its CPU set to that core or its NUMA node before exec, so the command and the thread
+// draining its pipe share a cache. Everything the child needs is computed up front, since only
+// async-signal-safe calls are allowed between fork and exec in a threaded process.
+
+static cpu_set_t general_cpus;          // Server threads outside latency-sensitive sessions
+static cpu_set_t isolated_cpus;         // Reserved for latency-sensitive sessions
+static int have_isolated_cpus = 0;
+static cpu_set_t command_cpus;          // Forked commands, unless the session is latency-sensitive
+static int have_command_cpus = 0;
+static Placement command_placement = PLACE_ANY;
+
+static cpu_set_t node_cpus[AFFINITY_MAX_NODES];
+static int node_of_cpu[CPU_SETSIZE];    // -1 for CPUs without a known node
+
+static __thread int forking_cpu = -1;         // CPU the thread forked on, copied into the child
+static __thread int latency_sensitive = 0;    // Whether the thread runs on the isolated CPUs
+
+// Parse a CPU list in the kernel's format, e.g. "0-3,8,10-11"
+int parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *position = list;
+    while (*position != '\0' && *position != '\n') {
+        char *end;
+        long first = strtol(position, &end, 10);
+        if (end == position || first < 0) return -1;
+        long last = first;
+        position = end;
+        if (*position == '-') {
+            position++;
+            last = strtol(position, &end, 10);
+            if (end == position || last < first) return -1;
+            position = end;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*position == ',') {
+            position++;
+        } else if (*position != '\0' && *position != '\n') {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Parse a placement name
+int parse_placement(const char *name) {
+    if (strcmp(name, "any") == 0) return PLACE_ANY;
+    if (strcmp(name, "core") == 0) return PLACE_CORE;
+    if (strcmp(name, "node") == 0) return PLACE_NODE;
+    return -1;
+}
+
+// Read the CPUs of every NUMA node from sysfs; without it every CPU stays without a node
+static void load_numa_nodes(void) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        node_of_cpu[cpu] = -1;
+    }
+
+    DIR *nodes = opendir("/sys/devices/system/node");
+    if (nodes == NULL) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(nodes)) != NULL) {
+        int node;
+        char path[300], list[4096];
+        if (sscanf(entry->d_name, "node%d", &node) != 1 || node < 0 || node >= AFFINITY_MAX_NODES) continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) continue;
+        if (fgets(list, sizeof(list), file) != NULL && parse_cpu_list(list, &node_cpus[node]) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &node_cpus[node])) node_of_cpu[cpu] = node;
+            }
+        }
+        fclose(file);
+    }
+    closedir(nodes);
+}
+
+// Set the CPUs of server threads and reserve the isolated ones
+int affinity_set_server_cpus(const cpu_set_t *server_cpus, const cpu_set_t *isolated) {
+    cpu_set_t allowed;
+    if (server_cpus != NULL) {
+        allowed = *server_cpus;
+    } else if (pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+
+    // Other threads keep off the isolated CPUs
+    general_cpus = allowed;
+    if (isolated != NULL) {
+        isolated_cpus = *isolated;
+        have_isolated_cpus = 1;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, isolated)) CPU_CLR(cpu, &general_cpus);
+        }
+    }
+    if (CPU_COUNT(&general_cpus) == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(general_cpus), &general_cpus);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+// Set the CPUs and placement of forked commands
+void affinity_set_command_cpus(const cpu_set_t *cpus, Placement placement) {
+    if (cpus != NULL) {
+        command_cpus = *cpus;
+        have_command_cpus = 1;
+    }
+    command_placement = placement;
+    load_numa_nodes();
+}
+
+// Note the CPU of the forking thread; runs in the parent just before fork
+static void note_forking_cpu(void) {
+    forking_cpu = command_placement != PLACE_ANY ? sched_getcpu() : -1;
+}
+
+// Narrow the CPU set of a new child; runs in the child right after fork
+static void place_forked_child(void) {
+    cpu_set_t cpus;
+    if (latency_sensitive) {
+        cpus = isolated_cpus;
+    } else if (have_command_cpus) {
+        cpus = command_cpus;
+    } else if (command_placement != PLACE_ANY) {
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) return;
+    } else {
+        return; // The child keeps the forking thread's CPUs
+    }
+
+    // Prefer the forking thread's core or node, as long as it is within the allowed CPUs
+    if (forking_cpu >= 0 && forking_cpu < CPU_SETSIZE) {
+        cpu_set_t near;
+        CPU_ZERO(&near);
+        if (command_placement == PLACE_CORE) {
+            CPU_SET(forking_cpu, &near);
+        } else if (command_placement == PLACE_NODE && node_of_cpu[forking_cpu] >= 0) {
+            near = node_cpus[node_of_cpu[forking_cpu]];
+        }
+        CPU_AND(&near, &near, &cpus);
+        if (CPU_COUNT(&near) > 0) cpus = near;
+    }
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+// Register the fork handlers that place children
+void affinity_install_fork_handlers(void) {
+    pthread_atfork(note_forking_cpu, NULL, place_forked_child);
+}
+
+// Move the calling thread onto the isolated CPUs or back
+void affinity_set_latency_sensitive(int sensitive) {
+    if (!have_isolated_cpus || latency_sensitive == sensitive) return;
+    latency_sensitive = sensitive;
+    cpu_set_t *cpus = sensitive ? &isolated_cpus : &general_cpus;
+    pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+}
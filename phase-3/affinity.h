@@ -0,0 +1,35 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h> // cpu_set_t needs _GNU_SOURCE defined before the first include
+
+// Where forked commands are placed relative to the thread that reads their output
+typedef enum {
+    PLACE_ANY,      // Anywhere in the command CPU set
+    PLACE_CORE,     // On the CPU the forking thread runs on
+    PLACE_NODE      // On the NUMA node of the CPU the forking thread runs on
+} Placement;
+
+#define AFFINITY_MAX_NODES 64   // NUMA nodes read from sysfs
+
+// Function to parse a CPU list such as "0-3,8,10-11" into set, returns 0 or -1 if it is malformed or empty
+int parse_cpu_list(const char *list, cpu_set_t *set);
+
+// Function to parse a placement name ("any", "core" or "node"), returns -1 if unknown
+int parse_placement(const char *name);
+
+// Function to set the CPUs of server threads (NULL keeps the inherited set) and of latency-sensitive
+// sessions (NULL for none), which other threads then avoid; applies to the calling thread and every
+// thread it starts afterwards. Returns 0 or -1 if the resulting set is empty or rejected.
+int affinity_set_server_cpus(const cpu_set_t *server_cpus, const cpu_set_t *isolated_cpus);
+
+// Function to set the CPUs of forked commands (NULL for the forking thread's set) and their placement
+void affinity_set_command_cpus(const cpu_set_t *command_cpus, Placement placement);
+
+// Function to register the fork handlers that place every child forked from now on
+void affinity_install_fork_handlers(void);
+
+// Function to move the calling thread onto the isolated CPUs, or back off them; no-op without isolated CPUs
+void affinity_set_latency_sensitive(int sensitive);
+
+#endif
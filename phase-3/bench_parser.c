@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include "parser.h"
+#include "utilities.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+#endif
+
+// Parser microbenchmark: drives parse_pipeline over a fixed corpus.
+// The corpus is generated from a fixed seed and every class runs a fixed number of iterations,
+// so two builds can be compared run to run. Allocations made by the parser are counted by
+// wrapping the allocator at link time (-Wl,--wrap=malloc,...).
+
+#define CORPUS_LINES 64         // Lines generated per corpus class
+#define ITERATIONS 2000         // Passes over each class per repetition
+#define REPETITIONS 5           // Repetitions per class, the fastest is reported
+
+// Allocation counting through the linker's --wrap option
+static int counting_allocations = 0;
+static uint64_t allocation_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *str);
+char *__real_strndup(const char *str, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    if (counting_allocations) allocation_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    if (counting_allocations) allocation_count++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    if (counting_allocations) allocation_count++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *str) {
+    if (counting_allocations) allocation_count++;
+    return __real_strdup(str);
+}
+
+char *__wrap_strndup(const char *str, size_t size) {
+    if (counting_allocations) allocation_count++;
+    return __real_strndup(str, size);
+}
+
+// Structure to hold one class of benchmark input
+typedef struct {
+    const char *name;
+    char *lines[CORPUS_LINES];
+    size_t bytes;               // Total length of the lines
+} CorpusClass;
+
+// Deterministic linear congruential generator for the corpus
+static uint32_t corpus_seed = 12345;
+static uint32_t next_random(void) {
+    corpus_seed = corpus_seed * 1103515245u + 12345u;
+    return corpus_seed >> 8;
+}
+
+// Append a random lowercase word of the given length
+static char *append_word(char *out, int length) {
+    for (int i = 0; i < length; i++) *out++ = 'a' + next_random() % 26;
+    return out;
+}
+
+// Realistic interactive commands, with the odd pipe and redirection
+static void generate_realistic_line(char *line) {
+    static const char *templates[] = {
+        "ls -la /var/log",
+        "grep -n \"connection refused\" server.log",
+        "cat access.log | grep GET | wc -l",
+        "sort -u names.txt > sorted.txt",
+        "ps aux | grep server",
+        "./calculator + 12 30",
+        "echo 'hello world' >> notes.txt",
+        "find . -name main.c 2> errors.txt",
+        "tr a-z A-Z < input.txt > output.txt",
+        "head -n 20 /etc/passwd | cut -d : -f 1 | sort",
+    };
+    strcpy(line, templates[next_random() % (sizeof(templates) / sizeof(templates[0]))]);
+}
+
+// A few very long arguments, close to the input buffer limit
+static void generate_long_args_line(char *line) {
+    char *out = line;
+    out += sprintf(out, "echo");
+    for (int i = 0; i < 3; i++) {
+        *out++ = ' ';
+        out = append_word(out, 250 + next_random() % 50);
+    }
+    *out = '\0';
+}
+
+// Arguments made almost entirely of quoted fragments
+static void generate_quoted_line(char *line) {
+    char *out = line;
+    out += sprintf(out, "printf");
+    for (int i = 0; i < 40; i++) {
+        char quote = next_random() % 2 ? '\'' : '"';
+        *out++ = ' ';
+        for (int j = 0; j < 3; j++) {
+            *out++ = quote;
+            out = append_word(out, 1 + next_random() % 4);
+            *out++ = ' ';
+            *out++ = quote;
+        }
+    }
+    *out = '\0';
+}
+
+// Every redirection the parser understands, repeated (later ones win)
+static void generate_redirection_line(char *line) {
+    char *out = line;
+    out += sprintf(out, "sort data");
+    for (int i = 0; i < 12; i++) {
+        switch (next_random() % 4) {
+            case 0: out += sprintf(out, " < in%d.txt", i); break;
+            case 1: out += sprintf(out, " > out%d.txt", i); break;
+            case 2: out += sprintf(out, " >> log%d.txt", i); break;
+            default: out += sprintf(out, " 2> err%d.txt", i); break;
+        }
+    }
+    *out = '\0';
+}
+
+// The maximum number of pipeline stages, each with many arguments
+static void generate_max_pipes_line(char *line) {
+    char *out = line;
+    // MAX_PIPED_COMMANDS counts the pipes, so the longest pipeline has one more stage than that
+    for (int stage = 0; stage <= MAX_PIPED_COMMANDS; stage++) {
+        if (stage > 0) out += sprintf(out, " | ");
+        out = append_word(out, 4);
+        for (int i = 0; i < 20; i++) {
+            *out++ = ' ';
+            *out++ = '-';
+            out = append_word(out, 1 + next_random() % 6);
+        }
+    }
+    *out = '\0';
+}
+
+// Fill a corpus class using the given line generator
+static void generate_corpus_class(CorpusClass *corpus, const char *name, void (*generate)(char *)) {
+    corpus->name = name;
+    corpus->bytes = 0;
+    for (int i = 0; i < CORPUS_LINES; i++) {
+        char line[MAX_COMMAND_LENGTH * 2];
+        generate(line);
+        line[MAX_COMMAND_LENGTH - 1] = '\0'; // Respect the shell's input limit
+        corpus->lines[i] = strdup(line);
+        corpus->bytes += strlen(corpus->lines[i]);
+    }
+}
+
+// Parse every line of the class once, returns the number of commands parsed
+static int parse_corpus_class(const CorpusClass *corpus) {
+    int commands = 0;
+
+    for (int i = 0; i < CORPUS_LINES; i++) {
+        Pipeline pipeline;
+        int count = parse_pipeline(corpus->lines[i], &pipeline);
+        if (count > 0) {
+            commands += count;
+            free_pipeline(&pipeline);
+        }
+    }
+    return commands;
+}
+
+// Return the CPU's cycle counter, or 0 where none is available
+static uint64_t read_cycles(void) {
+#ifdef HAVE_CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Time one corpus class and print its results
+static void run_corpus_class(const CorpusClass *corpus) {
+    uint64_t best_ns = UINT64_MAX, best_cycles = UINT64_MAX;
+    uint64_t allocations = 0;
+    int commands_per_pass = parse_corpus_class(corpus); // Warm up caches and count commands
+
+    for (int repetition = 0; repetition < REPETITIONS; repetition++) {
+        allocation_count = 0;
+        counting_allocations = 1;
+        uint64_t start_cycles = read_cycles();
+        uint64_t start_ns = now_ns();
+        for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+            parse_corpus_class(corpus);
+        }
+        uint64_t elapsed_ns = now_ns() - start_ns;
+        uint64_t elapsed_cycles = read_cycles() - start_cycles;
+        counting_allocations = 0;
+
+        if (elapsed_ns < best_ns) best_ns = elapsed_ns;
+        if (elapsed_cycles < best_cycles) best_cycles = elapsed_cycles;
+        allocations = allocation_count;
+    }
+
+    double lines = (double)CORPUS_LINES * ITERATIONS;
+    double commands = (double)commands_per_pass * ITERATIONS;
+    printf("%-14s %8.1f %8.2f %10.1f %10.1f %11.2f\n",
+           corpus->name,
+           (double)corpus->bytes / CORPUS_LINES,
+           best_ns / ((double)corpus->bytes * ITERATIONS),
+           best_ns / lines,
+           best_cycles / commands,
+           allocations / commands);
+}
+
+int main(void) {
+    // Pin to one CPU so frequency and migration noise stay out of the numbers
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    CorpusClass corpus[5];
+    generate_corpus_class(&corpus[0], "realistic", generate_realistic_line);
+    generate_corpus_class(&corpus[1], "long-args", generate_long_args_line);
+    generate_corpus_class(&corpus[2], "quoting", generate_quoted_line);
+    generate_corpus_class(&corpus[3], "redirections", generate_redirection_line);
+    generate_corpus_class(&corpus[4], "max-pipes", generate_max_pipes_line);
+
+    printf("Parser benchmark: %d lines x %d iterations per class, best of %d%s\n",
+           CORPUS_LINES, ITERATIONS, REPETITIONS,
+#ifdef HAVE_CYCLE_COUNTER
+           ""
+#else
+           " (no cycle counter on this CPU)"
+#endif
+    );
+    printf("%-14s %8s %8s %10s %10s %11s\n", "class", "B/line", "ns/B", "ns/line", "cyc/cmd", "allocs/cmd");
+    for (int i = 0; i < 5; i++) {
+        run_corpus_class(&corpus[i]);
+    }
+
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < CORPUS_LINES; j++) free(corpus[i].lines[j]);
+    }
+    return 0;
+}
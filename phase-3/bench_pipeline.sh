@@ -0,0 +1,39 @@
+#!/bin/bash
+# Pipeline throughput benchmark: pushes SIZE bytes through `cat | tr | wc`
+# with bash, the shell in its default mode and the shell with --high-throughput.
+# Usage: SIZE=10G ./bench_pipeline.sh
+
+SIZE=${SIZE:-1G}
+RUNS=${RUNS:-3}
+DATA_FILE=$(mktemp /tmp/bench_pipeline.XXXXXX)
+trap 'rm -f "$DATA_FILE"' EXIT
+
+PIPELINE="cat $DATA_FILE | tr a-z A-Z | wc -c"
+
+# Generate the input once so every run reads from the page cache
+head -c "$SIZE" /dev/urandom > "$DATA_FILE"
+BYTES=$(stat -c %s "$DATA_FILE")
+
+# Run the pipeline RUNS times with the given runner and print the best throughput
+run_benchmark() {
+    local label=$1
+    shift
+    local best=""
+    for ((run = 0; run < RUNS; run++)); do
+        local start end elapsed
+        start=$(date +%s%N)
+        "$@" > /dev/null
+        end=$(date +%s%N)
+        elapsed=$((end - start))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+    done
+    awk -v label="$label" -v ns="$best" -v bytes="$BYTES" \
+        'BEGIN { printf "%-28s %8.3f s  %8.2f MB/s\n", label, ns / 1e9, bytes / 1e6 / (ns / 1e9) }'
+}
+
+echo "Pipeline: cat | tr a-z A-Z | wc -c, $BYTES bytes, best of $RUNS"
+run_benchmark "bash" bash -c "$PIPELINE"
+run_benchmark "shell (default)" bash -c "echo '$PIPELINE' | ./shell"
+run_benchmark "shell (--high-throughput)" bash -c "echo '$PIPELINE' | ./shell --high-throughput"
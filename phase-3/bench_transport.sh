@@ -0,0 +1,50 @@
+#!/bin/bash
+# Transport benchmark: compares loopback TCP with the Unix domain socket for the same server.
+# Latency comes from loadgen running small commands; throughput from streaming SIZE bytes
+# through a remote `cat` in both directions.
+# Usage: SIZE=256M DURATION=5 ./bench_transport.sh
+
+SIZE=${SIZE:-256M}
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-4}
+RUNS=${RUNS:-3}
+SOCKET_PATH=$(mktemp -u /tmp/bench_transport.XXXXXX.sock)
+DATA_FILE=$(mktemp /tmp/bench_transport.XXXXXX)
+
+./server --grace 0 --log-level warn --socket "$SOCKET_PATH" &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; wait $SERVER_PID 2>/dev/null; rm -f "$DATA_FILE"' EXIT
+
+# Generate the input once so every run reads from the page cache
+head -c "$SIZE" /dev/urandom > "$DATA_FILE"
+BYTES=$(stat -c %s "$DATA_FILE")
+sleep 0.3
+
+# Stream the data through a remote cat RUNS times and print the best throughput
+run_throughput() {
+    local label=$1
+    shift
+    local best=""
+    for ((run = 0; run < RUNS; run++)); do
+        local start end elapsed
+        start=$(date +%s%N)
+        ./client "$@" -c cat < "$DATA_FILE" > /dev/null
+        end=$(date +%s%N)
+        elapsed=$((end - start))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+    done
+    awk -v label="$label" -v ns="$best" -v bytes="$BYTES" \
+        'BEGIN { printf "%-12s %8.3f s  %8.2f MB/s\n", label, ns / 1e9, bytes / 1e6 / (ns / 1e9) }'
+}
+
+echo "== Latency: echo hello, $CONNECTIONS connections, $DURATION s =="
+echo "-- TCP"
+./loadgen -n "$CONNECTIONS" -d "$DURATION" -p "$SERVER_PID"
+echo "-- Unix socket"
+./loadgen -n "$CONNECTIONS" -d "$DURATION" -p "$SERVER_PID" -u "$SOCKET_PATH"
+
+echo "== Throughput: $BYTES bytes up and back through cat, best of $RUNS =="
+run_throughput "TCP"
+run_throughput "Unix socket" --socket "$SOCKET_PATH"
@@ -1,80 +1,1039 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "histogram.h"
+#include "history.h"
+#include "lineedit.h"
+#include "pipeio.h"
+#include "protocol.h"
 #include "utilities.h"
 
 #define PORT 8080          // Port number to connect to
-#define BUFFER_SIZE 1024   // Buffer size for sending and receiving data
+#define BUFFER_SIZE 1024   // Buffer size for reading user input
+#define RECONNECT_ATTEMPTS 20     // Tries to reach the server again after the connection drops
+#define RECONNECT_DELAY_MS 500    // Pause between reconnection attempts
+#define COMPLETION_CACHE_ENTRIES 32   // Completion replies kept
+#define COMPLETION_CACHE_MS 10000     // Age after which a reply is asked for again
+#define COMPLETION_TIMEOUT_MS 2000    // Longest wait for a completion reply
+#define MAX_UPLOADS 16                // --upload options accepted
 
-int main() {
-    int client_socket;
+// Flags of run_remote_command
+#define RUN_TERMINAL   2   // Run the command under a pseudo-terminal, with the local terminal in raw mode
+
+// What the last FRAME_SESSION said about the session
+#define SESSION_STARTED      0  // A new session; the server runs nothing for us
+#define SESSION_RESUMED      1  // Resumed; the rest of the running command's output follows
+#define SESSION_RESUMED_IDLE 2  // Resumed, but no command is running and nothing is left to replay
+#define SESSION_EXPIRED      3  // The server no longer had our session and started a new one
+
+// Structure to hold the connection and buffers of the client
+typedef struct {
+    int socket;
+    int show_stats;
+    char *input;           // Room for a frame header and FRAME_STDIN_MAX bytes of input
+    char *output;          // Room for FRAME_MAX_PAYLOAD bytes of output
+    int have_token;        // Whether the server offered to keep the session across reconnects
+    uint64_t token;
+    uint64_t received_offset;  // Bytes of session frames received, where a resumed session continues
+    int session_state;     // SESSION_* from the last FRAME_SESSION
+    const char *socket_path;   // Unix domain socket of the server, NULL for TCP
+    uint32_t deadline_ms;      // Run time asked for every command, 0 for the server's default
+} ClientSession;
+
+// Terminal settings to restore after a pseudo-terminal command, even if the client exits early
+static struct termios saved_terminal;
+static int terminal_is_raw = 0;
+
+// Set by SIGWINCH, so the new window size is forwarded to the remote terminal
+static volatile sig_atomic_t window_resized = 0;
+
+// Counts SIGINT (Ctrl+C) while a command runs; each one is forwarded to it as a cancel
+static volatile sig_atomic_t cancel_requests = 0;
+
+// Keystroke-to-echo latency of pseudo-terminal commands, in nanoseconds
+static Histogram echo_latency;
+
+// Structure to hold a completion request and, once answered, its reply
+typedef struct {
+    char *word;                  // NULL for a free entry
+    size_t word_length;
+    uint8_t kind;                // COMPLETE_COMMAND or COMPLETE_PATH
+    uint32_t request_id;
+    uint64_t requested_at;       // Monotonic time of the request, in nanoseconds
+    int answered;
+    int truncated;               // The reply does not hold every candidate, so it cannot be narrowed locally
+    char *candidates;            // Back to back, each null-terminated
+    size_t candidates_length;
+} CompletionEntry;
+
+// Replies are narrowed locally as the word grows, so most Tabs never reach the server
+static CompletionEntry completion_cache[COMPLETION_CACHE_ENTRIES];
+static uint32_t next_completion_id = 1;
+
+// Candidates matching the word last completed, handed to the line editor
+static char *completion_matches = NULL;
+static size_t completion_matches_capacity = 0;
+
+// Note that the local terminal changed size
+static void handle_window_change(int signal_number) {
+    (void)signal_number;
+    window_resized = 1;
+}
+
+// Note that the user wants the remote command stopped
+static void handle_interrupt(int signal_number) {
+    (void)signal_number;
+    cancel_requests++;
+}
+
+// Restore the local terminal to the settings it had before raw mode
+static void restore_terminal(void) {
+    if (terminal_is_raw) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_terminal);
+        terminal_is_raw = 0;
+    }
+}
+
+// Put the local terminal in raw mode, so every keystroke goes to the remote terminal as typed
+static void make_terminal_raw(void) {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_terminal) < 0) return;
+
+    struct termios raw = saved_terminal;
+    cfmakeraw(&raw);
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == 0) {
+        terminal_is_raw = 1;
+    }
+}
+
+// Send the local window size (or 24x80 without a terminal) as a frame of the given type, with an optional command after it
+static int send_window_size(int client_socket, uint8_t frame_type, const char *command) {
+    uint8_t payload[WINDOW_SIZE_SIZE + BUFFER_SIZE];
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || size.ws_row == 0) {
+        size.ws_row = 24;
+        size.ws_col = 80;
+    }
+
+    size_t command_length = command != NULL ? strlen(command) : 0;
+    if (command_length > BUFFER_SIZE) command_length = BUFFER_SIZE;
+    encode_window_size(size.ws_row, size.ws_col, payload);
+    memcpy(payload + WINDOW_SIZE_SIZE, command, command_length);
+    return send_frame(client_socket, frame_type, payload, WINDOW_SIZE_SIZE + command_length);
+}
+
+// Print the completion trailer of a command
+static void print_command_stats(const CommandResult *result) {
+    if (result->term_signal != 0) {
+        fprintf(stderr, "[killed by signal %d", result->term_signal);
+    } else {
+        fprintf(stderr, "[exit %d", result->exit_code);
+    }
+    fprintf(stderr, " | total %.3f ms: queue %.3f, spawn %.3f, first byte %.3f"
+                    " | cpu user %.3f ms, sys %.3f ms | max rss %llu KB]\n",
+            result->complete_us / 1e3, result->queue_us / 1e3, result->spawn_us / 1e3,
+            result->first_byte_us / 1e3, result->user_cpu_us / 1e3, result->sys_cpu_us / 1e3,
+            (unsigned long long)result->max_rss_kb);
+}
+
+// Print the keystroke-to-echo latency measured over pseudo-terminal commands
+static void print_echo_stats(void) {
+    if (echo_latency.total_count == 0) return;
+    fprintf(stderr, "[keystroke echo: %llu samples | p50 %.3f ms, p99 %.3f ms, max %.3f ms]\n",
+            (unsigned long long)echo_latency.total_count,
+            histogram_percentile(&echo_latency, 50) / 1e6, histogram_percentile(&echo_latency, 99) / 1e6,
+            echo_latency.max / 1e6);
+}
+
+// Connect to the server over its Unix socket if one was given, otherwise over TCP
+static int connect_to_server(const ClientSession *session) {
     struct sockaddr_in server_addr;
-    char buffer[BUFFER_SIZE];
+    if (session->socket_path != NULL) {
+        return create_unix_client_socket(session->socket_path);
+    }
+    return create_client_socket(PORT, "127.0.0.1", &server_addr);
+}
 
-    // Create and connect the client socket
-    client_socket = create_client_socket(PORT, "127.0.0.1", &server_addr);
-    if (client_socket < 0) {
-        fprintf(stderr, "Failed to connect to the server.\n");
+// Connect again and ask the server for our session; returns 0 once the request is sent
+static int reconnect_session(ClientSession *session) {
+    uint8_t payload[RESUME_FRAME_SIZE];
+    encode_resume_frame(session->token, session->received_offset, payload);
+
+    close(session->socket);
+    session->socket = -1;
+    fprintf(stderr, "[connection lost, reconnecting]\r\n");
+
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS; attempt++) {
+        struct timespec delay = { 0, RECONNECT_DELAY_MS * 1000000L };
+        if (attempt > 0) nanosleep(&delay, NULL);
+
+        int sock = connect_to_server(session);
+        if (sock < 0) continue;
+        if (send_frame(sock, FRAME_RESUME, payload, sizeof(payload)) == 0) {
+            session->socket = sock;
+            return 0;
+        }
+        close(sock);
+    }
+    return -1;
+}
+
+// Take note of the session token, and of where a resumed session continues
+static void handle_session_frame(ClientSession *session, const uint8_t *payload, uint32_t length) {
+    uint64_t token, replay_offset, journal_end;
+    int running;
+    if (decode_session_frame(payload, length, &token, &replay_offset, &journal_end, &running) < 0) return;
+
+    if (session->have_token && token == session->token) {
+        // Output older than the server's journal is gone for good
+        if (replay_offset > session->received_offset) {
+            fprintf(stderr, "[%llu bytes of output were lost while disconnected]\r\n",
+                    (unsigned long long)(replay_offset - session->received_offset));
+        }
+        session->received_offset = replay_offset;
+        session->session_state = !running && replay_offset == journal_end ? SESSION_RESUMED_IDLE : SESSION_RESUMED;
+    } else {
+        session->session_state = session->have_token ? SESSION_EXPIRED : SESSION_STARTED;
+        session->have_token = 1;
+        session->token = token;
+        session->received_offset = 0;
+    }
+}
+
+// Free a completion cache entry
+static void forget_completion(CompletionEntry *entry) {
+    free(entry->word);
+    free(entry->candidates);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Drop the cached file names; the command that is about to run may change them
+static void forget_path_completions(void) {
+    for (int i = 0; i < COMPLETION_CACHE_ENTRIES; i++) {
+        if (completion_cache[i].word != NULL && completion_cache[i].kind == COMPLETE_PATH) {
+            forget_completion(&completion_cache[i]);
+        }
+    }
+}
+
+// Store a completion reply with its request
+static void store_completions(const uint8_t *payload, uint32_t length) {
+    uint32_t request_id;
+    uint8_t flags;
+    if (decode_completion_header(payload, length, &request_id, &flags) < 0) return;
+
+    // A reply to a forgotten request is dropped
+    for (int i = 0; i < COMPLETION_CACHE_ENTRIES; i++) {
+        CompletionEntry *entry = &completion_cache[i];
+        if (entry->word == NULL || entry->answered || entry->request_id != request_id) continue;
+
+        entry->candidates_length = length - COMPLETION_HEADER_SIZE;
+        entry->candidates = malloc(entry->candidates_length + 1);
+        if (entry->candidates == NULL) {
+            forget_completion(entry);
+            return;
+        }
+        memcpy(entry->candidates, payload + COMPLETION_HEADER_SIZE, entry->candidates_length);
+        entry->truncated = (flags & COMPLETIONS_TRUNCATED) != 0;
+        entry->answered = 1;
+        return;
+    }
+}
+
+// Receive one frame from the server, printing output; returns the frame type
+static int receive_server_frame(ClientSession *session, int *exit_code) {
+    uint8_t frame_type;
+    uint32_t frame_length;
+    int status = recv_frame(session->socket, &frame_type, session->output, FRAME_MAX_PAYLOAD, &frame_length);
+    if (status <= 0 && session->have_token) {
+        // The server keeps the session for a while, so the command carries on after a reconnect
+        if (reconnect_session(session) == 0) {
+            status = recv_frame(session->socket, &frame_type, session->output, FRAME_MAX_PAYLOAD, &frame_length);
+        }
+        if (status > 0 && frame_type != FRAME_SESSION) status = -1;
+        if (status <= 0) errno = ECONNRESET;
+    }
+    if (status < 0) {
+        perror("Receive failed");
+        close(session->socket);
         exit(EXIT_FAILURE);
+    } else if (status == 0) {
+        // Connection closed by the server
+        restore_terminal();
+        printf("Server closed the connection.\n");
+        close(session->socket);
+        exit(EXIT_SUCCESS);
     }
 
-    printf("Connected to server. Enter commands (type 'exit' to quit):\n");
+    // Everything but the token counts toward the offset a resumed session continues from
+    if (frame_type == FRAME_SESSION) {
+        handle_session_frame(session, (uint8_t *)session->output, frame_length);
+        return frame_type;
+    }
+    session->received_offset += FRAME_HEADER_SIZE + frame_length;
 
+    if (frame_type == FRAME_STDOUT) {
+        // Print the received data
+        fwrite(session->output, 1, frame_length, stdout);
+        fflush(stdout);
+    } else if (frame_type == FRAME_STDERR) {
+        // Error output stays apart from the output, so either can be redirected on its own
+        fflush(stdout);
+        fwrite(session->output, 1, frame_length, stderr);
+    } else if (frame_type == FRAME_COMPLETIONS) {
+        store_completions((uint8_t *)session->output, frame_length);
+    } else if (frame_type == FRAME_RESULT) {
+        CommandResult result;
+        if (decode_command_result((uint8_t *)session->output, frame_length, &result) == 0) {
+            restore_terminal(); // Before printing, so the trailer is not drawn in raw mode
+            if (session->show_stats) print_command_stats(&result);
+            *exit_code = result.exit_code;
+        }
+    }
+    return frame_type;
+}
+
+// Send a command to the server, after the deadline asked for if any; a terminal command carries the window size first.
+// Without input the command sees end of file straight away.
+static void send_command(ClientSession *session, const char *command, int has_input, int flags) {
+    int sent = 0;
+    if (session->deadline_ms > 0) {
+        uint8_t payload[DEADLINE_FRAME_SIZE];
+        encode_deadline_frame(session->deadline_ms, payload);
+        sent = send_frame(session->socket, FRAME_DEADLINE, payload, sizeof(payload));
+    }
+    if (sent == 0 && (flags & RUN_TERMINAL)) {
+        sent = send_window_size(session->socket, FRAME_PTY_COMMAND, command);
+    } else if (sent == 0) {
+        sent = send_frame(session->socket, FRAME_COMMAND, command, strlen(command));
+    }
+    if (sent == 0 && !has_input) {
+        sent = send_frame(session->socket, FRAME_STDIN, NULL, 0);
+    }
+
+    // A dropped connection of a resumable session shows up when its output is read
+    if (sent < 0 && !session->have_token) {
+        perror("Send failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Run a command remotely, streaming input_fd to its stdin (-1 for no input) and its output to stdout.
+// Returns the command's exit code.
+static int relay_remote_command(ClientSession *session, const char *command, int input_fd, int flags) {
+    int exit_code = 1;
+    int cancels_sent = 0;
+
+    send_command(session, command, input_fd >= 0, flags);
+    if (flags & RUN_TERMINAL) make_terminal_raw();
+
+    // Forward input and print output as each arrives, until the completion frame. Input frames are
+    // sent without blocking, so output is always read even when the command stops taking input.
+    size_t pending_offset = 0, pending_length = 0;  // Part of the input frame not yet sent
+    int input_ended = input_fd < 0;
+    uint64_t keystroke_sent_at = 0;                 // Oldest input not yet followed by output
     while (1) {
-        printf("client_shell> ");  // Display prompt
-        fflush(stdout); // Ensure prompt is displayed immediately
+        // Ctrl+C interrupts the command, pressing it again kills it; a cancel must not split an input frame
+        if (cancel_requests > cancels_sent && pending_length == 0) {
+            uint8_t signal_number = cancels_sent == 0 ? SIGINT : SIGKILL;
+            cancels_sent = cancel_requests;
+            send_frame(session->socket, FRAME_CANCEL, &signal_number, CANCEL_FRAME_SIZE);
+        }
 
-        // Read user input from stdin
-        if (!fgets(buffer, BUFFER_SIZE, stdin)) {
-            // Handle EOF (e.g., Ctrl+D)
-            printf("\nEOF detected. Exiting.\n");
-            break;
+        struct pollfd fds[2] = {
+            { .fd = session->socket, .events = POLLIN | (pending_length > 0 ? POLLOUT : 0) },
+            { .fd = pending_length == 0 ? input_fd : -1, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+                exit(EXIT_FAILURE);
+            }
+            if (window_resized && (flags & RUN_TERMINAL)) {
+                window_resized = 0;
+                send_window_size(session->socket, FRAME_WINSIZE, NULL);
+            }
+            continue;
+        }
+
+        if (fds[1].revents) {
+            ssize_t bytes = read(input_fd, session->input + FRAME_HEADER_SIZE, FRAME_STDIN_MAX);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes < 0) bytes = 0; // Treat a read error like the end of the input
+
+            // An empty frame closes the command's stdin
+            encode_frame_header((uint8_t *)session->input, FRAME_STDIN, (uint32_t)bytes);
+            pending_offset = 0;
+            pending_length = FRAME_HEADER_SIZE + bytes;
+            if (bytes == 0) {
+                input_ended = 1;
+                input_fd = -1;
+            } else if ((flags & RUN_TERMINAL) && keystroke_sent_at == 0) {
+                keystroke_sent_at = now_ns();
+            }
         }
 
-        // Remove the trailing newline character
-        buffer[strcspn(buffer, "\n")] = '\0';
+        if (pending_length > 0) {
+            ssize_t written = send(session->socket, session->input + pending_offset, pending_length,
+                                   MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (written < 0 && errno != EAGAIN && errno != EINTR && !session->have_token) {
+                perror("Send failed");
+                exit(EXIT_FAILURE);
+            }
+            if (written > 0) {
+                pending_offset += written;
+                pending_length -= written;
+            }
+        }
 
-        // Send the command to the server
-        if (send(client_socket, buffer, strlen(buffer), 0) < 0) {
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int frame_type = receive_server_frame(session, &exit_code);
+            if (frame_type == FRAME_RESULT) {
+                return exit_code;
+            }
+            if (frame_type == FRAME_SESSION && session->session_state == SESSION_EXPIRED) {
+                restore_terminal();
+                fprintf(stderr, "[the server lost the session, the command's outcome is unknown]\n");
+                return 255;
+            }
+            if (frame_type == FRAME_SESSION && session->session_state != SESSION_STARTED) {
+                // The command never reached the server if it is idle with nothing to replay
+                if (session->session_state == SESSION_RESUMED_IDLE) {
+                    send_command(session, command, input_fd >= 0 || pending_length > 0, flags);
+                }
+
+                // Input in flight when the connection dropped is lost, but the end of the input is sent again
+                if (pending_length > 0) {
+                    pending_length += pending_offset;
+                    pending_offset = 0;
+                } else if (input_ended) {
+                    encode_frame_header((uint8_t *)session->input, FRAME_STDIN, 0);
+                    pending_offset = 0;
+                    pending_length = FRAME_HEADER_SIZE;
+                }
+            }
+            if (frame_type == FRAME_STDOUT && keystroke_sent_at != 0) {
+                // The first output after a keystroke is its echo
+                histogram_record(&echo_latency, now_ns() - keystroke_sent_at);
+                keystroke_sent_at = 0;
+            }
+        }
+    }
+}
+
+// Run a command remotely as relay_remote_command does, with Ctrl+C cancelling the command instead of the client
+static int run_remote_command(ClientSession *session, const char *command, int input_fd, int flags) {
+    // Without SA_RESTART the signal interrupts poll, so the cancel goes out straight away
+    struct sigaction action, previous;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigemptyset(&action.sa_mask);
+    cancel_requests = 0;
+    sigaction(SIGINT, &action, &previous);
+
+    int exit_code = relay_remote_command(session, command, input_fd, flags);
+    sigaction(SIGINT, &previous, NULL);
+    return exit_code;
+}
+
+// Upload a file ("-" for stdin) into the server's memory under a name, "" for the stdin of the next command.
+// Returns 0, or -1 after printing why the file could not be read.
+static int upload_file(ClientSession *session, const char *name, const char *path) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    // Pieces are built in the input buffer, each as large as the server's receive buffer allows
+    uint8_t *payload = (uint8_t *)session->input;
+    int header_length = encode_upload_header(UPLOAD_FIRST, name, payload);
+    if (header_length < 0) {
+        fprintf(stderr, "Upload name longer than %d bytes: %s\n", UPLOAD_NAME_MAX, name);
+        if (fd != STDIN_FILENO) close(fd);
+        return -1;
+    }
+    size_t capacity = FRAME_STDIN_MAX - header_length;
+    uint8_t flags = UPLOAD_FIRST;
+    int status = 0;
+    while (!(flags & UPLOAD_LAST)) {
+        // Only a read of nothing ends the file, so a piece is filled as far as it goes
+        size_t length = 0;
+        while (length < capacity) {
+            ssize_t bytes = read(fd, payload + header_length + length, capacity - length);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes < 0) {
+                perror(path);
+                status = -1;
+            }
+            if (bytes <= 0) {
+                flags |= UPLOAD_LAST;
+                break;
+            }
+            length += bytes;
+        }
+
+        // A failed read still ends the upload, so the server drops nothing half-done on the next one
+        payload[0] = flags;
+        if (send_frame(session->socket, FRAME_UPLOAD, payload, header_length + length) < 0) {
             perror("Send failed");
+            exit(EXIT_FAILURE);
+        }
+        flags &= ~UPLOAD_FIRST;
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    return status;
+}
+
+// Upload the files of --upload options, given as [name=]file; returns whether one is for the next command's stdin
+static int upload_files(ClientSession *session, const char **uploads, int upload_count) {
+    int stdin_upload = 0;
+    for (int i = 0; i < upload_count; i++) {
+        char name[UPLOAD_NAME_MAX + 2] = "";
+        const char *path = uploads[i];
+        const char *equals = strchr(uploads[i], '=');
+        if (equals != NULL) {
+            snprintf(name, sizeof(name), "%.*s", (int)(equals - uploads[i]), uploads[i]);
+            path = equals + 1;
+        }
+        if (upload_file(session, name, path) < 0) exit(EXIT_FAILURE);
+        if (name[0] == '\0') stdin_upload = 1;
+    }
+    return stdin_upload;
+}
+
+// Structure to hold the local end of a download
+typedef struct {
+    int fd;
+    off_t position;          // Where the next data goes in the file
+    int pipe_fds[2];         // Between the socket and the file, for splice
+    int file_error;          // errno of a failed write, after which the data is discarded
+} Download;
+
+// Receive frames until a transfer reply of the given type, moving file data into the download if there is one
+// and storing completion replies asked for earlier. Returns 0 with the reply decoded, or -1 if the connection failed.
+static int receive_transfer_reply(ClientSession *session, uint8_t reply_type, Download *download, int32_t *error,
+                                  uint64_t *size, uint64_t *offset) {
+    errno = 0;
+    while (1) {
+        uint8_t frame_type;
+        uint32_t frame_length;
+        int received = recv_frame_header(session->socket, &frame_type, &frame_length);
+        if (received == 0) errno = ECONNRESET; // The server closed the connection between frames
+        if (received <= 0) break;
+        if (frame_type != FRAME_SESSION) session->received_offset += FRAME_HEADER_SIZE + frame_length;
+
+        if (frame_type == FRAME_FILE_DATA && download != NULL) {
+            if (splice_to_file(session->socket, download->fd, &download->position, frame_length, download->pipe_fds,
+                               &download->file_error) < 0) {
+                break;
+            }
+            continue;
+        }
+        if (frame_length > FRAME_MAX_PAYLOAD) {
+            errno = EPROTO;
+            break;
+        }
+        if (recv_frame_payload(session->socket, session->output, frame_length) < 0) break;
+        if (frame_type == FRAME_COMPLETIONS) {
+            store_completions((uint8_t *)session->output, frame_length);
+        } else if (frame_type == reply_type) {
+            if (decode_transfer_reply((uint8_t *)session->output, frame_length, error, size, offset) == 0) return 0;
+            errno = EPROTO;
             break;
         }
+    }
+    perror("Receive failed");
+    return -1;
+}
 
-        // If the user types 'exit', close the connection
-        if (strcmp(buffer, "exit") == 0) {
-            printf("Closing connection.\n");
+// Print how much a transfer moved and how fast
+static void print_transfer_stats(const char *direction, const char *from, const char *to, uint64_t bytes,
+                                 uint64_t offset, uint64_t started_at) {
+    double seconds = (now_ns() - started_at) / 1e9;
+    fprintf(stderr, "[%s %s -> %s: %llu bytes in %.3f s, %.1f MB/s", direction, from, to, (unsigned long long)bytes,
+            seconds, seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+    if (offset > 0) fprintf(stderr, ", resumed at %llu", (unsigned long long)offset);
+    fprintf(stderr, "]\n");
+}
+
+// Upload a local file to a path on the server, from what an earlier upload left if resuming. The data goes
+// from the page cache to the socket with sendfile. Returns 0, or 1 after printing what failed.
+static int put_file(ClientSession *session, const char *local_path, const char *remote_path, int resume) {
+    struct stat status;
+    int fd = open(local_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &status) < 0) {
+        int saved_errno = errno;
+        close(fd);
+        fd = -1;
+        errno = saved_errno;
+    } else if (fd >= 0 && !S_ISREG(status.st_mode)) {
+        close(fd);
+        fd = -1;
+        errno = S_ISDIR(status.st_mode) ? EISDIR : EINVAL;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "put: %s: %s\n", local_path, strerror(errno));
+        return 1;
+    }
+    uint64_t size = status.st_size;
+
+    int length = encode_transfer_request(resume ? TRANSFER_RESUME : 0, size, remote_path, (uint8_t *)session->input,
+                                         FRAME_STDIN_MAX);
+    int32_t error;
+    uint64_t offset, done_size, done_offset;
+    uint64_t started_at = now_ns();
+    if (length < 0 || send_frame(session->socket, FRAME_PUT, session->input, length) < 0 ||
+        receive_transfer_reply(session, FRAME_TRANSFER, NULL, &error, &done_size, &offset) < 0) {
+        if (length < 0) fprintf(stderr, "put: %s: %s\n", remote_path, strerror(ENAMETOOLONG));
+        close(fd);
+        return 1;
+    }
+    if (error != 0) {
+        fprintf(stderr, "put: %s: %s\n", remote_path, strerror(error));
+        close(fd);
+        return 1;
+    }
+
+    off_t position = offset;
+    int shrank = 0;
+    while ((uint64_t)position < size) {
+        uint64_t chunk = size - position < TRANSFER_CHUNK ? size - position : TRANSFER_CHUNK;
+        ssize_t sent = send_file_frame(session->socket, FRAME_FILE_DATA, fd, &position, (uint32_t)chunk);
+        if (sent < 0) {
+            perror("Send failed");
+            close(fd);
+            return 1;
+        }
+        if (sent < (ssize_t)chunk) {
+            // The frames still went out whole, padded with zeros, so the stream stays in step
+            shrank = 1;
+            position += chunk - sent;
+        }
+    }
+    close(fd);
+
+    if (receive_transfer_reply(session, FRAME_TRANSFER_DONE, NULL, &error, &done_size, &done_offset) < 0) return 1;
+    if (error != 0 || shrank) {
+        fprintf(stderr, "put: %s: %s at offset %llu\n", shrank ? local_path : remote_path,
+                shrank ? "file shrank while it was sent" : strerror(error), (unsigned long long)done_offset);
+        return 1;
+    }
+    print_transfer_stats("put", local_path, remote_path, done_size, offset, started_at);
+    return 0;
+}
+
+// Download a file from the server into a local path, from the end of what the local file holds if resuming.
+// The data goes from the socket into the file with splice. Returns 0, or 1 after printing what failed.
+static int get_file(ClientSession *session, const char *remote_path, const char *local_path, int resume) {
+    struct stat status;
+    uint64_t have = resume && stat(local_path, &status) == 0 && S_ISREG(status.st_mode) ? status.st_size : 0;
+
+    int length = encode_transfer_request(resume ? TRANSFER_RESUME : 0, have, remote_path, (uint8_t *)session->input,
+                                         FRAME_STDIN_MAX);
+    int32_t error;
+    uint64_t size, offset, done_size, done_offset;
+    uint64_t started_at = now_ns();
+    if (length < 0 || send_frame(session->socket, FRAME_GET, session->input, length) < 0 ||
+        receive_transfer_reply(session, FRAME_TRANSFER, NULL, &error, &size, &offset) < 0) {
+        if (length < 0) fprintf(stderr, "get: %s: %s\n", remote_path, strerror(ENAMETOOLONG));
+        return 1;
+    }
+    if (error != 0) {
+        fprintf(stderr, "get: %s: %s\n", remote_path, strerror(error));
+        return 1;
+    }
+
+    // The local file is opened only now, so a failed request leaves nothing behind; the data is still
+    // taken off the connection if it cannot be written
+    Download download = { .fd = open(local_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644), .position = offset,
+                          .pipe_fds = { -1, -1 } };
+    if (download.fd < 0 || ftruncate(download.fd, offset) < 0 || create_pipe(download.pipe_fds) < 0) {
+        download.file_error = errno;
+    }
+    if (download.pipe_fds[0] < 0 && create_pipe(download.pipe_fds) < 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    int received = receive_transfer_reply(session, FRAME_TRANSFER_DONE, &download, &error, &done_size, &done_offset);
+    close(download.pipe_fds[0]);
+    close(download.pipe_fds[1]);
+    if (received < 0) {
+        if (download.fd >= 0) close(download.fd);
+        return 1;
+    }
+
+    // Frames padded after the server's file shrank are cut off again
+    if (download.fd >= 0 && error != 0 && download.file_error == 0 && ftruncate(download.fd, done_offset) < 0) {
+        download.file_error = errno;
+    }
+    if (download.fd >= 0) close(download.fd);
+    if (download.file_error != 0 || error != 0) {
+        fprintf(stderr, "get: %s: %s\n", download.file_error != 0 ? local_path : remote_path,
+                strerror(download.file_error != 0 ? download.file_error : error));
+        return 1;
+    }
+    print_transfer_stats("get", remote_path, local_path, done_size, offset, started_at);
+    return 0;
+}
+
+// Run a put or get line: "put [-r] local [remote]" or "get [-r] remote [local]", where -r resumes an earlier
+// transfer and the second path defaults to the last component of the first. Returns the exit code, or -1 if
+// the line is neither.
+static int run_transfer_command(ClientSession *session, const char *line) {
+    char words[BUFFER_SIZE];
+    snprintf(words, sizeof(words), "%s", line);
+    char *save = NULL;
+    char *command = strtok_r(words, " \t", &save);
+    if (command == NULL || (strcmp(command, "put") != 0 && strcmp(command, "get") != 0)) return -1;
+
+    int resume = 0;
+    char *source = strtok_r(NULL, " \t", &save);
+    if (source != NULL && strcmp(source, "-r") == 0) {
+        resume = 1;
+        source = strtok_r(NULL, " \t", &save);
+    }
+    char *destination = strtok_r(NULL, " \t", &save);
+    if (source == NULL || strtok_r(NULL, " \t", &save) != NULL) {
+        fprintf(stderr, "Usage: put [-r] local [remote] | get [-r] remote [local]\n");
+        return 2;
+    }
+    if (destination == NULL) {
+        const char *slash = strrchr(source, '/');
+        destination = (char *)(slash != NULL && slash[1] != '\0' ? slash + 1 : source);
+    }
+
+    if (strcmp(command, "put") == 0) return put_file(session, source, destination, resume);
+    return get_file(session, source, destination, resume);
+}
+
+// Return the length of the directory part of a path, up to and including its last '/'
+static size_t directory_part(const char *word, size_t length) {
+    const char *slash = memrchr(word, '/', length);
+    return slash != NULL ? (size_t)(slash - word) + 1 : 0;
+}
+
+// Ask the server to complete a word, unless the same request is recent; returns its cache entry
+static CompletionEntry *request_completions(ClientSession *session, uint8_t kind, const char *word, size_t length) {
+    uint64_t now = now_ns();
+    CompletionEntry *entry = NULL;
+    for (int i = 0; i < COMPLETION_CACHE_ENTRIES; i++) {
+        CompletionEntry *candidate = &completion_cache[i];
+        if (candidate->word != NULL && candidate->kind == kind && candidate->word_length == length &&
+            memcmp(candidate->word, word, length) == 0) {
+            if (now - candidate->requested_at < COMPLETION_CACHE_MS * 1000000ULL) return candidate;
+            entry = candidate; // Asked again in its place
             break;
         }
 
-        // Receive and display the server's response
-        while (1) {
-            memset(buffer, 0, BUFFER_SIZE); // Clear the buffer
-            int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-            if (bytes_received < 0) {
-                perror("Receive failed");
-                close(client_socket);
+        // Otherwise replace a free entry, or the oldest
+        if (entry == NULL || (entry->word != NULL && (candidate->word == NULL || candidate->requested_at < entry->requested_at))) {
+            entry = candidate;
+        }
+    }
+
+    char payload[COMPLETION_HEADER_SIZE + BUFFER_SIZE];
+    if (length > BUFFER_SIZE) length = BUFFER_SIZE;
+    forget_completion(entry);
+    entry->word = strndup(word, length);
+    if (entry->word == NULL) return entry;
+    entry->word_length = length;
+    entry->kind = kind;
+    entry->request_id = next_completion_id++;
+    entry->requested_at = now;
+
+    encode_completion_header(entry->request_id, kind, (uint8_t *)payload);
+    memcpy(payload + COMPLETION_HEADER_SIZE, word, length);
+    send_frame(session->socket, FRAME_COMPLETE, payload, COMPLETION_HEADER_SIZE + length);
+    return entry;
+}
+
+// Receive the frames that arrived while no command runs, waiting up to timeout_ms for the reply of awaited (NULL for none)
+static void receive_idle_frames(ClientSession *session, const CompletionEntry *awaited, int timeout_ms) {
+    uint64_t deadline = now_ns() + timeout_ms * 1000000ULL;
+    while (1) {
+        int wait_ms = 0;
+        if (awaited != NULL && awaited->word != NULL && !awaited->answered) {
+            uint64_t now = now_ns();
+            if (now >= deadline) return;
+            wait_ms = (int)((deadline - now + 999999) / 1000000);
+        }
+
+        struct pollfd fd = { .fd = session->socket, .events = POLLIN };
+        int ready = poll(&fd, 1, wait_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return;
+
+        int exit_code;
+        receive_server_frame(session, &exit_code);
+    }
+}
+
+// Find the freshest answered request whose candidates include every completion of a word
+static const CompletionEntry *find_completions(uint8_t kind, const char *word, size_t length) {
+    uint64_t now = now_ns();
+    size_t directory_length = kind == COMPLETE_PATH ? directory_part(word, length) : 0;
+    const CompletionEntry *found = NULL;
+
+    for (int i = 0; i < COMPLETION_CACHE_ENTRIES; i++) {
+        const CompletionEntry *entry = &completion_cache[i];
+        if (entry->word == NULL || !entry->answered || entry->kind != kind ||
+            now - entry->requested_at >= COMPLETION_CACHE_MS * 1000000ULL) {
+            continue;
+        }
+
+        // The request must be a prefix of the word in the same directory, and complete unless it is the word itself
+        if (entry->word_length > length || memcmp(entry->word, word, entry->word_length) != 0) continue;
+        if (entry->truncated && entry->word_length != length) continue;
+        if (kind == COMPLETE_PATH) {
+            if (directory_part(entry->word, entry->word_length) != directory_length) continue;
+
+            // Hidden files were only listed if the request started with the dot
+            if (length > directory_length && word[directory_length] == '.' && entry->word_length == directory_length) {
+                continue;
+            }
+        }
+        if (found == NULL || entry->word_length > found->word_length) found = entry;
+    }
+    return found;
+}
+
+// Complete the word before the cursor, for the line editor. A miss asks for every command, or every file of
+// the word's directory, so the following keys are answered from the cache.
+static size_t complete_remote_word(const char *line, size_t cursor, size_t *word_start, const char **candidates,
+                                   void *context) {
+    ClientSession *session = (ClientSession *)context;
+
+    // The word starts after the last blank or operator
+    size_t start = cursor;
+    while (start > 0 && strchr(" \t|<>", line[start - 1]) == NULL) start--;
+    *word_start = start;
+    const char *word = line + start;
+    size_t length = cursor - start;
+
+    // Commands are the first word, the first after a pipe, and the first after "pty"
+    size_t before = start;
+    while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t')) before--;
+    uint8_t kind = COMPLETE_PATH;
+    if ((before == 0 || line[before - 1] == '|' || (before == 3 && strncmp(line, "pty", 3) == 0)) &&
+        memchr(word, '/', length) == NULL) {
+        kind = COMPLETE_COMMAND;
+    }
+
+    receive_idle_frames(session, NULL, 0);
+    const CompletionEntry *entry = find_completions(kind, word, length);
+    if (entry == NULL) {
+        // Hidden files are only listed for a request that starts with the dot
+        size_t request_length = kind == COMPLETE_PATH ? directory_part(word, length) : 0;
+        if (request_length < length && word[request_length] == '.') request_length++;
+        CompletionEntry *requested = request_completions(session, kind, word, request_length);
+        receive_idle_frames(session, requested, COMPLETION_TIMEOUT_MS);
+
+        // A directory too large for one reply is asked for the word itself
+        if (requested->answered && requested->truncated && request_length < length) {
+            requested = request_completions(session, kind, word, length);
+            receive_idle_frames(session, requested, COMPLETION_TIMEOUT_MS);
+        }
+        entry = find_completions(kind, word, length);
+        if (entry == NULL) return 0;
+    }
+
+    // Narrow the reply to the word
+    if (completion_matches_capacity < entry->candidates_length + 1) {
+        char *matches = realloc(completion_matches, entry->candidates_length + 1);
+        if (matches == NULL) return 0;
+        completion_matches = matches;
+        completion_matches_capacity = entry->candidates_length + 1;
+    }
+    size_t count = 0, matches_length = 0;
+    const char *last_match = NULL;
+    for (const char *candidate = entry->candidates; candidate < entry->candidates + entry->candidates_length;
+         candidate += strlen(candidate) + 1) {
+        if (strncmp(candidate, word, length) != 0) continue;
+        size_t candidate_length = strlen(candidate) + 1;
+        last_match = completion_matches + matches_length;
+        memcpy(completion_matches + matches_length, candidate, candidate_length);
+        matches_length += candidate_length;
+        count++;
+    }
+
+    // The only match is a directory: list it now, while the user looks at the line
+    if (count == 1 && last_match[strlen(last_match) - 1] == '/') {
+        request_completions(session, COMPLETE_PATH, last_match, strlen(last_match));
+    }
+    *candidates = completion_matches;
+    return count;
+}
+
+// Ask once per session for the completions most likely needed first: every command, and the files of the
+// working directory. Later ones are asked for when tab needs them.
+static void prefetch_completions(ClientSession *session) {
+    request_completions(session, COMPLETE_COMMAND, "", 0);
+    request_completions(session, COMPLETE_PATH, "", 0);
+}
+
+// Print the command-line options of the client
+static void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--stats] [--socket path] [--deadline seconds] [--upload [name=]file]... [-t] [-c command]\n"
+            "  --socket path connect to the server's Unix domain socket instead of 127.0.0.1:8080\n"
+            "  --stats       print exit status, timings and resource usage after every command\n"
+            "  --deadline seconds\n"
+            "                have the server terminate any command running longer than this\n"
+            "  --upload [name=]file\n"
+            "                keep a file (- for stdin) in server memory, read by '<@name' redirections, or\n"
+            "                without a name as the stdin of the first command\n"
+            "  -c command    run one command with this program's stdin as its input, then exit with its status\n"
+            "  -t            run the -c command under a pseudo-terminal (for interactive programs)\n"
+            "In the interactive loop, 'pty command' runs a command under a pseudo-terminal.\n"
+            "'put [-r] local [remote]' and 'get [-r] remote [local]' copy files, also as the -c command;\n"
+            "-r resumes a transfer that broke off.\n"
+            "Ctrl+C interrupts the remote command; pressing it again kills it.\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    ClientSession session = { .socket = -1 };
+    char buffer[BUFFER_SIZE];
+    const char *one_shot_command = NULL;
+    int one_shot_flags = 0;
+    const char *uploads[MAX_UPLOADS];
+    int upload_count = 0;
+
+    // Parse command-line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            session.show_stats = 1; // Print exit status, timings and resource usage after every command
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            one_shot_command = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0) {
+            one_shot_flags |= RUN_TERMINAL;
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            session.socket_path = argv[++i]; // Same-host server: skip the TCP stack
+        } else if (strcmp(argv[i], "--upload") == 0 && i + 1 < argc && upload_count < MAX_UPLOADS) {
+            uploads[upload_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) {
+            if (parse_deadline_seconds(argv[++i], &session.deadline_ms) < 0) {
+                fprintf(stderr, "Invalid deadline '%s'\n", argv[i]);
                 exit(EXIT_FAILURE);
-            } else if (bytes_received == 0) {
-                // Connection closed by the server
-                printf("Server closed the connection.\n");
-                close(client_socket);
-                exit(EXIT_SUCCESS);
             }
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-            buffer[bytes_received] = '\0';  // Null-terminate the received data
+    // Output frames may be as large as the server's pipe buffers
+    session.output = malloc(FRAME_MAX_PAYLOAD);
+    session.input = malloc(FRAME_HEADER_SIZE + FRAME_STDIN_MAX);
+    if (session.output == NULL || session.input == NULL) {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
 
-            // Check for the end-of-output signal
-            if (strcmp(buffer, "__END__") == 0) {
-                break;
+    // Forward window size changes; without SA_RESTART the signal interrupts poll
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_window_change;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGWINCH, &action, NULL);
+    atexit(restore_terminal);
+    histogram_init(&echo_latency);
+
+    // A dropped connection is noticed by the failing send, then resumed
+    signal(SIGPIPE, SIG_IGN);
+
+    // Create and connect the client socket
+    session.socket = connect_to_server(&session);
+    if (session.socket < 0) {
+        fprintf(stderr, "Failed to connect to the server.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Uploads go first, so they are complete when the first command runs
+    int stdin_upload = upload_files(&session, uploads, upload_count);
+
+    // One-shot mode: all of stdin streams to the command, unless it reads an upload instead; the connection
+    // stays open for a cancel until it finishes
+    if (one_shot_command != NULL) {
+        int exit_code = run_transfer_command(&session, one_shot_command);
+        if (exit_code < 0) {
+            exit_code = run_remote_command(&session, one_shot_command, stdin_upload ? -1 : STDIN_FILENO,
+                                           one_shot_flags);
+        }
+        if (session.show_stats) print_echo_stats();
+        close(session.socket);
+        free(session.input);
+        free(session.output);
+        return exit_code;
+    }
+
+    // Typed lines go to the running command, and Ctrl+D ends its input. Commands read from a
+    // file or pipe get no input, so the following lines stay commands.
+    int stream_input = isatty(STDIN_FILENO);
+
+    // Only typed commands are worth recalling, not those of a script
+    History *history = NULL;
+    char history_path[4096];
+    if (stream_input && history_default_path(".client_shell_history", history_path, sizeof(history_path)) == 0) {
+        history = history_open(history_path);
+    }
+
+    printf("Connected to server. Enter commands (type 'exit' to quit):\n");
+
+    // Tab completes from the server's commands and files; the replies are cached and asked for ahead of time
+    if (stream_input) {
+        line_editor_set_completer(complete_remote_word, &session);
+        prefetch_completions(&session);
+    }
+
+    while (1) {
+        // Read user input from stdin
+        if (!line_editor_read("client_shell> ", buffer, BUFFER_SIZE, history)) {
+            // Handle EOF (e.g., Ctrl+D)
+            printf("\nEOF detected. Exiting.\n");
+            break;
+        }
+        if (history != NULL && buffer[0] != '\0') history_add(history, buffer);
+
+        // If the user types 'exit', close the connection
+        if (strcmp(buffer, "exit") == 0) {
+            if (send_frame(session.socket, FRAME_COMMAND, buffer, strlen(buffer)) < 0) {
+                perror("Send failed");
             }
+            printf("Closing connection.\n");
+            break;
+        }
 
-            // Print the received data
-            printf("%s", buffer);
+        // Run the command and display its output until the completion frame
+        forget_path_completions();
+        if (run_transfer_command(&session, buffer) >= 0) {
+            // A file was moved to or from the server without running a command
+        } else if (strncmp(buffer, "pty ", 4) == 0) {
+            run_remote_command(&session, buffer + 4, stream_input ? STDIN_FILENO : -1, RUN_TERMINAL);
+            if (session.show_stats) print_echo_stats();
+        } else {
+            run_remote_command(&session, buffer, stream_input ? STDIN_FILENO : -1, 0);
         }
     }
 
+    // Replies to completions asked for ahead of time are read, so closing does not reset the connection
+    if (stream_input) receive_idle_frames(&session, NULL, 0);
+
     // Close the client socket
-    close(client_socket);
+    close(session.socket);
+    history_close(history);
+    free(session.input);
+    free(session.output);
     return 0;
 }
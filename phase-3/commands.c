@@ -1,95 +1,180 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include "commands.h"
+#include "parallel.h"
+#include "pipeio.h"
+#include "trace.h"
+
+// Set up input, output and error redirections for a command in the child process
+static void apply_redirections(ShellCommand *cmd) {
+    // Set up input redirection
+    if (cmd->input_file) {
+        int input_fd = open(cmd->input_file, O_RDONLY);
+        if (input_fd < 0) {
+            perror("Open Input File Error");
+            exit(EXIT_FAILURE);
+        }
+        dup2(input_fd, STDIN_FILENO);
+        close(input_fd);
+    }
+
+    // Set up output redirection
+    if (cmd->output_file) {
+        int output_fd;
+        if (cmd->append_output) {
+            output_fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        } else {
+            output_fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (output_fd < 0) {
+            perror("Open Output File Error");
+            exit(EXIT_FAILURE);
+        }
+        dup2(output_fd, STDOUT_FILENO);
+        close(output_fd);
+    }
+
+    // Set up error redirection
+    if (cmd->error_file) {
+        int error_fd = open(cmd->error_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (error_fd < 0) {
+            perror("Open Error File Failure");
+            exit(EXIT_FAILURE);
+        }
+        dup2(error_fd, STDERR_FILENO);
+        close(error_fd);
+    }
+}
+
+// Replace the current (child) process with the command, never returns
+static void exec_shell_command(ShellCommand *cmd) {
+    // The parallel builtin runs inside the child so that redirections and pipes apply to it as a whole
+    if (is_parallel_command(cmd)) {
+        _exit(execute_parallel_command(cmd));
+    }
+
+    // Check if the command starts with './' or '/' indicating a relative or absolute path
+    if (cmd->arguments[0][0] == '.' || cmd->arguments[0][0] == '/') {
+        // Execute command as-is, since it may be a path
+        execv(cmd->arguments[0], cmd->arguments);
+        perror("Error executing program");
+    } else {
+        // A path found ahead of time skips the search, unless the file has gone since
+        if (cmd->executable != NULL) execv(cmd->executable, cmd->arguments);
+        // Use execvp for searching in PATH
+        execvp(cmd->arguments[0], cmd->arguments);
+        fprintf(stderr, "Error: Invalid command '%s'\n", cmd->arguments[0]);
+    }
+    exit(EXIT_FAILURE);
+}
+
+// Set up redirections and execute the command in an already forked child process
+void run_command_in_child(ShellCommand *cmd) {
+    apply_redirections(cmd);
+    exec_shell_command(cmd);
+}
 
 // Execute a single shell command
 void execute_single_command(ShellCommand *cmd) {
     pid_t child_pid = fork();
     if (child_pid == 0) {
         // Child process
+        run_command_in_child(cmd);
+    } else if (child_pid > 0) {
+        // Parent process
+        wait_for_commands(&child_pid, 1, NULL);  // Wait for the child process to complete
+    } else {
+        perror("fork");
+    }
+}
 
-        // Set up input redirection
-        if (cmd->input_file) {
-            int input_fd = open(cmd->input_file, O_RDONLY);
-            if (input_fd < 0) {
-                perror("Open Input File Error");
-                exit(EXIT_FAILURE);
-            }
-            dup2(input_fd, STDIN_FILENO);
-            close(input_fd);
-        }
+// Wait for the given processes and collect the exit status of the last one and their summed resource usage
+void wait_for_commands(pid_t *pids, int count, ExecutionResult *result) {
+    if (result != NULL) {
+        memset(result, 0, sizeof(*result));
+    }
 
-        // Set up output redirection
-        if (cmd->output_file) {
-            int output_fd;
-            if (cmd->append_output) {
-                output_fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            } else {
-                output_fd = open(cmd->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (int i = 0; i < count; i++) {
+        int status;
+        struct rusage usage;
+        while (wait4(pids[i], &status, 0, &usage) < 0) {
+            if (errno != EINTR) {
+                // The stage's exit could not be collected, so it is reported as failed like a command not found
+                perror("wait4");
+                status = W_EXITCODE(127, 0);
+                memset(&usage, 0, sizeof(usage));
+                break;
             }
-            if (output_fd < 0) {
-                perror("Open Output File Error");
-                exit(EXIT_FAILURE);
-            }
-            dup2(output_fd, STDOUT_FILENO);
-            close(output_fd);
         }
-
-        // Set up error redirection
-        if (cmd->error_file) {
-            int error_fd = open(cmd->error_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (error_fd < 0) {
-                perror("Open Error File Failure");
-                exit(EXIT_FAILURE);
-            }
-            dup2(error_fd, STDERR_FILENO);
-            close(error_fd);
+        trace_process_reaped(pids[i]);
+        if (result != NULL) {
+            record_command_exit(result, status, &usage, i == count - 1);
         }
+    }
+}
 
-        // Check if the command starts with './' or '/' indicating a relative or absolute path
-        if (cmd->arguments[0][0] == '.' || cmd->arguments[0][0] == '/') {
-            // Execute command as-is, since it may be a path
-            if (execv(cmd->arguments[0], cmd->arguments) < 0) {
-                perror("Error executing program");
-                exit(EXIT_FAILURE);
-            }
-        } else {
-            // Use execvp for searching in PATH
-            if (execvp(cmd->arguments[0], cmd->arguments) < 0) {
-                fprintf(stderr, "Error: Invalid command '%s'\n", cmd->arguments[0]);
-                exit(EXIT_FAILURE);
-            }
-        }
-    } else if (child_pid > 0) {
-        // Parent process
-        wait(NULL);  // Wait for the child process to complete
-    } else {
-        perror("fork");
+// Add a reaped process to the result of its pipeline
+void record_command_exit(ExecutionResult *result, int status, const struct rusage *usage, int last_stage) {
+    // Like other shells, the pipeline's status is the status of its last stage
+    if (last_stage) {
+        result->status = status;
+    }
+    timeradd(&result->usage.ru_utime, &usage->ru_utime, &result->usage.ru_utime);
+    timeradd(&result->usage.ru_stime, &usage->ru_stime, &result->usage.ru_stime);
+    if (usage->ru_maxrss > result->usage.ru_maxrss) {
+        result->usage.ru_maxrss = usage->ru_maxrss;
     }
 }
 
 // Execute a series of piped commands
 void execute_piped_commands(ShellCommand **commands, int command_count) {
+    pid_t pids[command_count];
+    int started = spawn_piped_commands(commands, command_count, pids, NULL, 0);
+    wait_for_commands(pids, started, NULL);
+}
+
+// Fork every command of a pipeline without waiting, returns the number of processes started
+int spawn_piped_commands(ShellCommand **commands, int command_count, pid_t *pids, const int *stdio_fds, int own_group) {
     int pipes[2 * (command_count - 1)];
     pid_t child_pid;
+    int started = 0;
 
     // Create pipes for inter-process communication
     for (int i = 0; i < command_count - 1; i++) {
-        if (pipe(pipes + i * 2) < 0) {
+        if (create_pipe(pipes + i * 2) < 0) {
             perror("pipe");
-            exit(EXIT_FAILURE);
+            for (int j = 0; j < i * 2; j++) {
+                close(pipes[j]);
+            }
+            return 0;
         }
     }
 
     // Fork and execute each command in the pipeline
     for (int i = 0; i < command_count; i++) {
+        int exec_fds[2];
+        trace_exec_pipe(exec_fds);
+        uint64_t fork_started = trace_now_us();
+
         child_pid = fork();
         if (child_pid == 0) {
             // Child process
+            if (own_group) {
+                setpgid(0, i == 0 ? 0 : pids[0]);
+            }
+
+            // Connect the ends of the pipeline and every stage's error output to the given descriptors
+            if (stdio_fds != NULL) {
+                if (i == 0) dup2(stdio_fds[0], STDIN_FILENO);
+                if (i == command_count - 1) dup2(stdio_fds[1], STDOUT_FILENO);
+                dup2(stdio_fds[2], STDERR_FILENO);
+            }
 
             // Redirect input from previous pipe if not the first command
             if (i != 0) {
@@ -144,14 +229,22 @@ void execute_piped_commands(ShellCommand **commands, int command_count) {
             }
 
             // Execute the command
-            if (execvp(commands[i]->arguments[0], commands[i]->arguments) < 0) {
-                fprintf(stderr, "Error: Invalid command '%s'\n", commands[i]->arguments[0]);
-                exit(EXIT_FAILURE);
-            }
+            exec_shell_command(commands[i]);
         } else if (child_pid < 0) {
+            // Stages already started see EOF or SIGPIPE once the pipes are closed below
             perror("fork");
-            exit(EXIT_FAILURE);
+            trace_exec_started(exec_fds, -1, 0);
+            break;
         }
+        // Set the group from both sides, so it exists before either the parent or the child goes on
+        if (own_group) {
+            setpgid(child_pid, i == 0 ? child_pid : pids[0]);
+        }
+        uint64_t forked_at = trace_now_us();
+        trace_span("fork", fork_started, forked_at, commands[i]->arguments[0]);
+        trace_process_started(child_pid, commands[i]->arguments[0]);
+        trace_exec_started(exec_fds, child_pid, forked_at);
+        pids[started++] = child_pid;
     }
 
     // Close all pipe file descriptors in the parent process
@@ -159,10 +252,7 @@ void execute_piped_commands(ShellCommand **commands, int command_count) {
         close(pipes[i]);
     }
 
-    // Wait for all child processes to complete
-    for (int i = 0; i < command_count; i++) {
-        wait(NULL);
-    }
+    return started;
 }
 
 // Check if the command is a built-in shell command
@@ -1,14 +1,37 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include <sys/types.h>
+#include <sys/resource.h>
 #include "shell.h"
 
+// Structure to hold how a command or pipeline finished
+typedef struct {
+    int status;            // Wait status of the last process
+    struct rusage usage;   // CPU times summed over all processes, ru_maxrss is the largest
+} ExecutionResult;
+
+// Function to set up redirections and execute a command in an already forked child process
+void run_command_in_child(ShellCommand *cmd);
+
 // Funciton to execute a single shell command
 void execute_single_command(ShellCommand *cmd);
 
 // Funciton to execute a series of piped commands
 void execute_piped_commands(ShellCommand **commands, int command_count);
 
+// Function to fork every command of a pipeline without waiting, returns the number of processes started.
+// stdio_fds (NULL to inherit) holds the stdin of the first stage, the stdout of the last stage and
+// the stderr of every stage; file redirections of the commands still take precedence. With own_group
+// every stage joins a new process group led by the first, so the pipeline can be signalled as a whole.
+int spawn_piped_commands(ShellCommand **commands, int command_count, pid_t *pids, const int *stdio_fds, int own_group);
+
+// Function to wait for the given processes, filling result (if not NULL) with their status and usage
+void wait_for_commands(pid_t *pids, int count, ExecutionResult *result);
+
+// Function to add a reaped process's status (if it is the last stage) and usage to result
+void record_command_exit(ExecutionResult *result, int status, const struct rusage *usage, int last_stage);
+
 // Funciton to check if the given command is a built-in shell command
 int is_built_in_command(ShellCommand *cmd);
 
@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "complete.h"
+#include "listing.h"
+#include "logger.h"
+#include "protocol.h"
+
+// Completions are answered from sorted directory listings, so a lookup is a binary search for the
+// first name with the prefix. The executables of every PATH directory are read at startup and merged
+// into one list of command names; other directories are read when a word first needs them and kept
+// while recently used. Every listing is watched with inotify: a thread marks a listing stale when its
+// directory changes, and only stale listings are read again. Without inotify, a listing is read again
+// when the modification time of its directory changed.
+
+#define WATCHED_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | \
+                        IN_MOVE_SELF | IN_ONLYDIR)
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"   // Searched when the server has no PATH
+
+// Structure to hold a directory that completions are offered from, with the watch that keeps it current
+typedef struct {
+    char *path;                  // As it appears in completed words, "." for the working directory
+    SortedListing entries;       // Names of directories end in '/'
+    int executables_only;        // A PATH directory, listing only the files that can be executed
+    int watch;                   // inotify watch descriptor, -1 if the directory is not watched
+    int stale;                   // Set when the directory changed since it was read, or was never read
+    struct timespec mtime;       // Modification time of the directory when read, for unwatched listings
+    uint64_t last_used;
+} DirectoryListing;
+
+// One lock serializes lookups and the watch thread; completions arrive at typing speed
+static pthread_mutex_t completion_lock = PTHREAD_MUTEX_INITIALIZER;
+static int inotify_fd = -1;
+static DirectoryListing path_listings[COMPLETION_PATH_DIRECTORIES];
+static size_t path_listing_count = 0;
+static DirectoryListing cached_listings[COMPLETION_CACHED_DIRECTORIES];
+static size_t cached_listing_count = 0;
+static uint64_t use_clock = 0;
+
+// Every PATH executable and builtin, sorted and without duplicates; the pointers are into the PATH listings
+static const char **command_names = NULL;
+static size_t command_count = 0;
+static int commands_stale = 1;
+
+// The builtins of is_built_in_command
+static const char *const built_in_names[] = { "cd", "exit" };
+
+// Read a directory into its listing; a directory that cannot be read is listed as empty
+static void read_listing(DirectoryListing *listing) {
+    // Watch before reading, so a change during the read is not missed
+    if (listing->watch < 0 && inotify_fd >= 0) {
+        listing->watch = inotify_add_watch(inotify_fd, listing->path, WATCHED_EVENTS);
+    }
+    listing->stale = 0;
+    free_sorted_listing(&listing->entries);
+
+    int directory_fd = open(listing->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd < 0) return;
+    struct stat status;
+    if (fstat(directory_fd, &status) == 0) listing->mtime = status.st_mtim;
+    int flags = LISTING_MARK_DIRECTORIES | (listing->executables_only ? LISTING_EXECUTABLES_ONLY : 0);
+    read_sorted_listing(directory_fd, flags, &listing->entries);
+    close(directory_fd);
+}
+
+// Check whether a listing still matches its directory
+static int listing_is_current(const DirectoryListing *listing) {
+    if (listing->stale) return 0;
+    if (listing->watch >= 0) return 1;
+
+    struct stat status;
+    return stat(listing->path, &status) == 0 && status.st_mtim.tv_sec == listing->mtime.tv_sec &&
+           status.st_mtim.tv_nsec == listing->mtime.tv_nsec;
+}
+
+// Check whether any listing but the given one uses a watch
+static int watch_is_shared(const DirectoryListing *except, int watch) {
+    for (size_t i = 0; i < path_listing_count; i++) {
+        if (&path_listings[i] != except && path_listings[i].watch == watch) return 1;
+    }
+    for (size_t i = 0; i < cached_listing_count; i++) {
+        if (&cached_listings[i] != except && cached_listings[i].watch == watch) return 1;
+    }
+    return 0;
+}
+
+// Free a listing and stop watching its directory; inotify gives the same watch to every path of a directory
+static void release_listing(DirectoryListing *listing) {
+    if (listing->watch >= 0 && !watch_is_shared(listing, listing->watch)) {
+        inotify_rm_watch(inotify_fd, listing->watch);
+    }
+    free(listing->path);
+    free_sorted_listing(&listing->entries);
+    memset(listing, 0, sizeof(*listing));
+    listing->watch = -1;
+}
+
+// Mark the listings of a changed directory stale; a removed watch (or -1 after lost events) affects all
+static void mark_changed(int watch, int removed) {
+    DirectoryListing *arrays[2] = { path_listings, cached_listings };
+    size_t counts[2] = { path_listing_count, cached_listing_count };
+    for (int a = 0; a < 2; a++) {
+        for (size_t i = 0; i < counts[a]; i++) {
+            DirectoryListing *listing = &arrays[a][i];
+            if (watch >= 0 && listing->watch != watch) continue;
+            listing->stale = 1;
+            if (removed && listing->watch == watch) listing->watch = -1;
+        }
+    }
+}
+
+// Mark listings stale as inotify reports changes to their directories
+static void *completion_watch_thread(void *arg) {
+    (void)arg;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t length = read(inotify_fd, events, sizeof(events));
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "Reading inotify events failed: %m");
+            return NULL;
+        }
+
+        pthread_mutex_lock(&completion_lock);
+        for (char *position = events; position < events + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)position;
+            if (event->mask & IN_Q_OVERFLOW) {
+                mark_changed(-1, 0); // Events were lost, so any directory may have changed
+            } else {
+                mark_changed(event->wd, (event->mask & IN_IGNORED) != 0);
+            }
+            position += sizeof(struct inotify_event) + event->len;
+        }
+        pthread_mutex_unlock(&completion_lock);
+    }
+}
+
+// Read the PATH directories that changed and merge their executables with the builtins
+static void refresh_command_names(void) {
+    for (size_t i = 0; i < path_listing_count; i++) {
+        if (!listing_is_current(&path_listings[i])) {
+            read_listing(&path_listings[i]);
+            commands_stale = 1;
+        }
+    }
+    if (!commands_stale) return;
+
+    // The old names point into listings that may just have been read again
+    free(command_names);
+    command_names = NULL;
+    command_count = 0;
+    commands_stale = 0;
+
+    size_t builtin_count = sizeof(built_in_names) / sizeof(built_in_names[0]);
+    size_t total = builtin_count;
+    for (size_t i = 0; i < path_listing_count; i++) {
+        total += path_listings[i].entries.count;
+    }
+    command_names = malloc(total * sizeof(char *));
+    if (command_names == NULL) return;
+
+    size_t count = 0;
+    for (size_t i = 0; i < builtin_count; i++) {
+        command_names[count++] = built_in_names[i];
+    }
+    for (size_t i = 0; i < path_listing_count; i++) {
+        const SortedListing *entries = &path_listings[i].entries;
+        memcpy(command_names + count, entries->names, entries->count * sizeof(char *));
+        count += entries->count;
+    }
+    qsort(command_names, count, sizeof(char *), compare_names);
+
+    // The same command in several PATH directories is offered once
+    for (size_t i = 0; i < count; i++) {
+        if (command_count == 0 || strcmp(command_names[command_count - 1], command_names[i]) != 0) {
+            command_names[command_count++] = command_names[i];
+        }
+    }
+}
+
+// Return the current listing of a directory other than PATH, reading it if needed; NULL if memory runs out
+static DirectoryListing *cached_listing(const char *path) {
+    DirectoryListing *listing = NULL;
+    for (size_t i = 0; i < cached_listing_count && listing == NULL; i++) {
+        if (strcmp(cached_listings[i].path, path) == 0) listing = &cached_listings[i];
+    }
+
+    if (listing == NULL) {
+        if (cached_listing_count < COMPLETION_CACHED_DIRECTORIES) {
+            listing = &cached_listings[cached_listing_count++];
+        } else {
+            // Evict the least recently used listing
+            listing = &cached_listings[0];
+            for (size_t i = 1; i < cached_listing_count; i++) {
+                if (cached_listings[i].last_used < listing->last_used) listing = &cached_listings[i];
+            }
+            release_listing(listing);
+        }
+        listing->path = strdup(path);
+        listing->watch = -1;
+        listing->stale = 1;
+        if (listing->path == NULL) return NULL;
+    }
+
+    listing->last_used = ++use_clock;
+    if (!listing_is_current(listing)) read_listing(listing);
+    return listing;
+}
+
+// Index PATH and start watching
+int completion_start(void) {
+    // Without the watch thread nothing would read the events, so a failure leaves every listing unwatched
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    pthread_t thread;
+    if (inotify_fd >= 0 && pthread_create(&thread, NULL, completion_watch_thread, NULL) != 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if (inotify_fd >= 0) pthread_detach(thread);
+
+    // Index PATH now, so the first completion is as quick as any other
+    const char *path = getenv("PATH");
+    char *directories = strdup(path != NULL ? path : DEFAULT_PATH);
+    if (directories == NULL) return -1;
+
+    pthread_mutex_lock(&completion_lock);
+    char *saveptr;
+    for (char *directory = strtok_r(directories, ":", &saveptr);
+         directory != NULL && path_listing_count < COMPLETION_PATH_DIRECTORIES;
+         directory = strtok_r(NULL, ":", &saveptr)) {
+        int duplicate = 0;
+        for (size_t i = 0; i < path_listing_count; i++) {
+            if (strcmp(path_listings[i].path, directory) == 0) duplicate = 1;
+        }
+        if (duplicate) continue;
+
+        DirectoryListing *listing = &path_listings[path_listing_count];
+        listing->path = strdup(directory);
+        if (listing->path == NULL) break;
+        listing->executables_only = 1;
+        listing->watch = -1;
+        listing->stale = 1;
+        path_listing_count++;
+    }
+    refresh_command_names();
+    pthread_mutex_unlock(&completion_lock);
+    free(directories);
+    return inotify_fd >= 0 ? 0 : -1;
+}
+
+// Find the candidates completing a word
+size_t completion_find(int kind, const char *word, size_t length, char *buffer, size_t capacity, int *truncated) {
+    *truncated = 0;
+
+    // A command given by its path, such as ./build.sh, is completed as a path
+    if (kind == COMPLETE_COMMAND && memchr(word, '/', length) != NULL) kind = COMPLETE_PATH;
+
+    pthread_mutex_lock(&completion_lock);
+    const char **names = NULL;
+    size_t count = 0;
+    size_t directory_length = 0;     // The directory part of a path, repeated in every candidate
+    if (kind == COMPLETE_COMMAND) {
+        refresh_command_names();
+        names = command_names;
+        count = command_count;
+    } else {
+        const char *slash = memrchr(word, '/', length);
+        directory_length = slash != NULL ? (size_t)(slash - word) + 1 : 0;
+        char directory[PATH_MAX];
+        if (directory_length < sizeof(directory)) {
+            memcpy(directory, word, directory_length);
+            directory[directory_length] = '\0';
+            DirectoryListing *listing = cached_listing(directory_length > 0 ? directory : ".");
+            if (listing != NULL) {
+                names = listing->entries.names;
+                count = listing->entries.count;
+            }
+        }
+    }
+    const char *prefix = word + directory_length;
+    size_t prefix_length = length - directory_length;
+
+    // Names with the prefix are contiguous in byte order
+    size_t first = find_prefix(names, count, prefix, prefix_length);
+    size_t written = 0;
+    for (size_t i = first; i < count && strncmp(names[i], prefix, prefix_length) == 0; i++) {
+        // Hidden files only when the word asks for them
+        if (kind == COMPLETE_PATH && names[i][0] == '.' && (prefix_length == 0 || prefix[0] != '.')) continue;
+
+        size_t name_length = strlen(names[i]) + 1;
+        if (written + directory_length + name_length > capacity) {
+            *truncated = 1;
+            break;
+        }
+        memcpy(buffer + written, word, directory_length);
+        memcpy(buffer + written + directory_length, names[i], name_length);
+        written += directory_length + name_length;
+    }
+    pthread_mutex_unlock(&completion_lock);
+    return written;
+}
@@ -0,0 +1,18 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include <stddef.h>
+
+#define COMPLETION_PATH_DIRECTORIES 64     // PATH entries indexed for command names
+#define COMPLETION_CACHED_DIRECTORIES 64   // Other directory listings kept, least recently used evicted first
+
+// Function to index the executables in PATH and start the thread that marks changed directories
+// with inotify; returns 0, or -1 without inotify, when changes are found by modification time instead
+int completion_start(void);
+
+// Function to write the candidates completing a word of the given kind (COMPLETE_COMMAND or COMPLETE_PATH)
+// into buffer, back to back and each null-terminated, in byte order; directories end in '/'. Returns the
+// bytes written, with *truncated set if some candidates did not fit.
+size_t completion_find(int kind, const char *word, size_t length, char *buffer, size_t capacity, int *truncated);
+
+#endif
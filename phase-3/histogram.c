@@ -0,0 +1,72 @@
+#include <string.h>
+#include "histogram.h"
+
+// Reset a histogram to empty
+void histogram_init(Histogram *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+// Map a value to its bucket index
+static int histogram_bucket_index(uint64_t value) {
+    if (value >= (1ULL << HISTOGRAM_MAX_BITS)) {
+        value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+    }
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value; // Small values are recorded exactly
+    }
+
+    // Keep the top HISTOGRAM_SUB_BUCKET_BITS bits of the value
+    int exponent = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    int sub_bucket = (int)(value >> exponent); // In [SUB_BUCKETS / 2, SUB_BUCKETS)
+    return exponent * (HISTOGRAM_SUB_BUCKETS / 2) + sub_bucket;
+}
+
+// Return the largest value that falls into the given bucket
+uint64_t histogram_bucket_upper_bound(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int exponent = bucket / (HISTOGRAM_SUB_BUCKETS / 2) - 1;
+    uint64_t sub_bucket = bucket - exponent * (HISTOGRAM_SUB_BUCKETS / 2);
+    return ((sub_bucket + 1) << exponent) - 1;
+}
+
+// Record a value using relaxed atomics so several threads may share a histogram
+void histogram_record(Histogram *histogram, uint64_t value) {
+    __atomic_fetch_add(&histogram->counts[histogram_bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Add all values of the source histogram to the destination
+void histogram_merge(Histogram *destination, const Histogram *source) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        destination->counts[i] += __atomic_load_n(&source->counts[i], __ATOMIC_RELAXED);
+    }
+    destination->total_count += __atomic_load_n(&source->total_count, __ATOMIC_RELAXED);
+    destination->sum += __atomic_load_n(&source->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&source->max, __ATOMIC_RELAXED);
+    if (max > destination->max) destination->max = max;
+}
+
+// Return the value at the given percentile (0-100)
+uint64_t histogram_percentile(const Histogram *histogram, double percentile) {
+    if (histogram->total_count == 0) return 0;
+
+    uint64_t target = (uint64_t)(histogram->total_count * percentile / 100.0 + 0.5);
+    if (target == 0) target = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= target) {
+            uint64_t value = histogram_bucket_upper_bound(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
@@ -0,0 +1,35 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// HDR-style log-linear histogram: values are bucketed by their power of two and the
+// top HISTOGRAM_SUB_BUCKET_BITS bits below it, giving < 1% relative error per bucket.
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_BITS 40 // Values are clamped to 2^40 (about 18 minutes in nanoseconds)
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 2) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS]; // Number of values recorded per bucket
+    uint64_t total_count;               // Number of values recorded
+    uint64_t sum;                       // Sum of recorded values, for the mean
+    uint64_t max;                       // Largest recorded value
+} Histogram;
+
+// Function to reset a histogram to empty
+void histogram_init(Histogram *histogram);
+
+// Function to record a value, safe to call concurrently on the same histogram
+void histogram_record(Histogram *histogram, uint64_t value);
+
+// Function to add all values of the source histogram to the destination
+void histogram_merge(Histogram *destination, const Histogram *source);
+
+// Function to return the value at the given percentile (0-100)
+uint64_t histogram_percentile(const Histogram *histogram, double percentile);
+
+// Function to return the largest value that falls into the given bucket
+uint64_t histogram_bucket_upper_bound(int bucket);
+
+#endif
@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "history.h"
+
+// The history file is plain text, one command per line, and is only ever appended to. It is mapped
+// read-only, and the indexes refer to lines by their offset in the mapping, so no line is copied.
+// Opening only splits the file into lines and finds repeated ones through a hash table of distinct
+// commands. Every distinct command becomes a path in a radix trie whose nodes remember the newest
+// entry below them, which answers prefix recall without scanning; substring recall looks the
+// pattern's rarest trigram up in a bucketed index of distinct commands and checks only those
+// candidates. Both are built in slices while the line editor waits for keys, so opening a long
+// history stays quick, and a search that comes first finishes its index itself. Other shells append under
+// flock, and their lines are indexed when the file is seen to have grown.
+
+#define HISTORY_TRIGRAM_BUCKETS (1 << HISTORY_TRIGRAM_BITS)
+#define HISTORY_INDEX_SLICE 4096    // Distinct commands added to the trie or trigram index per step
+
+// Structure to hold one line of the history file, by its place in the mapping
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t command;                // Distinct command the line is an occurrence of
+} HistoryEntry;
+
+// Structure to hold a distinct command
+typedef struct {
+    uint32_t latest;                 // Newest entry of the command
+    uint32_t hash;
+} HistoryCommand;
+
+// Structure to hold a node of the prefix trie; its edge label is a range of the mapping
+typedef struct {
+    uint32_t label_offset;
+    uint32_t label_length;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t command;                // Distinct command ending at this node, HISTORY_NONE if none
+    uint32_t latest;                 // Newest entry of any command at or below this node
+    char first_byte;                 // First byte of the label, so looking for a child stays in the node array
+} HistoryNode;
+
+// Structure to hold the distinct commands containing the trigrams of one bucket
+typedef struct {
+    uint32_t *commands;              // Ascending, each command once
+    uint32_t count;
+    uint32_t capacity;
+} HistoryPostings;
+
+// Structure to hold a history file and its indexes
+struct History {
+    int fd;
+    const char *data;                // Mapping of the file, NULL while nothing is mapped
+    size_t mapped_size;
+    size_t indexed_size;             // Bytes of complete lines indexed so far
+    HistoryEntry *entries;
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+    HistoryCommand *commands;
+    uint32_t command_count;
+    uint32_t command_capacity;
+    uint32_t *command_table;         // Open addressing by hash, HISTORY_NONE in free slots
+    uint32_t table_size;             // Power of two, at least twice command_count
+    HistoryNode *nodes;              // nodes[0] is the root, the empty prefix
+    uint32_t node_count;
+    uint32_t node_capacity;
+    uint32_t trie_indexed;           // Distinct commands already in the trie
+    HistoryPostings *trigrams;       // HISTORY_TRIGRAM_BUCKETS lists
+    uint32_t trigram_indexed;        // Distinct commands already in the substring index
+};
+
+// Make room for one more element in a growing array, returns 0 or -1 if memory runs out
+static int reserve_one(void **array, uint32_t count, uint32_t *capacity, size_t element_size) {
+    if (count < *capacity) return 0;
+    uint32_t new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+    void *grown = realloc(*array, (size_t)new_capacity * element_size);
+    if (grown == NULL) return -1;
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Return the FNV-1a hash of a line
+static uint32_t hash_line(const char *text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Return the bucket of the trigram starting at text
+static uint32_t trigram_bucket(const char *text) {
+    const unsigned char *bytes = (const unsigned char *)text;
+    uint32_t trigram = bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16;
+    return (trigram * 2654435761u) >> (32 - HISTORY_TRIGRAM_BITS); // Multiplicative hashing
+}
+
+// Return the text of a distinct command, from its newest entry
+static const char *command_text(const History *history, uint32_t command, size_t *length) {
+    return history_entry_text(history, history->commands[command].latest, length);
+}
+
+// Find the slot of a line in the command table: the slot holding its command, or the free slot it would take
+static uint32_t find_slot(const History *history, const char *text, size_t length, uint32_t hash) {
+    uint32_t mask = history->table_size - 1;
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        uint32_t command = history->command_table[slot];
+        if (command == HISTORY_NONE) return slot;
+
+        size_t command_length;
+        const char *command_start = command_text(history, command, &command_length);
+        if (history->commands[command].hash == hash && command_length == length &&
+            memcmp(command_start, text, length) == 0) {
+            return slot;
+        }
+    }
+}
+
+// Double the command table, returns 0 or -1 if memory runs out
+static int grow_command_table(History *history) {
+    uint32_t size = history->table_size == 0 ? 1024 : history->table_size * 2;
+    uint32_t *table = malloc(size * sizeof(uint32_t));
+    if (table == NULL) return -1;
+    memset(table, 0xff, size * sizeof(uint32_t)); // Every slot HISTORY_NONE
+
+    for (uint32_t command = 0; command < history->command_count; command++) {
+        uint32_t slot = history->commands[command].hash & (size - 1);
+        while (table[slot] != HISTORY_NONE) slot = (slot + 1) & (size - 1);
+        table[slot] = command;
+    }
+    free(history->command_table);
+    history->command_table = table;
+    history->table_size = size;
+    return 0;
+}
+
+// Append a trie node, returns its index or HISTORY_NONE if memory runs out
+static uint32_t add_node(History *history, uint32_t label_offset, uint32_t label_length, uint32_t latest) {
+    if (reserve_one((void **)&history->nodes, history->node_count, &history->node_capacity, sizeof(HistoryNode)) < 0) {
+        return HISTORY_NONE;
+    }
+    HistoryNode *node = &history->nodes[history->node_count];
+    node->label_offset = label_offset;
+    node->label_length = label_length;
+    node->first_child = HISTORY_NONE;
+    node->next_sibling = HISTORY_NONE;
+    node->command = HISTORY_NONE;
+    node->latest = latest;
+    node->first_byte = label_length > 0 ? history->data[label_offset] : '\0';
+    return history->node_count++;
+}
+
+// Find the child of a node whose label starts with byte, returns HISTORY_NONE if there is none;
+// link (if not NULL) is set to the field that points to the child
+static uint32_t find_child(const History *history, uint32_t node, char byte, uint32_t **link) {
+    uint32_t *child = &history->nodes[node].first_child;
+    while (*child != HISTORY_NONE) {
+        if (history->nodes[*child].first_byte == byte) break;
+        child = &history->nodes[*child].next_sibling;
+    }
+    if (link != NULL) *link = child;
+    return *child;
+}
+
+// Insert a distinct command, whose newest entry is latest, into the trie; returns its node or HISTORY_NONE
+static uint32_t trie_insert(History *history, uint32_t offset, uint32_t length, uint32_t latest) {
+    const char *text = history->data + offset;
+    uint32_t node = 0, position = 0;
+
+    while (1) {
+        // Commands are inserted in the order they were first seen, not the order they were last used
+        HistoryNode *current = &history->nodes[node];
+        if (current->latest == HISTORY_NONE || latest > current->latest) current->latest = latest;
+        if (position == length) return node;
+
+        uint32_t *link;
+        uint32_t child = find_child(history, node, text[position], &link);
+        if (child == HISTORY_NONE) {
+            // Nothing shares the rest of the line: it becomes the label of a new leaf
+            uint32_t leaf = add_node(history, offset + position, length - position, latest);
+            if (leaf == HISTORY_NONE) return HISTORY_NONE;
+            history->nodes[leaf].next_sibling = history->nodes[node].first_child;
+            history->nodes[node].first_child = leaf;
+            return leaf;
+        }
+
+        // Follow the label as far as the line agrees with it
+        HistoryNode *edge = &history->nodes[child];
+        const char *label = history->data + edge->label_offset;
+        uint32_t common = 1;
+        while (common < edge->label_length && position + common < length && label[common] == text[position + common]) {
+            common++;
+        }
+        if (common < edge->label_length) {
+            // Split the edge where the line leaves it; the loop then raises the new node's latest
+            uint32_t middle = add_node(history, edge->label_offset, common, edge->latest);
+            if (middle == HISTORY_NONE) return HISTORY_NONE;
+            find_child(history, node, text[position], &link); // The node array may have moved
+            edge = &history->nodes[child];
+            history->nodes[middle].first_child = child;
+            history->nodes[middle].next_sibling = edge->next_sibling;
+            edge->next_sibling = HISTORY_NONE;
+            edge->label_offset += common;
+            edge->label_length -= common;
+            edge->first_byte = history->data[edge->label_offset];
+            *link = middle;
+            child = middle;
+        }
+        node = child;
+        position += common;
+    }
+}
+
+// Make entry, the newest of all, the latest of every node on the path of a command already in the trie
+static void raise_latest(History *history, const char *text, size_t length, uint32_t entry) {
+    uint32_t node = 0;
+    size_t position = 0;
+
+    history->nodes[0].latest = entry;
+    while (position < length) {
+        node = find_child(history, node, text[position], NULL);
+        history->nodes[node].latest = entry;
+        position += history->nodes[node].label_length;
+    }
+}
+
+// Add a distinct command first seen at entry, returns it or HISTORY_NONE
+static uint32_t add_command(History *history, uint32_t slot, uint32_t hash, uint32_t entry) {
+    if (reserve_one((void **)&history->commands, history->command_count, &history->command_capacity,
+                    sizeof(HistoryCommand)) < 0) {
+        return HISTORY_NONE;
+    }
+    uint32_t command = history->command_count++;
+    history->commands[command].latest = entry;
+    history->commands[command].hash = hash;
+    history->command_table[slot] = command;
+    return command;
+}
+
+// Index the complete lines between indexed_size and the end of the mapping
+static void index_new_lines(History *history) {
+    size_t position = history->indexed_size;
+    size_t end = history->mapped_size < UINT32_MAX ? history->mapped_size : UINT32_MAX; // Offsets are 32-bit
+
+    while (position < end) {
+        const char *text = history->data + position;
+        const char *newline = memchr(text, '\n', end - position);
+        if (newline == NULL) break; // Another shell is still writing the line
+        size_t length = newline - text;
+
+        // Longer lines are no commands anyone typed, and would only deepen the trie
+        if (length > 0 && length <= HISTORY_LINE_MAX &&
+            reserve_one((void **)&history->entries, history->entry_count, &history->entry_capacity,
+                        sizeof(HistoryEntry)) == 0 &&
+            (2 * (history->command_count + 1) <= history->table_size || grow_command_table(history) == 0)) {
+            uint32_t entry = history->entry_count;
+            uint32_t hash = hash_line(text, length);
+            uint32_t slot = find_slot(history, text, length, hash);
+            uint32_t command = history->command_table[slot];
+            if (command == HISTORY_NONE) {
+                command = add_command(history, slot, hash, entry);
+            } else {
+                // A command not in the trie yet takes its latest entry along when it is inserted
+                history->commands[command].latest = entry;
+                if (command < history->trie_indexed) raise_latest(history, text, length, entry);
+            }
+            if (command != HISTORY_NONE) {
+                history->entries[entry] = (HistoryEntry){ (uint32_t)position, (uint32_t)length, command };
+                history->entry_count++;
+            }
+        }
+        position += length + 1;
+    }
+    history->indexed_size = position;
+}
+
+// Drop every index, as if the file had never been read
+static void reset_indexes(History *history) {
+    history->entry_count = 0;
+    history->command_count = 0;
+    memset(history->command_table, 0xff, history->table_size * sizeof(uint32_t));
+    history->node_count = 1;
+    history->nodes[0].first_child = HISTORY_NONE;
+    history->nodes[0].command = HISTORY_NONE;
+    history->nodes[0].latest = HISTORY_NONE;
+    history->trie_indexed = 0;
+    for (int i = 0; i < HISTORY_TRIGRAM_BUCKETS; i++) {
+        history->trigrams[i].count = 0;
+    }
+    history->trigram_indexed = 0;
+    history->indexed_size = 0;
+}
+
+// Index what other shells appended
+void history_refresh(History *history) {
+    struct stat status;
+    if (fstat(history->fd, &status) < 0) return;
+    size_t size = status.st_size;
+
+    if (size < history->indexed_size) {
+        // The file was truncated or replaced; start over
+        reset_indexes(history);
+    }
+    if (size == history->mapped_size) return;
+
+    // The indexes hold offsets, so the mapping is free to move. The old mapping is kept until the new one
+    // exists, since the indexes still refer into it if mapping the new size fails.
+    void *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_SHARED, history->fd, 0);
+        if (data == MAP_FAILED) return;
+    }
+    if (history->data != NULL) munmap((void *)history->data, history->mapped_size);
+    history->data = data;
+    history->mapped_size = size;
+    index_new_lines(history);
+}
+
+// Insert the next slice of distinct commands into the trie
+static void index_trie_slice(History *history) {
+    uint32_t last = history->trie_indexed + HISTORY_INDEX_SLICE;
+    if (last > history->command_count) last = history->command_count;
+
+    for (uint32_t command = history->trie_indexed; command < last; command++) {
+        size_t length;
+        const char *text = command_text(history, command, &length);
+        uint32_t node = trie_insert(history, text - history->data, length, history->commands[command].latest);
+        if (node != HISTORY_NONE) history->nodes[node].command = command; // Else out of memory: prefix recall misses it
+    }
+    history->trie_indexed = last;
+}
+
+// Add the next slice of distinct commands to the trigram index
+static void index_trigram_slice(History *history) {
+    uint32_t last = history->trigram_indexed + HISTORY_INDEX_SLICE;
+    if (last > history->command_count) last = history->command_count;
+
+    for (uint32_t command = history->trigram_indexed; command < last; command++) {
+        size_t length;
+        const char *text = command_text(history, command, &length);
+        for (size_t i = 0; i + 3 <= length; i++) {
+            HistoryPostings *postings = &history->trigrams[trigram_bucket(text + i)];
+            if (postings->count > 0 && postings->commands[postings->count - 1] == command) continue;
+            if (reserve_one((void **)&postings->commands, postings->count, &postings->capacity, sizeof(uint32_t)) < 0) {
+                break; // Out of memory: substring recall will miss this command
+            }
+            postings->commands[postings->count++] = command;
+        }
+    }
+    history->trigram_indexed = last;
+}
+
+// Add the next slice of distinct commands to the trie, or once it is complete to the trigram index
+int history_index_step(History *history) {
+    if (history->trie_indexed < history->command_count) {
+        index_trie_slice(history);
+    } else if (history->trigram_indexed < history->command_count) {
+        index_trigram_slice(history);
+    }
+    return history->trie_indexed < history->command_count || history->trigram_indexed < history->command_count;
+}
+
+// Open and index a history file
+History *history_open(const char *path) {
+    History *history = calloc(1, sizeof(History));
+    if (history == NULL) return NULL;
+
+    history->trigrams = calloc(HISTORY_TRIGRAM_BUCKETS, sizeof(HistoryPostings));
+    history->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history->trigrams == NULL || history->fd < 0 || grow_command_table(history) < 0 ||
+        add_node(history, 0, 0, HISTORY_NONE) == HISTORY_NONE) {
+        history_close(history);
+        return NULL;
+    }
+    history_refresh(history);
+    return history;
+}
+
+// Name a history file in the user's home directory
+int history_default_path(const char *file_name, char *path, size_t capacity) {
+    const char *home = getenv("HOME");
+    if (home == NULL || home[0] == '\0') return -1;
+    int written = snprintf(path, capacity, "%s/%s", home, file_name);
+    return written > 0 && (size_t)written < capacity ? 0 : -1;
+}
+
+// Close a history file and free its indexes
+void history_close(History *history) {
+    if (history == NULL) return;
+    if (history->data != NULL) munmap((void *)history->data, history->mapped_size);
+    if (history->fd >= 0) close(history->fd);
+    if (history->trigrams != NULL) {
+        for (int i = 0; i < HISTORY_TRIGRAM_BUCKETS; i++) {
+            free(history->trigrams[i].commands);
+        }
+    }
+    free(history->trigrams);
+    free(history->entries);
+    free(history->commands);
+    free(history->command_table);
+    free(history->nodes);
+    free(history);
+}
+
+// Append a line under an exclusive lock, so lines of concurrent shells never interleave
+int history_add(History *history, const char *line) {
+    size_t length = strcspn(line, "\n");
+    if (length == 0) return 0;
+
+    struct iovec iov[2] = { { (void *)line, length }, { "\n", 1 } };
+    while (flock(history->fd, LOCK_EX) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    ssize_t written = writev(history->fd, iov, 2); // O_APPEND puts it at the end, wherever that is now
+    flock(history->fd, LOCK_UN);
+    if (written != (ssize_t)length + 1) return -1;
+
+    history_refresh(history);
+    return 0;
+}
+
+// Return the number of entries
+uint32_t history_entry_count(const History *history) {
+    return history->entry_count;
+}
+
+// Return the text of an entry
+const char *history_entry_text(const History *history, uint32_t entry, size_t *length) {
+    *length = history->entries[entry].length;
+    return history->data + history->entries[entry].offset;
+}
+
+// Return the newest entry below node older than before, HISTORY_NONE if there is none. Subtrees
+// entirely older than before are answered by their latest entry, so only the paths to commands
+// already stepped past are descended.
+static uint32_t newest_below(const History *history, uint32_t node, uint32_t before) {
+    const HistoryNode *current = &history->nodes[node];
+    if (current->latest < before) return current->latest;
+
+    uint32_t best = HISTORY_NONE;
+    if (current->command != HISTORY_NONE && history->commands[current->command].latest < before) {
+        best = history->commands[current->command].latest;
+    }
+    for (uint32_t child = current->first_child; child != HISTORY_NONE; child = history->nodes[child].next_sibling) {
+        uint32_t found = newest_below(history, child, before);
+        if (found != HISTORY_NONE && (best == HISTORY_NONE || found > best)) best = found;
+    }
+    return best;
+}
+
+// Find the newest entry starting with prefix
+uint32_t history_find_prefix(History *history, const char *prefix, size_t length, uint32_t before) {
+    uint32_t node = 0;
+    size_t position = 0;
+
+    // Finish the trie if the editor had no time to
+    while (history->trie_indexed < history->command_count) index_trie_slice(history);
+
+    // Walk down to the node whose subtree holds every command starting with prefix
+    while (position < length) {
+        uint32_t child = find_child(history, node, prefix[position], NULL);
+        if (child == HISTORY_NONE) return HISTORY_NONE;
+        const HistoryNode *edge = &history->nodes[child];
+        size_t compared = length - position < edge->label_length ? length - position : edge->label_length;
+        if (memcmp(history->data + edge->label_offset, prefix + position, compared) != 0) return HISTORY_NONE;
+        position += compared;
+        node = child;
+    }
+    return newest_below(history, node, before);
+}
+
+// Check whether an entry contains the pattern
+static int entry_contains(const History *history, uint32_t entry, const char *pattern, size_t length) {
+    const HistoryEntry *line = &history->entries[entry];
+    return memmem(history->data + line->offset, line->length, pattern, length) != NULL;
+}
+
+// Find the newest entry containing pattern
+uint32_t history_find_substring(History *history, const char *pattern, size_t length, uint32_t before) {
+    if (length == 0) return HISTORY_NONE;
+    if (before > history->entry_count) before = history->entry_count;
+
+    if (length < 3) {
+        // Too short for the trigram index; scan back from before
+        for (uint32_t entry = before; entry-- > 0;) {
+            if (history->commands[history->entries[entry].command].latest == entry &&
+                entry_contains(history, entry, pattern, length)) {
+                return entry;
+            }
+        }
+        return HISTORY_NONE;
+    }
+
+    // Finish the index if the editor had no time to
+    while (history->trigram_indexed < history->command_count) index_trigram_slice(history);
+
+    // Every match contains all trigrams of the pattern, so the shortest list holds them all
+    const HistoryPostings *rarest = &history->trigrams[trigram_bucket(pattern)];
+    for (size_t i = 1; i + 3 <= length; i++) {
+        const HistoryPostings *postings = &history->trigrams[trigram_bucket(pattern + i)];
+        if (postings->count < rarest->count) rarest = postings;
+    }
+
+    uint32_t best = HISTORY_NONE;
+    for (uint32_t i = 0; i < rarest->count; i++) {
+        uint32_t entry = history->commands[rarest->commands[i]].latest;
+        if (entry < before && (best == HISTORY_NONE || entry > best) && entry_contains(history, entry, pattern, length)) {
+            best = entry;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,46 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTORY_NONE UINT32_MAX   // Returned by the searches when nothing (older) matches
+#define HISTORY_TRIGRAM_BITS 17   // The substring index has 2^bits buckets; a collision only costs a failed check
+#define HISTORY_LINE_MAX 4096     // Longer lines of the file are skipped
+
+typedef struct History History;
+
+// Function to open (creating it if needed) and index a history file, returns NULL on failure
+History *history_open(const char *path);
+
+// Function to fill path with the name of a history file in the user's home directory, returns 0 or -1
+int history_default_path(const char *file_name, char *path, size_t capacity);
+
+// Function to close a history file and free its indexes
+void history_close(History *history);
+
+// Function to append a line to the file, safe against other shells appending at the same time, and index it
+int history_add(History *history, const char *line);
+
+// Function to index the lines other shells appended since the last call
+void history_refresh(History *history);
+
+// Function to add a slice of the commands not yet in the substring index to it, returns 1 while some are left.
+// Call it while waiting for input; a substring search finishes the index itself.
+int history_index_step(History *history);
+
+// Function to return the number of entries; entries are numbered from 0, oldest first
+uint32_t history_entry_count(const History *history);
+
+// Function to return the text of an entry, which is not null-terminated
+const char *history_entry_text(const History *history, uint32_t entry, size_t *length);
+
+// Function to find the newest entry older than entry number before that starts with prefix, counting
+// each distinct command only at its newest entry; returns the entry or HISTORY_NONE
+uint32_t history_find_prefix(History *history, const char *prefix, size_t length, uint32_t before);
+
+// Function to find the newest entry older than entry number before that contains pattern, counting
+// each distinct command only at its newest entry; returns the entry or HISTORY_NONE
+uint32_t history_find_substring(History *history, const char *pattern, size_t length, uint32_t before);
+
+#endif
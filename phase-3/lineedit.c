@@ -0,0 +1,528 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "lineedit.h"
+
+// The editor keeps the terminal raw only while a line is being read, so commands run with the
+// terminal as the user configured it. The line is redrawn on a single row, scrolled horizontally
+// when it is wider than the terminal. While no key is pending, the history indexes are built a
+// slice at a time, so recall is instant by the time the user reaches for it.
+
+#define CONTROL_KEY(key) ((key) & 0x1f)
+#define SEARCH_PATTERN_MAX 256   // Longest Ctrl+R pattern
+#define COMPLETION_LIST_MAX 100  // Candidates listed when Tab is pressed again
+
+// Keys that arrive as escape sequences
+enum {
+    KEY_EOF = -1,
+    KEY_NONE = 0,                // Ignored sequence
+    KEY_UP = 256,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE
+};
+
+// Structure to hold the state of the line being edited
+typedef struct {
+    char *buffer;                // The caller's line, kept null-terminated
+    size_t capacity;
+    size_t length;
+    size_t cursor;
+    const char *prompt;
+    size_t columns;              // Terminal width
+    History *history;
+    char *typed;                 // The line as typed before recall replaced it
+    size_t typed_length;
+    uint32_t *trail;             // Entries recalled so far, newest first; Down walks back along it
+    size_t trail_count;
+    size_t trail_capacity;
+} LineEditor;
+
+// Called on Tab, set by line_editor_set_completer
+static LineCompleter line_completer = NULL;
+static void *completer_context = NULL;
+
+// Write all of an output vector, returns 0 or -1 on a write error
+static int write_all(struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Write a string to the terminal
+static void write_text(const char *text) {
+    struct iovec iov = { (void *)text, strlen(text) };
+    write_all(&iov, 1);
+}
+
+// Return the width of the terminal
+static size_t terminal_columns(void) {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || size.ws_col == 0) return 80;
+    return size.ws_col;
+}
+
+// Redraw the prompt and the text, with the cursor at position; the text scrolls to keep the cursor visible
+static void redraw(const LineEditor *editor, const char *prompt, const char *text, size_t length, size_t position) {
+    size_t prompt_length = strlen(prompt);
+    size_t room = editor->columns > prompt_length + 1 ? editor->columns - prompt_length - 1 : 1;
+
+    if (position > room) {
+        text += position - room;
+        length -= position - room;
+        position = room;
+    }
+    if (length > room) length = room;
+
+    // One write, so the line never flickers half drawn
+    char move[32];
+    int move_length = 0;
+    if (position < length) move_length = snprintf(move, sizeof(move), "\x1b[%zuD", length - position);
+    struct iovec iov[5] = {
+        { "\r", 1 },
+        { (void *)prompt, prompt_length },
+        { (void *)text, length },
+        { "\x1b[K", 3 },             // Clear what is left of a longer line
+        { move, move_length }
+    };
+    write_all(iov, 5);
+}
+
+// Redraw the line being edited
+static void refresh_line(const LineEditor *editor) {
+    redraw(editor, editor->prompt, editor->buffer, editor->length, editor->cursor);
+}
+
+// Read a key, building the history indexes until one arrives; escape sequences become KEY_ values
+static int read_key(History *history) {
+    struct pollfd input = { .fd = STDIN_FILENO, .events = POLLIN };
+    while (history != NULL && poll(&input, 1, 0) == 0 && history_index_step(history));
+
+    unsigned char bytes[8];
+    ssize_t received;
+    while ((received = read(STDIN_FILENO, bytes, 1)) < 0 && errno == EINTR);
+    if (received <= 0) return KEY_EOF;
+    if (bytes[0] != 0x1b) return bytes[0];
+
+    // A lone Escape is not followed by anything within a moment
+    if (poll(&input, 1, 50) <= 0 || read(STDIN_FILENO, bytes + 1, 1) != 1) return KEY_NONE;
+    if (bytes[1] != '[' && bytes[1] != 'O') return KEY_NONE;
+
+    // Read up to the final byte of the sequence
+    size_t count = 2;
+    do {
+        if (poll(&input, 1, 50) <= 0 || read(STDIN_FILENO, bytes + count, 1) != 1) return KEY_NONE;
+    } while (bytes[count] < 0x40 && ++count < sizeof(bytes));
+    if (count == sizeof(bytes)) return KEY_NONE;
+
+    switch (bytes[count]) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            // ESC [ n ~, for the keys of the editing pad
+            if (count != 3) return KEY_NONE;
+            if (bytes[2] == '1' || bytes[2] == '7') return KEY_HOME;
+            if (bytes[2] == '4' || bytes[2] == '8') return KEY_END;
+            if (bytes[2] == '3') return KEY_DELETE;
+            return KEY_NONE;
+        default:
+            return KEY_NONE;
+    }
+}
+
+// Replace the line with text, cut to fit, with the cursor at its end
+static void set_line(LineEditor *editor, const char *text, size_t length) {
+    if (length > editor->capacity - 1) length = editor->capacity - 1;
+    memmove(editor->buffer, text, length);
+    editor->buffer[length] = '\0';
+    editor->length = length;
+    editor->cursor = length;
+}
+
+// Replace the line with a history entry
+static void set_line_from_entry(LineEditor *editor, uint32_t entry) {
+    size_t length;
+    const char *text = history_entry_text(editor->history, entry, &length);
+    set_line(editor, text, length);
+}
+
+// Insert a character at the cursor
+static void insert_character(LineEditor *editor, char character) {
+    if (editor->length + 1 >= editor->capacity) {
+        write_text("\a");
+        return;
+    }
+    memmove(editor->buffer + editor->cursor + 1, editor->buffer + editor->cursor, editor->length - editor->cursor + 1);
+    editor->buffer[editor->cursor++] = character;
+    editor->length++;
+}
+
+// Delete count characters starting at position
+static void delete_range(LineEditor *editor, size_t position, size_t count) {
+    memmove(editor->buffer + position, editor->buffer + position + count, editor->length - position - count + 1);
+    editor->length -= count;
+    if (editor->cursor > position + count) {
+        editor->cursor -= count;
+    } else if (editor->cursor > position) {
+        editor->cursor = position;
+    }
+}
+
+// Recall the next older line starting with what was typed, returns 0 if there is none
+static int recall_older(LineEditor *editor) {
+    if (editor->history == NULL) return 0;
+
+    if (editor->trail_count == 0) {
+        // The first press fixes the prefix
+        free(editor->typed);
+        editor->typed = malloc(editor->length + 1);
+        if (editor->typed == NULL) return 0;
+        memcpy(editor->typed, editor->buffer, editor->length + 1);
+        editor->typed_length = editor->length;
+    }
+    uint32_t before = editor->trail_count > 0 ? editor->trail[editor->trail_count - 1]
+                                              : history_entry_count(editor->history);
+    uint32_t entry = history_find_prefix(editor->history, editor->typed, editor->typed_length, before);
+    if (entry == HISTORY_NONE) return 0;
+
+    if (editor->trail_count == editor->trail_capacity) {
+        size_t capacity = editor->trail_capacity == 0 ? 64 : editor->trail_capacity * 2;
+        uint32_t *trail = realloc(editor->trail, capacity * sizeof(uint32_t));
+        if (trail == NULL) return 0;
+        editor->trail = trail;
+        editor->trail_capacity = capacity;
+    }
+    editor->trail[editor->trail_count++] = entry;
+    set_line_from_entry(editor, entry);
+    return 1;
+}
+
+// Go back to the newer line recalled before, or to the typed line; returns 0 if recall is not active
+static int recall_newer(LineEditor *editor) {
+    if (editor->trail_count == 0) return 0;
+
+    if (--editor->trail_count > 0) {
+        set_line_from_entry(editor, editor->trail[editor->trail_count - 1]);
+    } else {
+        set_line(editor, editor->typed, editor->typed_length);
+    }
+    return 1;
+}
+
+// Search the history for lines containing a pattern as it is typed. Returns the key that ended the
+// search, to be handled as usual, with the match left in the line; KEY_NONE if the search was aborted.
+static int reverse_search(LineEditor *editor) {
+    char pattern[SEARCH_PATTERN_MAX];
+    size_t pattern_length = 0;
+    uint32_t match = HISTORY_NONE;
+    int failed = 0;
+
+    // Aborting restores the line as it was
+    char *original = malloc(editor->length + 1);
+    if (original == NULL) return KEY_NONE;
+    memcpy(original, editor->buffer, editor->length + 1);
+    size_t original_length = editor->length;
+
+    while (1) {
+        char prompt[SEARCH_PATTERN_MAX + 32];
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ", failed ? "failed " : "",
+                 (int)pattern_length, pattern);
+        size_t position = editor->length;
+        if (match != HISTORY_NONE && pattern_length > 0) {
+            // Put the cursor on the pattern in the match
+            const char *found = memmem(editor->buffer, editor->length, pattern, pattern_length);
+            if (found != NULL) position = found - editor->buffer;
+        }
+        redraw(editor, prompt, editor->buffer, editor->length, position);
+
+        int key = read_key(editor->history);
+        uint32_t before = history_entry_count(editor->history);
+        if (key == CONTROL_KEY('r')) {
+            // The next older match
+            if (match != HISTORY_NONE) before = match;
+        } else if (key == 127 || key == CONTROL_KEY('h')) {
+            if (pattern_length > 0) pattern_length--;
+        } else if (key >= 32 && key < 127) {
+            if (pattern_length < sizeof(pattern)) pattern[pattern_length++] = (char)key;
+            if (match != HISTORY_NONE) before = match + 1; // A longer pattern may still match the current line
+        } else if (key == CONTROL_KEY('g') || key == CONTROL_KEY('c')) {
+            set_line(editor, original, original_length);
+            free(original);
+            return KEY_NONE;
+        } else {
+            editor->cursor = position;
+            free(original);
+            return key;
+        }
+
+        uint32_t entry = pattern_length > 0 ? history_find_substring(editor->history, pattern, pattern_length, before)
+                                            : HISTORY_NONE;
+        failed = pattern_length > 0 && entry == HISTORY_NONE;
+        if (entry != HISTORY_NONE) {
+            match = entry;
+            set_line_from_entry(editor, entry);
+        } else if (pattern_length == 0) {
+            match = HISTORY_NONE;
+            set_line(editor, original, original_length);
+        }
+    }
+}
+
+// Return the part of a candidate to list: its last path component
+static const char *candidate_name(const char *candidate) {
+    const char *name = candidate;
+    for (const char *character = candidate; character[0] != '\0' && character[1] != '\0'; character++) {
+        if (*character == '/') name = character + 1;
+    }
+    return name;
+}
+
+// List candidates in columns below the line
+static void list_candidates(const LineEditor *editor, const char *candidates, size_t count) {
+    size_t shown = count < COMPLETION_LIST_MAX ? count : COMPLETION_LIST_MAX;
+    size_t width = 0;
+    const char *candidate = candidates;
+    for (size_t i = 0; i < shown; i++) {
+        size_t length = strlen(candidate_name(candidate));
+        if (length + 2 > width) width = length + 2;
+        candidate += strlen(candidate) + 1;
+    }
+    size_t per_row = editor->columns / width > 0 ? editor->columns / width : 1;
+
+    // One write for the whole list
+    char *text = malloc(shown * (width + 2) + 64);
+    if (text == NULL) return;
+    size_t length = 0;
+    text[length++] = '\r';
+    text[length++] = '\n';
+    candidate = candidates;
+    for (size_t i = 0; i < shown; i++) {
+        const char *name = candidate_name(candidate);
+        size_t name_length = strlen(name);
+        memcpy(text + length, name, name_length);
+        length += name_length;
+        if ((i + 1) % per_row == 0 || i + 1 == shown) {
+            text[length++] = '\r';
+            text[length++] = '\n';
+        } else {
+            memset(text + length, ' ', width - name_length);
+            length += width - name_length;
+        }
+        candidate += strlen(candidate) + 1;
+    }
+    if (shown < count) length += snprintf(text + length, 64, "(%zu more)\r\n", count - shown);
+
+    struct iovec iov = { text, length };
+    write_all(&iov, 1);
+    free(text);
+}
+
+// Complete the word before the cursor with what all candidates share; if that adds nothing, list them
+// when Tab was pressed twice
+static void complete_word(LineEditor *editor, int repeated) {
+    size_t word_start;
+    const char *candidates;
+    size_t count = line_completer(editor->buffer, editor->cursor, &word_start, &candidates, completer_context);
+    if (count == 0) {
+        write_text("\a");
+        return;
+    }
+
+    // The longest prefix of every candidate
+    size_t common = strlen(candidates);
+    const char *candidate = candidates;
+    for (size_t i = 1; i < count; i++) {
+        candidate += strlen(candidate) + 1;
+        size_t shared = 0;
+        while (shared < common && candidate[shared] == candidates[shared]) shared++;
+        common = shared;
+    }
+
+    size_t word_length = editor->cursor - word_start;
+    if (common > word_length || (count == 1 && memcmp(editor->buffer + word_start, candidates, common) == 0)) {
+        delete_range(editor, word_start, word_length);
+        for (size_t i = 0; i < common; i++) {
+            insert_character(editor, candidates[i]);
+        }
+
+        // A single command or file is complete, a directory goes on
+        if (count == 1 && candidates[common - 1] != '/' && editor->buffer[editor->cursor] != ' ') {
+            insert_character(editor, ' ');
+        }
+    } else if (repeated) {
+        list_candidates(editor, candidates, count);
+    } else {
+        write_text("\a");
+    }
+}
+
+// Edit a line on the raw terminal, returns 1 once it is entered or 0 at end of input
+static int edit_line(LineEditor *editor) {
+    int previous_key = KEY_NONE;
+    refresh_line(editor);
+
+    while (1) {
+        int key = read_key(editor->history);
+        if (key == CONTROL_KEY('r') && editor->history != NULL) {
+            key = reverse_search(editor);
+        }
+
+        // Every key but recall ends it, so the next Up starts from what is then on the line
+        if (key != KEY_UP && key != KEY_DOWN && key != CONTROL_KEY('p') && key != CONTROL_KEY('n')) {
+            editor->trail_count = 0;
+        }
+
+        switch (key) {
+            case KEY_EOF:
+                return 0;
+            case '\r':
+            case '\n':
+                editor->cursor = editor->length;
+                refresh_line(editor);
+                write_text("\r\n");
+                return 1;
+            case CONTROL_KEY('d'):
+                if (editor->length == 0) return 0;
+                // Otherwise it deletes like Delete
+                __attribute__((fallthrough));
+            case KEY_DELETE:
+                if (editor->cursor < editor->length) delete_range(editor, editor->cursor, 1);
+                break;
+            case 127:
+            case CONTROL_KEY('h'):
+                if (editor->cursor > 0) delete_range(editor, editor->cursor - 1, 1);
+                break;
+            case CONTROL_KEY('c'):
+                // Abandon the line
+                write_text("^C\r\n");
+                set_line(editor, "", 0);
+                break;
+            case CONTROL_KEY('a'):
+            case KEY_HOME:
+                editor->cursor = 0;
+                break;
+            case CONTROL_KEY('e'):
+            case KEY_END:
+                editor->cursor = editor->length;
+                break;
+            case CONTROL_KEY('b'):
+            case KEY_LEFT:
+                if (editor->cursor > 0) editor->cursor--;
+                break;
+            case CONTROL_KEY('f'):
+            case KEY_RIGHT:
+                if (editor->cursor < editor->length) editor->cursor++;
+                break;
+            case CONTROL_KEY('k'):
+                delete_range(editor, editor->cursor, editor->length - editor->cursor);
+                break;
+            case CONTROL_KEY('u'):
+                delete_range(editor, 0, editor->cursor);
+                break;
+            case CONTROL_KEY('w'): {
+                // Delete the word before the cursor and the spaces after it
+                size_t start = editor->cursor;
+                while (start > 0 && editor->buffer[start - 1] == ' ') start--;
+                while (start > 0 && editor->buffer[start - 1] != ' ') start--;
+                delete_range(editor, start, editor->cursor - start);
+                break;
+            }
+            case '\t':
+                if (line_completer != NULL) {
+                    complete_word(editor, previous_key == '\t');
+                } else {
+                    write_text("\a");
+                }
+                break;
+            case CONTROL_KEY('l'):
+                write_text("\x1b[H\x1b[2J");
+                break;
+            case CONTROL_KEY('p'):
+            case KEY_UP:
+                if (!recall_older(editor)) write_text("\a");
+                break;
+            case CONTROL_KEY('n'):
+            case KEY_DOWN:
+                if (!recall_newer(editor)) write_text("\a");
+                break;
+            default:
+                if (key >= 32 && key < 127) insert_character(editor, (char)key);
+                break;
+        }
+        previous_key = key;
+        refresh_line(editor);
+    }
+}
+
+// Set the completer
+void line_editor_set_completer(LineCompleter completer, void *context) {
+    line_completer = completer;
+    completer_context = context;
+}
+
+// Read a line
+int line_editor_read(const char *prompt, char *line, size_t capacity, History *history) {
+    fflush(stdout);
+    struct termios saved;
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || tcgetattr(STDIN_FILENO, &saved) < 0) {
+        printf("%s", prompt);
+        fflush(stdout); // Ensure the prompt is displayed immediately
+        if (!fgets(line, capacity, stdin)) return 0;
+        line[strcspn(line, "\n")] = '\0';
+        return 1;
+    }
+
+    // Keys arrive one at a time and unechoed; Ctrl+C and Ctrl+Z are plain keys while editing
+    struct termios raw = saved;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    // Lines other shells added since the last prompt can be recalled too
+    if (history != NULL) history_refresh(history);
+
+    LineEditor editor = {
+        .buffer = line,
+        .capacity = capacity,
+        .prompt = prompt,
+        .columns = terminal_columns(),
+        .history = history
+    };
+    line[0] = '\0';
+    int entered = edit_line(&editor);
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    free(editor.typed);
+    free(editor.trail);
+    return entered;
+}
@@ -0,0 +1,22 @@
+#ifndef LINEEDIT_H
+#define LINEEDIT_H
+
+#include <stddef.h>
+#include "history.h"
+
+// Function type of completers: finds the word that ends at cursor, sets *word_start to where it begins and
+// returns the number of candidates to replace it with, stored back to back and each null-terminated in
+// *candidates, which stays owned by the completer. A candidate ending in '/' is not followed by a space.
+typedef size_t (*LineCompleter)(const char *line, size_t cursor, size_t *word_start, const char **candidates,
+                                void *context);
+
+// Function to set the completer Tab calls, NULL to turn completion off
+void line_editor_set_completer(LineCompleter completer, void *context);
+
+// Function to read a line without its newline. On a terminal it is edited in place, with Up/Down
+// recalling older lines starting with what was typed and Ctrl+R searching them incrementally (history
+// may be NULL for no recall); otherwise the prompt is printed and the line read as is. Returns 1, or
+// 0 at end of input.
+int line_editor_read(const char *prompt, char *line, size_t capacity, History *history);
+
+#endif
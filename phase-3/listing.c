@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "listing.h"
+
+// Globbing and completion both search directories by name prefix, so both keep sorted listings; only
+// how they notice a stale listing differs, which is left to them. Entries are read with getdents64 in
+// large batches into one block of text, and sorted once as an array of pointers into it.
+
+#define DIRENT_BUFFER_SIZE 65536   // Bytes of directory entries read per getdents64 call
+
+// Structure of the entries getdents64 returns
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Compare two strings for qsort
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Check whether an entry is a directory; symbolic links, and file systems that do not fill in d_type, need a stat
+static int entry_is_directory(int directory_fd, const char *name, unsigned char type) {
+    if (type != DT_LNK && type != DT_UNKNOWN) return type == DT_DIR;
+    struct stat target;
+    return fstatat(directory_fd, name, &target, 0) == 0 && S_ISDIR(target.st_mode);
+}
+
+// Read and sort the entries of a directory
+int read_sorted_listing(int directory_fd, int flags, SortedListing *listing) {
+    char *buffer = malloc(DIRENT_BUFFER_SIZE);
+    char *text = NULL;
+    size_t length = 0, capacity = 0, count = 0;
+    memset(listing, 0, sizeof(*listing));
+    if (buffer == NULL) goto fail;
+
+    for (;;) {
+        long read_bytes = syscall(SYS_getdents64, directory_fd, buffer, DIRENT_BUFFER_SIZE);
+        if (read_bytes < 0) goto fail;
+        if (read_bytes == 0) break;
+        for (long offset = 0; offset < read_bytes;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            int is_directory = 0;
+            if (flags & (LISTING_MARK_DIRECTORIES | LISTING_EXECUTABLES_ONLY)) {
+                is_directory = entry_is_directory(directory_fd, name, entry->d_type);
+            }
+            if ((flags & LISTING_EXECUTABLES_ONLY) && (is_directory || faccessat(directory_fd, name, X_OK, 0) < 0)) {
+                continue;
+            }
+
+            // The type byte, the name, a '/' for a marked directory and the null
+            size_t name_length = strlen(name);
+            if (length + name_length + 3 > capacity) {
+                size_t new_capacity = capacity == 0 ? 4096 : capacity * 2;
+                while (new_capacity < length + name_length + 3) new_capacity *= 2;
+                char *new_text = realloc(text, new_capacity);
+                if (new_text == NULL) goto fail;
+                text = new_text;
+                capacity = new_capacity;
+            }
+            text[length++] = (char)entry->d_type;
+            memcpy(text + length, name, name_length);
+            length += name_length;
+            if ((flags & LISTING_MARK_DIRECTORIES) && is_directory) text[length++] = '/';
+            text[length++] = '\0';
+            count++;
+        }
+    }
+    free(buffer);
+    buffer = NULL;
+
+    // Point at the names only once text stopped moving
+    const char **names = malloc((count > 0 ? count : 1) * sizeof(char *));
+    if (names == NULL) goto fail;
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        names[i] = text + offset + 1;
+        offset += strlen(names[i]) + 2;
+    }
+    qsort(names, count, sizeof(char *), compare_names);
+
+    listing->text = text;
+    listing->names = names;
+    listing->count = count;
+    return 0;
+
+fail:
+    free(buffer);
+    free(text);
+    return -1;
+}
+
+// Free the entries of a listing
+void free_sorted_listing(SortedListing *listing) {
+    free(listing->text);
+    free(listing->names);
+    memset(listing, 0, sizeof(*listing));
+}
+
+// Binary search for the first name not below the prefix
+size_t find_prefix(const char **names, size_t count, const char *prefix, size_t length) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strncmp(names[middle], prefix, length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
@@ -0,0 +1,30 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <stddef.h>
+
+#define LISTING_MARK_DIRECTORIES 1   // End the names of directories, and of links to them, in '/'
+#define LISTING_EXECUTABLES_ONLY 2   // Leave out directories and the files that cannot be executed
+
+// Structure to hold the entries of a directory in byte order, so the names sharing a prefix are adjacent
+typedef struct {
+    char *text;                  // Each entry as its d_type byte followed by its null-terminated name
+    const char **names;          // Sorted pointers to the names in text, so names[i][-1] is the type
+    size_t count;
+} SortedListing;
+
+// Function to read the entries of an open directory other than "." and ".." into a sorted listing, as the
+// LISTING_ flags ask; returns 0, or -1 with the listing empty if reading or memory failed
+int read_sorted_listing(int directory_fd, int flags, SortedListing *listing);
+
+// Function to free the entries of a listing and leave it empty
+void free_sorted_listing(SortedListing *listing);
+
+// Function to return the index of the first of count sorted names that is not below the prefix of the
+// given length; the names with that prefix follow it
+size_t find_prefix(const char **names, size_t count, const char *prefix, size_t length);
+
+// Function to compare two strings through pointers to them, for qsort
+int compare_names(const void *a, const void *b);
+
+#endif
@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include "histogram.h"
+#include "protocol.h"
+#include "shell.h"
+#include "utilities.h"
+
+#define DEFAULT_PORT 8080       // Port number of the server
+#define MAX_COMMAND_MIX 32      // Maximum number of distinct commands in the mix
+#define CONNECT_BACKOFF_MIN_NS 1000000ULL     // First wait after a failed connect (1 ms)
+#define CONNECT_BACKOFF_MAX_NS 200000000ULL   // Longest wait between connect attempts (200 ms)
+
+// Usage: loadgen [-n connections] [-d seconds] [-r rate] [-c weight:command]... [-p server_pid] [-h host] [-P port]
+//                [-u socket_path] [-S]
+//   Without -r every connection sends its next command as soon as the previous one completes
+//   (closed loop). With -r the connections together send `rate` commands per second on a fixed
+//   schedule (open loop), and latency is measured from the scheduled send time so that a stalled
+//   server is not hidden by the generator slowing down with it.
+//   With -S (connection storm) every command opens a fresh connection and closes it afterwards, so
+//   the run measures how fast the server accepts; connect times are reported separately.
+//   Without -p the server's memory and threads are sampled only if the process holding its
+//   listening socket can be found on this machine.
+
+// Structure to hold one entry of the command mix
+typedef struct {
+    char command[MAX_COMMAND_LENGTH];
+    int weight;
+} MixEntry;
+
+// Structure to hold the settings shared by all connections
+typedef struct {
+    const char *host;
+    int port;
+    const char *socket_path;       // Unix domain socket of the server, NULL for TCP
+    int storm;                     // Open a new connection for every command
+    int connections;
+    double duration;
+    double rate;                   // Total commands per second, 0 for closed loop
+    MixEntry mix[MAX_COMMAND_MIX];
+    int mix_count;
+    int total_weight;
+} LoadConfig;
+
+// Structure to hold the state and results of one connection
+typedef struct {
+    pthread_t thread;
+    int index;
+    const LoadConfig *config;
+    Histogram latency;             // Per-command latency in nanoseconds
+    Histogram connect_latency;     // Time to establish each connection, in nanoseconds
+    uint64_t completed;
+    uint64_t failed;               // Commands that completed with a non-zero exit code
+    uint64_t errors;               // Commands lost to a broken connection or a protocol error
+    uint64_t connect_failures;     // Connection attempts that failed
+} LoadWorker;
+
+// Sleep until the given monotonic time in nanoseconds
+static void sleep_until_ns(uint64_t deadline) {
+    struct timespec ts = { deadline / 1000000000ULL, deadline % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Pick a command from the mix using a per-connection xorshift generator (deterministic per run)
+static const char *pick_command(const LoadConfig *config, uint64_t *random_state) {
+    *random_state ^= *random_state << 13;
+    *random_state ^= *random_state >> 7;
+    *random_state ^= *random_state << 17;
+
+    int ticket = (int)(*random_state % (uint64_t)config->total_weight);
+    for (int i = 0; i < config->mix_count; i++) {
+        ticket -= config->mix[i].weight;
+        if (ticket < 0) return config->mix[i].command;
+    }
+    return config->mix[0].command;
+}
+
+// Send a command and read its output until the completion frame, returns its exit code or -1 on a transport error
+static int run_remote_command(int sock, const char *command, char *buffer) {
+    // Commands get no input, so close their stdin right away
+    if (send_frame(sock, FRAME_COMMAND, command, strlen(command)) < 0 || send_frame(sock, FRAME_STDIN, NULL, 0) < 0) {
+        return -1;
+    }
+
+    while (1) {
+        uint8_t frame_type;
+        uint32_t frame_length;
+        if (recv_frame(sock, &frame_type, buffer, FRAME_MAX_PAYLOAD, &frame_length) <= 0) {
+            return -1;
+        }
+        if (frame_type == FRAME_RESULT) {
+            CommandResult result;
+            if (decode_command_result((uint8_t *)buffer, frame_length, &result) < 0) return -1;
+            return result.exit_code;
+        }
+    }
+}
+
+// Run commands over one connection until the test duration is over
+static void *load_worker_thread(void *arg) {
+    LoadWorker *worker = (LoadWorker *)arg;
+    const LoadConfig *config = worker->config;
+    struct sockaddr_in server_addr;
+    uint64_t random_state = 0x9E3779B97F4A7C15ULL * (worker->index + 1);
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(config->duration * 1e9);
+    uint64_t interval = config->rate > 0 ? (uint64_t)(1e9 * config->connections / config->rate) : 0;
+    // Stagger the open-loop schedules so the connections do not fire in lockstep
+    uint64_t scheduled = start + (interval * worker->index) / config->connections;
+
+    char *buffer = malloc(FRAME_MAX_PAYLOAD);
+    if (buffer == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    int sock = -1;
+    uint64_t backoff = CONNECT_BACKOFF_MIN_NS;
+    while (1) {
+        uint64_t send_time;
+        if (interval > 0) {
+            if (scheduled >= end) break;
+            sleep_until_ns(scheduled);
+            send_time = scheduled;
+            scheduled += interval;
+        } else {
+            send_time = now_ns();
+            if (send_time >= end) break;
+        }
+
+        // (Re)connect lazily so an error only costs the failed command
+        if (sock < 0) {
+            uint64_t connect_start = now_ns();
+            sock = config->socket_path != NULL ? create_unix_client_socket(config->socket_path)
+                                               : create_client_socket(config->port, config->host, &server_addr);
+            if (sock < 0) {
+                // Wait before retrying so a refused connection does not spin; the wait doubles up to a cap
+                // and never runs past the end of the test
+                worker->connect_failures++;
+                uint64_t retry_at = now_ns() + backoff;
+                sleep_until_ns(retry_at < end ? retry_at : end);
+                if (backoff < CONNECT_BACKOFF_MAX_NS) backoff *= 2;
+                continue;
+            }
+            backoff = CONNECT_BACKOFF_MIN_NS;
+            histogram_record(&worker->connect_latency, now_ns() - connect_start);
+        }
+
+        int exit_code = run_remote_command(sock, pick_command(config, &random_state), buffer);
+        if (exit_code < 0) {
+            worker->errors++;
+            close(sock);
+            sock = -1;
+            continue;
+        }
+
+        histogram_record(&worker->latency, now_ns() - send_time);
+        worker->completed++;
+        if (exit_code != 0) worker->failed++;
+
+        if (config->storm) {
+            send_frame(sock, FRAME_COMMAND, "exit", strlen("exit"));
+            close(sock);
+            sock = -1;
+        }
+    }
+
+    if (sock >= 0) {
+        send_frame(sock, FRAME_COMMAND, "exit", strlen("exit"));
+        close(sock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Find the inode of the listening socket for the configured address in /proc/net, returns 0 if there is none.
+// Only a loopback host or a Unix socket is looked up, since a remote server's listener is not in this /proc.
+static unsigned long find_listener_inode(const LoadConfig *config) {
+    char line[512], path[256];
+    unsigned long inode, found = 0;
+
+    if (config->socket_path != NULL) {
+        FILE *unix_sockets = fopen("/proc/net/unix", "r");
+        if (unix_sockets == NULL) return 0;
+        while (found == 0 && fgets(line, sizeof(line), unix_sockets)) {
+            unsigned int flags;
+            // Num RefCount Protocol Flags Type St Inode Path; flag 0x10000 marks a listening socket
+            if (sscanf(line, "%*s %*s %*s %x %*s %*s %lu %255s", &flags, &inode, path) == 3 &&
+                (flags & 0x10000) && strcmp(path, config->socket_path) == 0) {
+                found = inode;
+            }
+        }
+        fclose(unix_sockets);
+        return found;
+    }
+
+    if (strncmp(config->host, "127.", 4) != 0 && strcmp(config->host, "localhost") != 0) return 0;
+
+    const char *tables[] = { "/proc/net/tcp", "/proc/net/tcp6" };
+    for (int t = 0; t < 2 && found == 0; t++) {
+        FILE *tcp = fopen(tables[t], "r");
+        if (tcp == NULL) continue;
+        while (found == 0 && fgets(line, sizeof(line), tcp)) {
+            unsigned int port, state;
+            // sl local_address rem_address st tx:rx tr:when retrnsmt uid timeout inode; state 0A is LISTEN
+            if (sscanf(line, "%*s %*[0-9A-Fa-f]:%x %*s %x %*s %*s %*s %*s %*s %lu", &port, &state, &inode) == 3 &&
+                state == 0x0A && (int)port == config->port) {
+                found = inode;
+            }
+        }
+        fclose(tcp);
+    }
+    return found;
+}
+
+// Find the PID of the process that holds the server's listening socket, returns 0 if it is not found
+static pid_t find_server_pid(const LoadConfig *config) {
+    unsigned long inode = find_listener_inode(config);
+    if (inode == 0) return 0;
+
+    DIR *proc = opendir("/proc");
+    if (proc == NULL) return 0;
+
+    char target[64];
+    snprintf(target, sizeof(target), "socket:[%lu]", inode);
+
+    struct dirent *entry;
+    pid_t found = 0;
+    while (found == 0 && (entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+
+        char path[300];
+        snprintf(path, sizeof(path), "/proc/%s/fd", entry->d_name);
+        DIR *fds = opendir(path);
+        if (fds == NULL) continue;
+
+        // Look for a descriptor of this process that refers to the listening socket
+        struct dirent *fd_entry;
+        while (found == 0 && (fd_entry = readdir(fds)) != NULL) {
+            char link_path[600], link[64];
+            snprintf(link_path, sizeof(link_path), "%s/%s", path, fd_entry->d_name);
+            ssize_t length = readlink(link_path, link, sizeof(link) - 1);
+            if (length < 0) continue;
+            link[length] = '\0';
+            if (strcmp(link, target) == 0) found = (pid_t)atoi(entry->d_name);
+        }
+        closedir(fds);
+    }
+    closedir(proc);
+    return found;
+}
+
+// Read the resident set size (KB) and thread count of a process, returns 0 on success
+static int read_process_stats(pid_t pid, long *rss_kb, long *threads) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *status = fopen(path, "r");
+    if (status == NULL) return -1;
+
+    while (fgets(line, sizeof(line), status)) {
+        sscanf(line, "VmRSS: %ld", rss_kb);
+        sscanf(line, "Threads: %ld", threads);
+    }
+    fclose(status);
+    return 0;
+}
+
+// Add a "weight:command" entry to the command mix
+static int add_mix_entry(LoadConfig *config, const char *spec) {
+    if (config->mix_count == MAX_COMMAND_MIX) {
+        fprintf(stderr, "Too many commands in the mix (max %d)\n", MAX_COMMAND_MIX);
+        return -1;
+    }
+
+    MixEntry *entry = &config->mix[config->mix_count];
+    const char *colon = strchr(spec, ':');
+    entry->weight = colon ? atoi(spec) : 1;
+    if (entry->weight <= 0) {
+        fprintf(stderr, "Invalid weight in '%s'\n", spec);
+        return -1;
+    }
+    snprintf(entry->command, sizeof(entry->command), "%s", colon ? colon + 1 : spec);
+
+    config->total_weight += entry->weight;
+    config->mix_count++;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    LoadConfig config = { .host = "127.0.0.1", .port = DEFAULT_PORT, .connections = 8, .duration = 10 };
+    pid_t server_pid = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:r:c:p:h:P:u:S")) != -1) {
+        switch (opt) {
+            case 'n': config.connections = atoi(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'c': if (add_mix_entry(&config, optarg) < 0) return 1; break;
+            case 'p': server_pid = (pid_t)atoi(optarg); break;
+            case 'h': config.host = optarg; break;
+            case 'P': config.port = atoi(optarg); break;
+            case 'u': config.socket_path = optarg; break;
+            case 'S': config.storm = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n connections] [-d seconds] [-r rate] "
+                                "[-c weight:command]... [-p server_pid] [-h host] [-P port] [-u socket_path] [-S]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (config.connections <= 0 || config.duration <= 0) {
+        fprintf(stderr, "Connections and duration must be positive\n");
+        return 1;
+    }
+    if (config.mix_count == 0) add_mix_entry(&config, "1:echo hello");
+    if (server_pid == 0) server_pid = find_server_pid(&config);
+
+    LoadWorker *workers = calloc(config.connections, sizeof(LoadWorker));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    printf("Running %s load: %d connections, %.1f s, %d command(s) in the mix",
+           config.rate > 0 ? "open-loop" : "closed-loop", config.connections, config.duration, config.mix_count);
+    if (config.rate > 0) printf(", %.0f commands/s", config.rate);
+    if (config.socket_path != NULL) printf(", Unix socket %s", config.socket_path);
+    if (config.storm) printf(", a new connection per command");
+    printf("\n");
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < config.connections; i++) {
+        workers[i].index = i;
+        workers[i].config = &config;
+        histogram_init(&workers[i].latency);
+        histogram_init(&workers[i].connect_latency);
+        if (pthread_create(&workers[i].thread, NULL, load_worker_thread, &workers[i]) != 0) {
+            perror("Thread creation failed");
+            return 1;
+        }
+    }
+
+    // Sample the server's memory and thread count while the load runs
+    long peak_rss = 0, peak_threads = 0, rss = 0, threads = 0;
+    uint64_t end = start + (uint64_t)(config.duration * 1e9);
+    while (server_pid > 0 && now_ns() < end) {
+        if (read_process_stats(server_pid, &rss, &threads) == 0) {
+            if (rss > peak_rss) peak_rss = rss;
+            if (threads > peak_threads) peak_threads = threads;
+        }
+        usleep(100000);
+    }
+
+    Histogram *latency = malloc(sizeof(Histogram));
+    Histogram *connect_latency = malloc(sizeof(Histogram));
+    histogram_init(latency);
+    histogram_init(connect_latency);
+    uint64_t completed = 0, failed = 0, errors = 0, connect_failures = 0;
+    for (int i = 0; i < config.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        histogram_merge(latency, &workers[i].latency);
+        histogram_merge(connect_latency, &workers[i].connect_latency);
+        completed += workers[i].completed;
+        failed += workers[i].failed;
+        errors += workers[i].errors;
+        connect_failures += workers[i].connect_failures;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("Completed:   %llu commands (%llu failed), %llu errors, %llu failed connects, %.1f commands/s\n",
+           (unsigned long long)completed, (unsigned long long)failed, (unsigned long long)errors,
+           (unsigned long long)connect_failures, completed / elapsed);
+    if (latency->total_count > 0) {
+        printf("Latency:     mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+               latency->sum / 1e6 / latency->total_count,
+               histogram_percentile(latency, 50) / 1e6, histogram_percentile(latency, 90) / 1e6,
+               histogram_percentile(latency, 99) / 1e6, histogram_percentile(latency, 99.9) / 1e6,
+               latency->max / 1e6);
+    }
+    if (config.storm && connect_latency->total_count > 0) {
+        printf("Connect:     %.1f connections/s, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               connect_latency->total_count / elapsed,
+               histogram_percentile(connect_latency, 50) / 1e6, histogram_percentile(connect_latency, 99) / 1e6,
+               connect_latency->max / 1e6);
+    }
+    if (server_pid > 0) {
+        printf("Server:      PID %d, RSS peak %ld KB, threads peak %ld\n", (int)server_pid, peak_rss, peak_threads);
+    } else {
+        printf("Server:      PID unknown, pass -p <pid> for RSS and thread counts\n");
+    }
+
+    free(latency);
+    free(connect_latency);
+    free(workers);
+    return errors > 0 || connect_failures > 0 ? 2 : 0;
+}
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "logger.h"
+#include "pipeio.h"
+
+// Every thread formats its lines into its own single-producer/single-consumer ring, so logging
+// never takes a lock. One background thread drains all rings and writes them out in batches.
+// A full ring drops the line and counts it instead of waiting for the writer.
+
+#define LOG_WRITER_INTERVAL_NS 5000000 // How long the writer sleeps when every ring is empty
+
+// Structure to hold one thread's ring of formatted lines
+typedef struct LogRing {
+    char lines[LOG_RING_SLOTS][LOG_LINE_MAX];
+    uint16_t lengths[LOG_RING_SLOTS];
+    uint32_t head;                      // Next slot to fill, written by the owning thread only
+    uint32_t tail;                      // Next slot to drain, written by the writer only
+    uint64_t dropped;                   // Lines dropped because the ring was full
+    uint64_t dropped_reported;          // Part of dropped already reported by the writer
+    int retired;                        // Set when the owning thread exits
+    unsigned sample_counters[LOG_LEVEL_COUNT];
+    struct LogRing *next;               // Next ring in the registry
+} LogRing;
+
+static const char *level_names[LOG_LEVEL_COUNT] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static LogRing *ring_registry = NULL;          // Lock-free list of all rings, pushed at the head
+static __thread LogRing *thread_ring = NULL;   // Ring of the calling thread
+static pthread_key_t ring_key;                 // Retires a thread's ring when the thread exits
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int log_fd = -1;                        // Destination of the writer, -1 until started
+static LogLevel log_min_level = LOG_LEVEL_INFO;
+static unsigned log_sampling[LOG_LEVEL_COUNT] = { 1, 1, 1, 1 };
+static uint64_t total_dropped = 0;             // Drops over all rings, including freed ones
+static pthread_t writer_thread;
+static int writer_running = 0;
+
+// Mark the exiting thread's ring as retired so the writer frees it once drained
+static void retire_ring(void *arg) {
+    LogRing *ring = (LogRing *)arg;
+    __atomic_store_n(&ring->retired, 1, __ATOMIC_RELEASE);
+}
+
+// Create the key whose destructor retires rings
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, retire_ring);
+}
+
+// Return the calling thread's ring, registering a new one on first use
+static LogRing *get_thread_ring(void) {
+    if (thread_ring != NULL) return thread_ring;
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (ring == NULL) return NULL;
+
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, ring);
+
+    // Push onto the registry; only the writer ever unlinks rings
+    ring->next = __atomic_load_n(&ring_registry, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ring_registry, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    thread_ring = ring;
+    return ring;
+}
+
+// Format the timestamp and level prefix of a line, returns its length
+static int format_prefix(char *line, size_t size, LogLevel level) {
+    // localtime_r takes the time zone lock, so only call it when the second changes
+    static __thread time_t cached_second = -1;
+    static __thread char cached_time[32];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != cached_second) {
+        struct tm local;
+        localtime_r(&now.tv_sec, &local);
+        strftime(cached_time, sizeof(cached_time), "%Y-%m-%d %H:%M:%S", &local);
+        cached_second = now.tv_sec;
+    }
+
+    return snprintf(line, size, "%s.%03ld %-5s ", cached_time, now.tv_nsec / 1000000, level_names[level]);
+}
+
+// Format a line into the calling thread's ring without blocking
+void log_message(LogLevel level, const char *format, ...) {
+    if (level < log_min_level) return;
+
+    // Before the writer starts there is no ring, and lines go synchronously to stderr
+    LogRing *ring = __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE) ? get_thread_ring() : NULL;
+
+    // Sampling is decided per thread so it needs no shared counter, and before formatting so a
+    // skipped line costs nothing
+    if (ring != NULL && log_sampling[level] > 1 && ring->sample_counters[level]++ % log_sampling[level] != 0) {
+        return;
+    }
+
+    // The prefix's time formatting may change errno, which a %m in the message still has to see
+    int saved_errno = errno;
+    char line[LOG_LINE_MAX];
+    va_list args;
+    int length = format_prefix(line, sizeof(line), level);
+    errno = saved_errno;
+    va_start(args, format);
+    int message_length = vsnprintf(line + length, sizeof(line) - length - 1, format, args);
+    va_end(args);
+
+    length += message_length;
+    if (length > LOG_LINE_MAX - 2) length = LOG_LINE_MAX - 2; // Truncated
+    line[length++] = '\n';
+
+    if (ring == NULL) {
+        write_all(STDERR_FILENO, line, length);
+        return;
+    }
+
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == LOG_RING_SLOTS) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint32_t slot = head % LOG_RING_SLOTS;
+    memcpy(ring->lines[slot], line, length);
+    ring->lengths[slot] = (uint16_t)length;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE); // Publish the line to the writer
+}
+
+// Move every pending line of every ring into the batch, returns the number of lines written
+static int drain_rings(char *batch, size_t batch_size) {
+    size_t batch_length = 0;
+    int lines = 0;
+    LogRing *previous = NULL;
+    LogRing *ring = __atomic_load_n(&ring_registry, __ATOMIC_ACQUIRE);
+
+    while (ring != NULL) {
+        int retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = ring->tail;
+
+        for (; tail != head; tail++) {
+            uint32_t slot = tail % LOG_RING_SLOTS;
+            if (batch_length + ring->lengths[slot] > batch_size) {
+                write_all(log_fd, batch, batch_length);
+                batch_length = 0;
+            }
+            memcpy(batch + batch_length, ring->lines[slot], ring->lengths[slot]);
+            batch_length += ring->lengths[slot];
+            lines++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE); // Hand the slots back to the producer
+
+        // Report drops, so a full ring is visible in the log itself
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported) {
+            char line[LOG_LINE_MAX];
+            int length = format_prefix(line, sizeof(line), LOG_LEVEL_WARN);
+            length += snprintf(line + length, sizeof(line) - length, "logger: dropped %llu lines\n",
+                               (unsigned long long)(dropped - ring->dropped_reported));
+            if (batch_length + length > batch_size) {
+                write_all(log_fd, batch, batch_length);
+                batch_length = 0;
+            }
+            memcpy(batch + batch_length, line, length);
+            batch_length += length;
+            ring->dropped_reported = dropped;
+        }
+
+        // Free rings of exited threads once they are drained
+        LogRing *next = ring->next;
+        if (retired && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+            int unlinked;
+            if (previous == NULL) {
+                // The head may be replaced by a concurrent push; retry on a later pass if so
+                LogRing *expected = ring;
+                unlinked = __atomic_compare_exchange_n(&ring_registry, &expected, next, 0,
+                                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+            } else {
+                previous->next = next;
+                unlinked = 1;
+            }
+            if (unlinked) {
+                free(ring);
+                ring = next;
+                continue;
+            }
+        }
+        previous = ring;
+        ring = next;
+    }
+
+    write_all(log_fd, batch, batch_length);
+    return lines;
+}
+
+// Background writer: drain the rings until stopped
+static void *logger_writer_thread(void *arg) {
+    (void)arg;
+    static char batch[64 * 1024];
+    struct timespec interval = { 0, LOG_WRITER_INTERVAL_NS };
+
+    while (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        if (drain_rings(batch, sizeof(batch)) == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    drain_rings(batch, sizeof(batch)); // Whatever was logged before the stop
+    return NULL;
+}
+
+// Start the background writer
+int logger_start(int fd, LogLevel min_level) {
+    log_fd = fd;
+    log_min_level = min_level;
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&writer_thread, NULL, logger_writer_thread, NULL) != 0) {
+        __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+// Write out everything still buffered and stop the background writer
+void logger_stop(void) {
+    if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) return;
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+}
+
+// Keep only one in every_n lines of the given level
+void logger_set_sampling(LogLevel level, unsigned every_n) {
+    log_sampling[level] = every_n > 0 ? every_n : 1;
+}
+
+// Parse a level name
+int logger_parse_level(const char *name) {
+    for (int level = 0; level < LOG_LEVEL_COUNT; level++) {
+        if (strcasecmp(name, level_names[level]) == 0) return level;
+    }
+    return -1;
+}
+
+// Return the number of lines dropped because a thread's ring was full
+uint64_t logger_dropped_lines(void) {
+    return __atomic_load_n(&total_dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,36 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+// Log levels, in increasing severity
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_COUNT
+} LogLevel;
+
+#define LOG_RING_SLOTS 128  // Lines buffered per thread before new lines are dropped
+#define LOG_LINE_MAX 256    // Longest line kept, longer lines are truncated
+
+// Function to start the background writer; lines below min_level are discarded
+int logger_start(int fd, LogLevel min_level);
+
+// Function to write out everything still buffered and stop the background writer
+void logger_stop(void);
+
+// Function to keep only one in every_n lines of the given level (1 keeps all)
+void logger_set_sampling(LogLevel level, unsigned every_n);
+
+// Function to parse a level name ("debug", "info", "warn", "error"), returns -1 if unknown
+int logger_parse_level(const char *name);
+
+// Function to return the number of lines dropped because a thread's ring was full
+uint64_t logger_dropped_lines(void);
+
+// Function to format a line into the calling thread's ring without blocking; %m is supported
+void log_message(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -1,78 +1,67 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "shell.h"
 #include "parser.h"
 #include "commands.h"
-#include "utilities.h"
+#include "pipeio.h"
+#include "history.h"
+#include "lineedit.h"
 
-// MAIN is used for local shell (can be started with ./shell)
-void display_shell_prompt();
-int read_user_input(char *command_line);
+// The local shell (./shell): reads lines through the line editor and runs them in this process
 
-int main(void) {
+int main(int argc, char *argv[]) {
     char command_line[MAX_COMMAND_LENGTH];
 
-    while (1) {
-        // Display the shell prompt
-        display_shell_prompt();  
+    // Parse command-line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--high-throughput") == 0) {
+            set_high_throughput_mode(1); // Enlarge pipes between pipeline stages
+        } else {
+            fprintf(stderr, "Usage: %s [--high-throughput]\n", argv[0]);
+            return 1;
+        }
+    }
 
-        if (!read_user_input(command_line)) {
+    // Only typed commands are worth recalling, not those of a script
+    History *history = NULL;
+    char history_path[4096];
+    if (isatty(STDIN_FILENO) && history_default_path(".my_shell_history", history_path, sizeof(history_path)) == 0) {
+        history = history_open(history_path);
+    }
+
+    while (1) {
+        if (!line_editor_read("my_shell> ", command_line, sizeof(command_line), history)) {
             break; // Exit on EOF (e.g., Ctrl+D)
         }
 
         if (strlen(command_line) == 0) {
             continue; // Ignore empty commands
         }
+        if (history != NULL) history_add(history, command_line);
 
-        char *piped_commands[MAX_PIPED_COMMANDS + 1];
-        int piped_command_count = split_piped_commands(command_line, piped_commands, MAX_PIPED_COMMANDS + 1);
-
-        // Skip execution if there was an error in parsing
-        if (piped_command_count == -1) {
-            continue; 
+        // Skip execution if there was an error in parsing, or nothing to run
+        Pipeline pipeline;
+        int piped_command_count = parse_pipeline(command_line, &pipeline);
+        if (piped_command_count <= 0) {
+            continue;
         }
 
         if (piped_command_count == 1) {
-            ShellCommand cmd;
-            parse_shell_command(piped_commands[0], &cmd);
-
-            if (cmd.arguments[0] == NULL) {
-                continue; // No command to execute
-            }
-
-            if (!is_built_in_command(&cmd)) {
-                execute_single_command(&cmd);
+            ShellCommand *cmd = &pipeline.commands[0];
+            if (!is_built_in_command(cmd)) {
+                execute_single_command(cmd);
             }
         } else {
             ShellCommand *commands[MAX_PIPED_COMMANDS + 1];
             for (int i = 0; i < piped_command_count; i++) {
-                commands[i] = malloc(sizeof(ShellCommand));
-                if (commands[i] == NULL) {
-                    perror("Malloc failed");
-                    // Free previously allocated commands
-                    for (int j = 0; j < i; j++) {
-                        for (int k = 0; commands[j]->arguments[k] != NULL; k++) {
-                            free(commands[j]->arguments[k]);
-                        }
-                        free(commands[j]);
-                    }
-                    break;
-                }
-                parse_shell_command(piped_commands[i], commands[i]);
+                commands[i] = &pipeline.commands[i];
             }
             execute_piped_commands(commands, piped_command_count);
-
-            // Free allocated ShellCommand structures
-            for (int i = 0; i < piped_command_count; i++) {
-                if (commands[i] != NULL) {
-                    for (int j = 0; commands[i]->arguments[j] != NULL; j++) {
-                        free(commands[i]->arguments[j]);
-                    }
-                    free(commands[i]);
-                }
-            }
         }
+        free_pipeline(&pipeline);
     }
+    history_close(history);
     return 0;
 }
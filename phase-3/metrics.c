@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "histogram.h"
+#include "metrics.h"
+
+// Every metric is split into METRIC_SHARDS cache-line sized shards. A thread always updates
+// the same shard with a relaxed atomic, so the command path never shares a cache line with
+// other threads unless there are more threads than shards. The scraper sums the shards.
+
+#define CACHE_LINE_SIZE 64
+#define MAX_METRICS 64
+
+// Structure to hold one shard of a counter, padded to its own cache line
+typedef struct {
+    int64_t value;
+    char padding[CACHE_LINE_SIZE - sizeof(int64_t)];
+} CounterShard;
+
+struct MetricCounter {
+    CounterShard shards[METRIC_SHARDS];
+};
+
+struct MetricHistogram {
+    Histogram *shards[METRIC_SHARDS];
+};
+
+// Kinds of registered metrics
+typedef enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM } MetricKind;
+
+// Structure to hold one entry of the registry
+typedef struct {
+    const char *name;
+    const char *help;
+    const char *label;
+    MetricKind kind;
+    MetricCounter *counter;
+    MetricHistogram *histogram;
+    uint64_t (*read_value)(void);
+} MetricEntry;
+
+static MetricEntry registry[MAX_METRICS];
+static int registry_count = 0;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int next_shard = 0;                 // Round-robin shard assignment for new threads
+static __thread int thread_shard = -1;     // Shard of the calling thread
+
+// Bucket boundaries exported for histograms, in microseconds
+static const uint64_t exported_bounds_us[] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+// Return the shard of the calling thread, assigning one on first use
+static int get_thread_shard(void) {
+    if (thread_shard < 0) {
+        thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRIC_SHARDS;
+    }
+    return thread_shard;
+}
+
+// Add an entry to the registry
+static MetricEntry *add_registry_entry(const char *name, const char *help, MetricKind kind) {
+    pthread_mutex_lock(&registry_mutex);
+    MetricEntry *entry = NULL;
+    if (registry_count < MAX_METRICS) {
+        entry = &registry[registry_count++];
+        memset(entry, 0, sizeof(*entry));
+        entry->name = name;
+        entry->help = help;
+        entry->kind = kind;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return entry;
+}
+
+// Register a counter or gauge
+MetricCounter *metrics_register_counter(const char *name, const char *help, int is_gauge) {
+    MetricCounter *counter = aligned_alloc(CACHE_LINE_SIZE, sizeof(MetricCounter));
+    if (counter == NULL) return NULL;
+    memset(counter, 0, sizeof(*counter));
+
+    MetricEntry *entry = add_registry_entry(name, help, is_gauge ? METRIC_GAUGE : METRIC_COUNTER);
+    if (entry == NULL) {
+        free(counter);
+        return NULL;
+    }
+    entry->counter = counter;
+    return counter;
+}
+
+// Register a histogram of durations in microseconds
+MetricHistogram *metrics_register_histogram(const char *name, const char *help, const char *label) {
+    MetricHistogram *histogram = calloc(1, sizeof(MetricHistogram));
+    if (histogram == NULL) return NULL;
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        histogram->shards[i] = aligned_alloc(CACHE_LINE_SIZE, sizeof(Histogram));
+        if (histogram->shards[i] == NULL) return NULL;
+        histogram_init(histogram->shards[i]);
+    }
+
+    MetricEntry *entry = add_registry_entry(name, help, METRIC_HISTOGRAM);
+    if (entry == NULL) return NULL;
+    entry->histogram = histogram;
+    entry->label = label;
+    return histogram;
+}
+
+// Register a value read from a callback at scrape time
+void metrics_register_callback(const char *name, const char *help, int is_gauge, uint64_t (*read_value)(void)) {
+    MetricEntry *entry = add_registry_entry(name, help, is_gauge ? METRIC_GAUGE : METRIC_COUNTER);
+    if (entry != NULL) entry->read_value = read_value;
+}
+
+// Add to a counter or gauge from the calling thread's shard
+void metrics_add(MetricCounter *counter, int64_t delta) {
+    if (counter == NULL) return;
+    __atomic_fetch_add(&counter->shards[get_thread_shard()].value, delta, __ATOMIC_RELAXED);
+}
+
+// Record a duration into the calling thread's shard
+void metrics_observe(MetricHistogram *histogram, uint64_t value_us) {
+    if (histogram == NULL) return;
+    histogram_record(histogram->shards[get_thread_shard()], value_us);
+}
+
+// Structure to hold a growing text buffer
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} TextBuffer;
+
+// Append formatted text to the buffer
+static void text_append(TextBuffer *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void text_append(TextBuffer *text, const char *format, ...) {
+    va_list args;
+    while (text->data != NULL) {
+        va_start(args, format);
+        int written = vsnprintf(text->data + text->length, text->capacity - text->length, format, args);
+        va_end(args);
+        if (written < 0) return;
+        if ((size_t)written < text->capacity - text->length) {
+            text->length += written;
+            return;
+        }
+
+        char *grown = realloc(text->data, text->capacity * 2 + written);
+        if (grown == NULL) return;
+        text->data = grown;
+        text->capacity = text->capacity * 2 + written;
+    }
+}
+
+// Render one histogram with the exported bucket boundaries, in seconds
+static void render_histogram(TextBuffer *text, const MetricEntry *entry) {
+    Histogram *merged = malloc(sizeof(Histogram));
+    if (merged == NULL) return;
+    histogram_init(merged);
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        histogram_merge(merged, entry->histogram->shards[i]);
+    }
+
+    const char *label = entry->label ? entry->label : "";
+    const char *separator = entry->label ? "," : "";
+    int bucket = 0;
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < sizeof(exported_bounds_us) / sizeof(exported_bounds_us[0]); i++) {
+        while (bucket < HISTOGRAM_BUCKETS && histogram_bucket_upper_bound(bucket) <= exported_bounds_us[i]) {
+            cumulative += merged->counts[bucket++];
+        }
+        text_append(text, "%s_bucket{%s%sle=\"%g\"} %llu\n", entry->name, label, separator,
+                    exported_bounds_us[i] / 1e6, (unsigned long long)cumulative);
+    }
+    text_append(text, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", entry->name, label, separator,
+                (unsigned long long)merged->total_count);
+    text_append(text, "%s_sum{%s} %g\n", entry->name, label, merged->sum / 1e6);
+    text_append(text, "%s_count{%s} %llu\n", entry->name, label, (unsigned long long)merged->total_count);
+    free(merged);
+}
+
+// Render every registered metric in the Prometheus text format
+char *metrics_render(void) {
+    static const char *type_names[] = { "counter", "gauge", "histogram" };
+    TextBuffer text = { malloc(16384), 0, 16384 };
+    if (text.data == NULL) return NULL;
+    text.data[0] = '\0';
+
+    pthread_mutex_lock(&registry_mutex);
+    for (int i = 0; i < registry_count; i++) {
+        const MetricEntry *entry = &registry[i];
+
+        // Entries sharing a name (labelled histograms) share one HELP and TYPE header
+        if (i == 0 || strcmp(registry[i - 1].name, entry->name) != 0) {
+            text_append(&text, "# HELP %s %s\n# TYPE %s %s\n", entry->name, entry->help,
+                        entry->name, type_names[entry->kind]);
+        }
+
+        if (entry->kind == METRIC_HISTOGRAM) {
+            render_histogram(&text, entry);
+        } else if (entry->read_value != NULL) {
+            text_append(&text, "%s %llu\n", entry->name, (unsigned long long)entry->read_value());
+        } else {
+            int64_t value = 0;
+            for (int shard = 0; shard < METRIC_SHARDS; shard++) {
+                value += __atomic_load_n(&entry->counter->shards[shard].value, __ATOMIC_RELAXED);
+            }
+            text_append(&text, "%s %lld\n", entry->name, (long long)value);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return text.data;
+}
+
+// Answer one scrape: read the request, whatever it is, and reply with the metrics
+static void serve_metrics_request(int client_socket) {
+    char request[1024];
+    struct pollfd pfd = { .fd = client_socket, .events = POLLIN };
+    if (poll(&pfd, 1, 1000) > 0) {
+        recv(client_socket, request, sizeof(request), 0);
+    }
+
+    char *body = metrics_render();
+    if (body != NULL) {
+        char header[128];
+        int header_length = snprintf(header, sizeof(header),
+                                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                     "Content-Length: %zu\r\n\r\n", strlen(body));
+        send(client_socket, header, header_length, MSG_NOSIGNAL);
+        for (size_t sent = 0, length = strlen(body); sent < length;) {
+            ssize_t written = send(client_socket, body + sent, length - sent, MSG_NOSIGNAL);
+            if (written <= 0) break;
+            sent += written;
+        }
+        free(body);
+    }
+    close(client_socket);
+}
+
+// Metrics thread: accept scrapes on the listening sockets
+static void *metrics_server_thread(void *arg) {
+    struct pollfd *listeners = (struct pollfd *)arg;
+    int listener_count = listeners[1].fd >= 0 ? 2 : 1;
+    if (listeners[0].fd < 0) {
+        listeners++;
+        listener_count = 1;
+    }
+
+    while (1) {
+        if (poll(listeners, listener_count, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < listener_count; i++) {
+            if (!(listeners[i].revents & POLLIN)) continue;
+            int client_socket = accept4(listeners[i].fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client_socket >= 0) {
+                serve_metrics_request(client_socket);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Create a listening socket for the metrics endpoint on 127.0.0.1:port
+static int listen_metrics_port(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local scrapers only
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Create a listening Unix socket for the metrics endpoint
+static int listen_metrics_unix(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path); // Remove a stale socket left by a previous run
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Serve the metrics on a local port and/or a Unix socket
+int metrics_start_server(int port, const char *unix_path) {
+    static struct pollfd listeners[2];
+    listeners[0].fd = listeners[1].fd = -1;
+    listeners[0].events = listeners[1].events = POLLIN;
+
+    if (port > 0 && (listeners[0].fd = listen_metrics_port(port)) < 0) {
+        return -1;
+    }
+    if (unix_path != NULL && (listeners[1].fd = listen_metrics_unix(unix_path)) < 0) {
+        if (listeners[0].fd >= 0) close(listeners[0].fd);
+        return -1;
+    }
+    if (listeners[0].fd < 0 && listeners[1].fd < 0) {
+        return 0; // Metrics endpoint disabled
+    }
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, metrics_server_thread, listeners) != 0) {
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRIC_SHARDS 16 // Threads are spread over this many shards of every metric
+
+typedef struct MetricCounter MetricCounter;
+typedef struct MetricHistogram MetricHistogram;
+
+// Function to register a counter (only goes up) or a gauge (goes up and down)
+MetricCounter *metrics_register_counter(const char *name, const char *help, int is_gauge);
+
+// Function to register a histogram of durations in microseconds; label may be NULL or e.g. "phase=\"parse\""
+MetricHistogram *metrics_register_histogram(const char *name, const char *help, const char *label);
+
+// Function to register a value that is read from a callback when the metrics are scraped
+void metrics_register_callback(const char *name, const char *help, int is_gauge, uint64_t (*read_value)(void));
+
+// Function to add to a counter or gauge from the calling thread's shard
+void metrics_add(MetricCounter *counter, int64_t delta);
+
+// Function to record a duration in microseconds into the calling thread's shard
+void metrics_observe(MetricHistogram *histogram, uint64_t value_us);
+
+// Function to render every registered metric in the Prometheus text format, returns a malloc'd string
+char *metrics_render(void);
+
+// Function to serve the metrics over HTTP on 127.0.0.1:port and/or a Unix socket (either may be 0/NULL)
+int metrics_start_server(int port, const char *unix_path);
+
+#endif
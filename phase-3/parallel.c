@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include "parallel.h"
+#include "commands.h"
+#include "pipeio.h"
+
+// Usage: parallel [-j N] [-k] command [args containing {}] [::: input ...]
+//   -j N  run at most N invocations at the same time (capped at MAX_PARALLEL_JOBS)
+//   -k    keep output in input order instead of printing each job as it completes
+// Without ':::' the inputs are read from stdin, one per line.
+
+// Structure to hold the state of a single invocation
+typedef struct {
+    const char *input;    // Input substituted for {} in the template
+    pid_t pid;            // Process ID of the job, 0 until started
+    int output_fd;        // Read end of the job's output pipe, -1 once drained
+    char *output;         // Output captured so far
+    size_t output_length;
+    size_t output_capacity;
+    int finished;         // Set once the output is drained and the job is reaped
+    int failed;           // Set if the job exited with a non-zero status
+} ParallelJob;
+
+// Check if the command is the parallel builtin
+int is_parallel_command(ShellCommand *cmd) {
+    return cmd->arguments[0] != NULL && strcmp(cmd->arguments[0], "parallel") == 0;
+}
+
+// Replace every occurrence of {} in the template argument with the input
+static char *substitute_placeholder(const char *template_arg, const char *input) {
+    size_t input_length = strlen(input);
+    size_t length = 0;
+    for (const char *p = template_arg; *p != '\0'; p++) {
+        if (p[0] == '{' && p[1] == '}') {
+            length += input_length;
+            p++;
+        } else {
+            length++;
+        }
+    }
+
+    char *result = malloc(length + 1);
+    if (result == NULL) return NULL;
+
+    char *out = result;
+    for (const char *p = template_arg; *p != '\0'; p++) {
+        if (p[0] == '{' && p[1] == '}') {
+            memcpy(out, input, input_length);
+            out += input_length;
+            p++;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+// Build the command for one input in the job's child process and execute it, never returns
+static void run_parallel_job(char **template_args, int template_count, const char *input, int null_stdin) {
+    ShellCommand job;
+    int arg_count = 0;
+    int has_placeholder = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.arguments = job.inline_arguments;
+    for (int i = 0; i < template_count && arg_count < MAX_ARGUMENTS - 2; i++) {
+        if (strstr(template_args[i], "{}") != NULL) has_placeholder = 1;
+        job.arguments[arg_count++] = substitute_placeholder(template_args[i], input);
+    }
+
+    // Like xargs, append the input when the template does not mention it
+    if (!has_placeholder) {
+        job.arguments[arg_count++] = strdup(input);
+    }
+    job.arguments[arg_count] = NULL;
+
+    // Jobs must not compete with the builtin for the inputs it is reading from stdin
+    if (null_stdin) {
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+    }
+
+    run_command_in_child(&job);
+    _exit(EXIT_FAILURE);
+}
+
+// Fork a job whose stdout is captured through a pipe, returns 0 on success
+static int start_parallel_job(ParallelJob *job, char **template_args, int template_count, int null_stdin) {
+    int pipe_fds[2];
+    if (create_pipe(pipe_fds) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process
+        close(pipe_fds[0]);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[1]);
+        run_parallel_job(template_args, template_count, job->input, null_stdin);
+    } else if (pid < 0) {
+        int saved_errno = errno;
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Parent process
+    close(pipe_fds[1]);
+    job->pid = pid;
+    job->output_fd = pipe_fds[0];
+    return 0;
+}
+
+// Read available output of a job, returns 0 once the job's output is at EOF
+static int drain_parallel_job(ParallelJob *job) {
+    if (job->output_capacity - job->output_length < 4096) {
+        size_t capacity = job->output_capacity ? job->output_capacity * 2 : 8192;
+        char *output = realloc(job->output, capacity);
+        if (output == NULL) {
+            // Out of memory: flush what we have and keep going without buffering
+            write_all(STDOUT_FILENO, job->output, job->output_length);
+            job->output_length = 0;
+        } else {
+            job->output = output;
+            job->output_capacity = capacity;
+        }
+    }
+
+    ssize_t read_bytes = read(job->output_fd, job->output + job->output_length,
+                              job->output_capacity - job->output_length);
+    if (read_bytes < 0 && errno == EINTR) return 1;
+    if (read_bytes <= 0) return 0;
+    job->output_length += read_bytes;
+    return 1;
+}
+
+// Print and release the captured output of a finished job
+static void flush_parallel_job(ParallelJob *job) {
+    write_all(STDOUT_FILENO, job->output, job->output_length);
+    free(job->output);
+    job->output = NULL;
+    job->output_length = job->output_capacity = 0;
+}
+
+// Read inputs from stdin, one per line
+static int read_parallel_inputs(char ***inputs) {
+    // Read the raw descriptor: the stdio buffer of a forked shell may hold the parent's pending input
+    size_t length = 0, capacity = 0;
+    char *data = NULL;
+    while (1) {
+        if (capacity - length < 4096) {
+            capacity = capacity ? capacity * 2 : 65536;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL) break;
+            data = grown;
+        }
+        ssize_t read_bytes = read(STDIN_FILENO, data + length, capacity - length);
+        if (read_bytes < 0 && errno == EINTR) continue;
+        if (read_bytes <= 0) break;
+        length += read_bytes;
+    }
+
+    int count = 0, slots = 0;
+    *inputs = NULL;
+    for (size_t start = 0; start < length;) {
+        size_t end = start;
+        while (end < length && data[end] != '\n') end++;
+
+        // Skip empty lines
+        if (end > start) {
+            if (count == slots) {
+                slots = slots ? slots * 2 : 64;
+                char **grown = realloc(*inputs, slots * sizeof(char *));
+                if (grown == NULL) break;
+                *inputs = grown;
+            }
+            (*inputs)[count++] = strndup(data + start, end - start);
+        }
+        start = end + 1;
+    }
+    free(data);
+    return count;
+}
+
+// Run the parallel builtin
+int execute_parallel_command(ShellCommand *cmd) {
+    int max_jobs = MAX_PARALLEL_JOBS;
+    int keep_order = 0;
+    int i = 1;
+
+    // Parse options
+    for (; cmd->arguments[i] != NULL && cmd->arguments[i][0] == '-'; i++) {
+        char *option = cmd->arguments[i];
+        if (strcmp(option, "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(option, "-k") == 0) {
+            keep_order = 1;
+        } else if (strncmp(option, "-j", 2) == 0) {
+            char *value = option[2] != '\0' ? option + 2 : cmd->arguments[++i];
+            if (value == NULL || atoi(value) <= 0) {
+                fprintf(stderr, "parallel: -j expects a positive number\n");
+                return 2;
+            }
+            max_jobs = atoi(value);
+        } else {
+            fprintf(stderr, "parallel: unknown option '%s'\n", option);
+            return 2;
+        }
+    }
+
+    // Respect the concurrency limit of the shell
+    if (max_jobs > MAX_PARALLEL_JOBS) max_jobs = MAX_PARALLEL_JOBS;
+
+    // Split the remaining arguments into the command template and the inputs
+    char **template_args = &cmd->arguments[i];
+    int template_count = 0;
+    while (template_args[template_count] != NULL && strcmp(template_args[template_count], ":::") != 0) {
+        template_count++;
+    }
+    if (template_count == 0) {
+        fprintf(stderr, "parallel: expected a command\n");
+        return 2;
+    }
+
+    char **inputs;
+    int input_count;
+    int inputs_from_stdin = template_args[template_count] == NULL;
+    if (inputs_from_stdin) {
+        input_count = read_parallel_inputs(&inputs);
+    } else {
+        inputs = &template_args[template_count + 1];
+        for (input_count = 0; inputs[input_count] != NULL; input_count++);
+    }
+
+    ParallelJob *jobs = calloc(input_count > 0 ? input_count : 1, sizeof(ParallelJob));
+    if (jobs == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int j = 0; j < input_count; j++) {
+        jobs[j].input = inputs[j];
+        jobs[j].output_fd = -1;
+    }
+
+    int next_job = 0;      // Next input to start
+    int next_to_print = 0; // Next input whose output is due in ordered mode
+    int running = 0;
+    int failed = 0;
+    struct pollfd poll_fds[MAX_PARALLEL_JOBS];
+    int poll_jobs[MAX_PARALLEL_JOBS];
+
+    fflush(stdout);
+    while (next_job < input_count || running > 0) {
+        // Start jobs until the limit is reached
+        while (running < max_jobs && next_job < input_count) {
+            if (start_parallel_job(&jobs[next_job], template_args, template_count, inputs_from_stdin) < 0) {
+                // Out of processes: wait for a running job to free a slot instead of failing
+                if (errno == EAGAIN && running > 0) break;
+                perror("parallel");
+                jobs[next_job].finished = jobs[next_job].failed = 1;
+                failed++;
+            } else {
+                running++;
+            }
+            next_job++;
+        }
+
+        // Wait for output from any running job
+        int poll_count = 0;
+        for (int j = next_to_print; j < next_job; j++) {
+            if (jobs[j].output_fd >= 0) {
+                poll_fds[poll_count].fd = jobs[j].output_fd;
+                poll_fds[poll_count].events = POLLIN;
+                poll_jobs[poll_count++] = j;
+            }
+        }
+        if (poll_count > 0 && poll(poll_fds, poll_count, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (int p = 0; p < poll_count; p++) {
+            ParallelJob *job = &jobs[poll_jobs[p]];
+            if (!(poll_fds[p].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            if (drain_parallel_job(job)) continue;
+
+            // The job closed its output: reap it, counting it as failed if its status cannot be collected
+            int status;
+            pid_t reaped;
+            close(job->output_fd);
+            job->output_fd = -1;
+            while ((reaped = waitpid(job->pid, &status, 0)) < 0 && errno == EINTR);
+            job->finished = 1;
+            if (reaped < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                job->failed = 1;
+                failed++;
+            }
+            running--;
+
+            if (!keep_order) flush_parallel_job(job);
+        }
+
+        // Print completed jobs in input order
+        while (next_to_print < next_job && jobs[next_to_print].finished) {
+            flush_parallel_job(&jobs[next_to_print++]);
+        }
+    }
+
+    free(jobs);
+    if (inputs_from_stdin) {
+        for (int j = 0; j < input_count; j++) free(inputs[j]);
+        free(inputs);
+    }
+
+    // Like GNU parallel, the exit status is the number of failed jobs (capped)
+    return failed > 100 ? 101 : failed;
+}
@@ -0,0 +1,12 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "shell.h"
+
+// Function to check if the given command is the parallel fan-out builtin
+int is_parallel_command(ShellCommand *cmd);
+
+// Function to run the parallel fan-out builtin and return its exit status
+int execute_parallel_command(ShellCommand *cmd);
+
+#endif
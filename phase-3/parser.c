@@ -1,180 +1,288 @@
 #include <string.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include "parser.h"
+#include "wildcard.h"
 
-// Skip leading whitespace characters in a string
-void skip_leading_whitespace(char **str) {
-    while (isspace((unsigned char)**str)) (*str)++;
-}
-
-// Parse redirection symbols (< or >) and return the associated filename
-char *parse_redirection_filename(char **str) {
-    skip_leading_whitespace(str);
-    char *start = *str;
-    // Find the end of the filename (next whitespace or end of string)
-    while (**str != '\0' && !isspace((unsigned char)**str)) (*str)++;
-    // Create a new string containing just the filename
-    return strndup(start, *str - start);
-}
+// The lexer reads a command line once, from left to right. Operators are recognized wherever they are
+// not quoted, and each word is written with its quotes removed into the token list's text, together with
+// a pattern for the wildcard expansion in which quoted wildcards and backslashes are escaped. Only the
+// patterns of words with an unquoted wildcard are kept. The parser then builds the pipeline from the
+// tokens without looking at the line again.
 
-// Parse a single argument, handling quoted strings
-void parse_single_argument(char **str, char *buffer) {
-    int in_quotes = 0, buffer_index = 0;
-    char quote_char = '\0';
-
-    while (**str != '\0' && (in_quotes || !isspace((unsigned char)**str))) {
-        if (in_quotes) {
-            // End of quoted string
-            if (**str == quote_char) in_quotes = 0;
-            // Add character to buffer
-            else buffer[buffer_index++] = **str;
-        } else {
-            if (**str == '\'' || **str == '\"') {
-                // Start of quoted string
-                in_quotes = 1;
-                quote_char = **str;
-            } else {
-                // Add character to buffer
-                buffer[buffer_index++] = **str;
-            }
-        }
-        (*str)++;
-    }
-    buffer[buffer_index] = '\0';
-}
+// Classes of the bytes the lexer treats specially
+#define CHAR_SPACE 1           // Ends an unquoted word
+#define CHAR_OPERATOR 2        // | < >, also ending an unquoted word
+#define CHAR_QUOTE 4           // ' and "
+#define CHAR_WILDCARD 8        // * ? [, which make an unquoted word a pattern
+#define CHAR_PATTERN 16        // * ? [ ] \, escaped in the pattern where they are quoted
+#define CHAR_BACKSLASH 32      // Escaped in the pattern everywhere
 
-// Parse a shell command into the ShellCommand structure
-void parse_shell_command(char *command_line, ShellCommand *cmd) {
-    int arg_count = 0;
-    cmd->input_file = NULL;
-    cmd->output_file = NULL;
-    cmd->append_output = 0;
-    cmd->error_file = NULL;
+static const unsigned char char_classes[256] = {
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE,
+    ['|'] = CHAR_OPERATOR, ['<'] = CHAR_OPERATOR, ['>'] = CHAR_OPERATOR,
+    ['\''] = CHAR_QUOTE, ['"'] = CHAR_QUOTE,
+    ['*'] = CHAR_WILDCARD | CHAR_PATTERN, ['?'] = CHAR_WILDCARD | CHAR_PATTERN, ['['] = CHAR_WILDCARD | CHAR_PATTERN,
+    [']'] = CHAR_PATTERN, ['\\'] = CHAR_PATTERN | CHAR_BACKSLASH,
+};
 
-    char *ptr = command_line;
-    char buffer[MAX_COMMAND_LENGTH];
-    int first_arg = 1;  // Track if the command starts with an argument
-    int empty_command_error = 0;  // Track empty command errors
+// Split a command line into tokens
+int lex_command_line(const char *command_line, TokenList *tokens) {
+    const char *ptr = command_line;
+    int text_length = 0, pattern_length = 0;
+    tokens->count = 0;
 
-    while (*ptr != '\0') {
-        skip_leading_whitespace(&ptr);
+    while (1) {
+        while (char_classes[(unsigned char)*ptr] & CHAR_SPACE) ptr++;
         if (*ptr == '\0') break;
+        if (tokens->count == MAX_TOKENS) goto too_long;
 
-        if (strncmp(ptr, "2>", 2) == 0) {
-            // Error redirection
-            ptr += 2;
-            cmd->error_file = parse_redirection_filename(&ptr);
-            if (cmd->error_file == NULL || strcmp(cmd->error_file, "") == 0) {
-                fprintf(stderr, "Error: Missing error redirection file.\n");
-                empty_command_error = 1;
-                break;  // Stop parsing
-            }
-        } else if (*ptr == '>') {
-            // Output redirection
+        Token *token = &tokens->tokens[tokens->count++];
+        token->wildcards = 0;
+        if (*ptr == '|') {
+            token->type = TOKEN_PIPE;
             ptr++;
-            if (*ptr == '>') {
-                // Append mode
-                cmd->append_output = 1;
-                ptr++;
-            } else {
-                cmd->append_output = 0;
-            }
-
-            skip_leading_whitespace(&ptr);
+            continue;
+        } else if (*ptr == '<') {
+            token->type = TOKEN_INPUT;
+            ptr++;
+            continue;
+        } else if (*ptr == '>') {
+            // Output redirection, appending for '>>'
+            token->type = ptr[1] == '>' ? TOKEN_APPEND : TOKEN_OUTPUT;
+            ptr += ptr[1] == '>' ? 2 : 1;
+            continue;
+        } else if (ptr[0] == '2' && ptr[1] == '>') {
+            token->type = TOKEN_ERROR_OUTPUT;
+            ptr += 2;
+            continue;
+        }
 
-            // Check if there is an argument after '>'
-            if (*ptr == '\0' || isspace((unsigned char)*ptr)) {
-                fprintf(stderr, "Error: Missing output file for redirection.\n");
-                empty_command_error = 1;
-                break;  // Stop parsing
+        // A word runs to the next space or operator outside quotes
+        token->type = TOKEN_WORD;
+        token->text = text_length;
+        token->pattern = pattern_length;
+        char quote_char = '\0';
+        for (; *ptr != '\0'; ptr++) {
+            char c = *ptr;
+            unsigned char char_class = char_classes[(unsigned char)c];
+            int escape = 0;
+            if (quote_char != '\0') {
+                if (c == quote_char) {
+                    // End of quoted string
+                    quote_char = '\0';
+                    continue;
+                }
+                // Taken literally in the pattern
+                escape = char_class & CHAR_PATTERN;
+            } else if (char_class != 0) {
+                if (char_class & (CHAR_SPACE | CHAR_OPERATOR)) break;
+                if (char_class & CHAR_QUOTE) {
+                    // Start of quoted string
+                    quote_char = c;
+                    continue;
+                }
+                if (char_class & CHAR_WILDCARD) token->wildcards = 1;
+                escape = char_class & CHAR_BACKSLASH;
             }
 
-            cmd->output_file = parse_redirection_filename(&ptr);
-            if (cmd->output_file == NULL || strcmp(cmd->output_file, "") == 0) {
-                fprintf(stderr, "Error: Missing output file for redirection.\n");
-                empty_command_error = 1;
-                break;  // Stop parsing
-            }
-        } else if (*ptr == '<') {
-            // Input redirection
-            if (first_arg && arg_count == 0) {
-                // No arguments before '<'
-                fprintf(stderr, "Error: Empty argument before input redirection.\n");
-                empty_command_error = 1;
-                break;  // Stop parsing
-            }
-            ptr++;
-            cmd->input_file = parse_redirection_filename(&ptr);
-            if (cmd->input_file == NULL || strcmp(cmd->input_file, "") == 0) {
-                fprintf(stderr, "Error: Missing input file for redirection.\n");
-                empty_command_error = 1;
-                break;  // Stop parsing
+            // One byte stays free in text for the terminating NUL, and one in patterns
+            if (text_length + 1 >= (int)sizeof(tokens->text) || pattern_length + 2 >= (int)sizeof(tokens->patterns)) {
+                goto too_long;
             }
+            tokens->text[text_length++] = c;
+            if (escape) tokens->patterns[pattern_length++] = '\\';
+            tokens->patterns[pattern_length++] = c;
+        }
+
+        if (text_length >= (int)sizeof(tokens->text)) goto too_long;  // An empty word like ""
+        token->length = text_length - token->text;
+        tokens->text[text_length++] = '\0';
+        if (token->wildcards) {
+            tokens->patterns[pattern_length++] = '\0';
         } else {
-            // Regular argument
-            parse_single_argument(&ptr, buffer);
-            cmd->arguments[arg_count++] = strdup(buffer);
-            first_arg = 0;  // Reset the first argument flag
+            pattern_length = token->pattern;  // The word itself is used, so its pattern is dropped
         }
     }
+    return tokens->count;
+
+too_long:
+    fprintf(stderr, "Error: Command line too long.\n");
+    return -1;
+}
 
-    // If there was an error during parsing, clear the command and return
-    if (empty_command_error) {
-        cmd->arguments[0] = NULL;  // Ensure no command is executed
-        return;
+// Append an argument the command takes ownership of, moving the arguments to the heap once they outgrow
+// the inline array; room is always kept for the terminating NULL
+static int add_argument(ShellCommand *cmd, int *arg_count, char *argument) {
+    if (argument == NULL) return -1;
+    if (*arg_count + 1 >= cmd->argument_capacity) {
+        int capacity = cmd->argument_capacity * 2;
+        char **arguments;
+        if (cmd->arguments == cmd->inline_arguments) {
+            arguments = malloc(capacity * sizeof(char *));
+            if (arguments != NULL) memcpy(arguments, cmd->inline_arguments, *arg_count * sizeof(char *));
+        } else {
+            arguments = realloc(cmd->arguments, capacity * sizeof(char *));
+        }
+        if (arguments == NULL) {
+            free(argument);
+            return -1;
+        }
+        cmd->arguments = arguments;
+        cmd->argument_capacity = capacity;
     }
+    cmd->arguments[(*arg_count)++] = argument;
+    return 0;
+}
 
-    // Null-terminate the arguments array
-    cmd->arguments[arg_count] = NULL;
+// Copy a word of the token list into a new string
+static char *copy_word(const TokenList *tokens, const Token *word) {
+    char *copy = malloc(word->length + 1);
+    if (copy != NULL) memcpy(copy, tokens->text + word->text, word->length + 1);
+    return copy;
 }
 
-// Split a command line into multiple piped commands
-int split_piped_commands(char *command_line, char *piped_commands[], int max_pipes) {
-    int pipe_count = 0;
-    char *token;
-    
-    // Temporary copy of command_line to check for trailing pipe
-    char *temp = strdup(command_line);
-    if (!temp) {
-        perror("strdup");
-        return -1;
+// Append a word as an argument, or the paths its wildcards match in byte order; a pattern that matches
+// nothing is passed on as typed
+static int add_expanded_argument(ShellCommand *cmd, int *arg_count, const TokenList *tokens, const Token *word) {
+    char **matches = NULL;
+    int match_count = word->wildcards ? wildcard_expand(tokens->patterns + word->pattern, &matches) : 0;
+    if (match_count <= 0) {
+        free(matches);
+        return add_argument(cmd, arg_count, copy_word(tokens, word));
     }
 
-    // Trim trailing whitespace
-    char *end = temp + strlen(temp) - 1;
-    while (end >= temp && isspace((unsigned char)*end)) {
-        end--;
+    for (int i = 0; i < match_count; i++) {
+        if (add_argument(cmd, arg_count, matches[i]) < 0) {
+            for (int j = i + 1; j < match_count; j++) free(matches[j]);
+            free(matches);
+            return -1;
+        }
     }
+    free(matches);
+    return 0;
+}
 
-    // Check if the last non-whitespace character is a pipe
-    if (end >= temp && *end == '|') {
-        fprintf(stderr, "Error: Missing command after pipe.\n");
-        free(temp);
-        return -1;
+// Start an empty command at the end of a pipeline
+static ShellCommand *start_command(Pipeline *pipeline) {
+    ShellCommand *cmd = &pipeline->commands[pipeline->command_count++];
+    cmd->arguments = cmd->inline_arguments;
+    cmd->argument_capacity = MAX_ARGUMENTS;
+    cmd->arguments[0] = NULL;
+    cmd->input_file = NULL;
+    cmd->output_file = NULL;
+    cmd->append_output = 0;
+    cmd->error_file = NULL;
+    cmd->expanded = 0;
+    cmd->executable = NULL;
+    return cmd;
+}
+
+// Return the syntax error of a redirection without a file name
+static const char *missing_file_error(uint8_t type) {
+    switch (type) {
+        case TOKEN_INPUT: return "Missing input file for redirection";
+        case TOKEN_ERROR_OUTPUT: return "Missing error redirection file";
+        default: return "Missing output file for redirection";
     }
-    free(temp);
-
-    // Tokenize the command_line using strtok
-    token = strtok(command_line, "|");
-    while (token != NULL && pipe_count < max_pipes) {
-        // Skip leading whitespace in the token
-        char *cmd = token;
-        skip_leading_whitespace(&cmd);
-
-        // Check if the token is empty or contains only whitespace
-        if (*cmd == '\0') {
-            fprintf(stderr, "Error: Empty command between pipes.\n");
-            return -1;
+}
+
+// Parse a command line into a pipeline
+int parse_pipeline(const char *command_line, Pipeline *pipeline) {
+    TokenList tokens;
+    pipeline->command_count = 0;
+    int token_count = lex_command_line(command_line, &tokens);
+    if (token_count <= 0) return token_count;
+
+    ShellCommand *cmd = start_command(pipeline);
+    int arg_count = 0;
+    const char *error = NULL;
+    for (int i = 0; i < token_count && error == NULL; i++) {
+        const Token *token = &tokens.tokens[i];
+        switch (token->type) {
+            case TOKEN_WORD:
+                // Regular argument
+                if (token->wildcards) cmd->expanded = 1;
+                if (add_expanded_argument(cmd, &arg_count, &tokens, token) < 0) {
+                    perror("malloc");
+                    error = "";
+                }
+                cmd->arguments[arg_count] = NULL;
+                break;
+
+            case TOKEN_PIPE:
+                if (i == token_count - 1) {
+                    error = "Missing command after pipe";
+                } else if (arg_count == 0) {
+                    error = "Empty command between pipes";
+                } else if (pipeline->command_count == MAX_PIPED_COMMANDS + 1) {
+                    error = "Too many piped commands";
+                } else {
+                    cmd = start_command(pipeline);
+                    arg_count = 0;
+                }
+                break;
+
+            default: {
+                // Redirection, to or from the file named by the next word; a later one replaces an earlier one
+                if (token->type == TOKEN_INPUT && arg_count == 0) {
+                    error = "Empty argument before input redirection";
+                    break;
+                }
+                const Token *file = i + 1 < token_count ? &tokens.tokens[i + 1] : NULL;
+                if (file == NULL || file->type != TOKEN_WORD || file->length == 0) {
+                    error = missing_file_error(token->type);
+                    break;
+                }
+                i++;
+
+                char **target = token->type == TOKEN_INPUT ? &cmd->input_file
+                              : token->type == TOKEN_ERROR_OUTPUT ? &cmd->error_file : &cmd->output_file;
+                if (token->type == TOKEN_OUTPUT || token->type == TOKEN_APPEND) {
+                    cmd->append_output = token->type == TOKEN_APPEND;
+                }
+                free(*target);
+                *target = copy_word(&tokens, file);
+                if (*target == NULL) {
+                    perror("malloc");
+                    error = "";
+                }
+                break;
+            }
         }
+    }
+    if (error == NULL && arg_count == 0) error = "Missing command";
 
-        piped_commands[pipe_count++] = cmd;
-        token = strtok(NULL, "|");
+    // If there was an error during parsing, no command is executed
+    if (error != NULL) {
+        if (error[0] != '\0') fprintf(stderr, "Error: %s.\n", error);
+        free_pipeline(pipeline);
+        return -1;
     }
+    return pipeline->command_count;
+}
 
-    // Null-terminate the piped_commands array
-    piped_commands[pipe_count] = NULL;
+// Free the commands of a parsed pipeline
+void free_pipeline(Pipeline *pipeline) {
+    for (int i = 0; i < pipeline->command_count; i++) {
+        free_shell_command(&pipeline->commands[i]);
+    }
+    pipeline->command_count = 0;
+}
 
-    return pipe_count;
-}
\ No newline at end of file
+// Free the strings a parsed ShellCommand owns
+void free_shell_command(ShellCommand *cmd) {
+    for (int i = 0; cmd->arguments[i] != NULL; i++) {
+        free(cmd->arguments[i]);
+    }
+    if (cmd->arguments != cmd->inline_arguments) free(cmd->arguments);
+    cmd->arguments = cmd->inline_arguments;
+    cmd->argument_capacity = MAX_ARGUMENTS;
+    cmd->arguments[0] = NULL;
+    free(cmd->input_file);
+    free(cmd->output_file);
+    free(cmd->error_file);
+    free(cmd->executable);
+    cmd->input_file = cmd->output_file = cmd->error_file = cmd->executable = NULL;
+}
@@ -1,21 +1,56 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <stdint.h>
 #include "shell.h"
 
-// Function to parse a single shell command from the command line input
-void parse_shell_command(char *command_line, ShellCommand *cmd);
+#define MAX_TOKENS MAX_COMMAND_LENGTH   // Every token takes at least one byte of the line
 
-// Function to split the command line into multiple piped commands
-int split_piped_commands(char *command_line, char *piped_commands[], int max_pipes);
+// Kinds of token the lexer makes of a command line
+typedef enum {
+    TOKEN_WORD,            // An argument or file name, with its quotes removed
+    TOKEN_PIPE,            // |
+    TOKEN_INPUT,           // <
+    TOKEN_OUTPUT,          // >
+    TOKEN_APPEND,          // >>
+    TOKEN_ERROR_OUTPUT     // 2>
+} TokenType;
 
-// Function to skip leading whitespace characters in the given string
-void skip_leading_whitespace(char **str);
+// Structure to hold one token; a word's text and pattern are offsets into its TokenList
+typedef struct {
+    uint8_t type;
+    uint8_t wildcards;     // Whether the word has an unquoted wildcard, so it has a pattern
+    uint16_t text;         // Offset of the NUL-terminated word in text
+    uint16_t pattern;      // Offset of the word with its quoted wildcards escaped in patterns
+    uint16_t length;       // Length of the word
+} Token;
 
-// Function to extract the filename for input/output redirection from the command line
-char *parse_redirection_filename(char **str);
+// Structure to hold the tokens of a command line, kept by the caller so lexing is reentrant
+typedef struct {
+    Token tokens[MAX_TOKENS];
+    int count;
+    char text[MAX_COMMAND_LENGTH + 1];
+    char patterns[2 * MAX_COMMAND_LENGTH + 1];  // Room for every character to be escaped
+} TokenList;
 
-// Function to parse a single argument from the command line and stores it in the buffer
-void parse_single_argument(char **str, char *buffer);
+// Structure to hold a parsed command line: the commands between its pipes
+typedef struct {
+    ShellCommand commands[MAX_PIPED_COMMANDS + 1];
+    int command_count;
+} Pipeline;
+
+// Function to split a command line into tokens in one pass; returns the number of tokens, or -1 after
+// printing why the line is too long
+int lex_command_line(const char *command_line, TokenList *tokens);
+
+// Function to parse a command line into a pipeline, expanding wildcards; returns the number of commands,
+// 0 for a blank line, or -1 after printing the syntax error. Free it with free_pipeline.
+int parse_pipeline(const char *command_line, Pipeline *pipeline);
+
+// Function to free the commands of a parsed pipeline
+void free_pipeline(Pipeline *pipeline);
+
+// Function to free the strings a parsed ShellCommand owns
+void free_shell_command(ShellCommand *cmd);
 
 #endif
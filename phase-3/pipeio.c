@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "pipeio.h"
+
+// Whether pipes are enlarged and relayed with splice
+static int high_throughput_mode = 0;
+
+// Enable or disable the high-throughput pipe mode
+void set_high_throughput_mode(int enabled) {
+    high_throughput_mode = enabled;
+}
+
+// Check if the high-throughput pipe mode is enabled
+int is_high_throughput_mode(void) {
+    return high_throughput_mode;
+}
+
+// Create a pipe, enlarging its buffer in high-throughput mode
+int create_pipe(int pipe_fds[2]) {
+    // Close-on-exec, so children forked concurrently by other threads cannot hold the pipe open;
+    // the ends a child uses are dup2'd onto its standard descriptors, which clears the flag
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    if (high_throughput_mode) {
+        // Unprivileged processes are capped by /proc/sys/fs/pipe-max-size, so back off until accepted
+        for (int size = HIGH_THROUGHPUT_PIPE_SIZE; size > 65536; size /= 2) {
+            if (fcntl(pipe_fds[1], F_SETPIPE_SZ, size) >= 0) break;
+        }
+    }
+    return 0;
+}
+
+// Write the whole buffer, retrying on short writes and interrupts
+int write_all(int fd, const void *data, size_t length) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Copy length bytes from the pipe with read and write, used when splice is not supported
+static int copy_from_pipe(int pipe_fd, int out_fd, size_t length) {
+    char buffer[65536];
+
+    while (length > 0) {
+        ssize_t read_bytes = read(pipe_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+        if (read_bytes < 0 && errno == EINTR) continue;
+        if (read_bytes <= 0) return -1;
+        for (ssize_t offset = 0; offset < read_bytes;) {
+            ssize_t written = write(out_fd, buffer + offset, read_bytes - offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            offset += written;
+        }
+        length -= read_bytes;
+    }
+    return 0;
+}
+
+// Move length bytes from the pipe to out_fd inside the kernel, without copying through user space
+int splice_from_pipe(int pipe_fd, int out_fd, size_t length) {
+    int spliced = 0;
+
+    while (length > 0) {
+        ssize_t moved = splice(pipe_fd, NULL, out_fd, NULL, length, SPLICE_F_MOVE);
+        if (moved == 0) return -1; // Writer closed the pipe early
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL && !spliced) {
+                // The destination does not support splice (e.g. opened with O_APPEND)
+                return copy_from_pipe(pipe_fd, out_fd, length);
+            }
+            return -1;
+        }
+        spliced = 1;
+        length -= moved;
+    }
+    return 0;
+}
+
+// Copy what the pipe holds to a file at *offset with read and pwrite, for files that do not support splice;
+// once the file failed the data is only read. Returns the bytes taken from the pipe, or -1.
+static ssize_t copy_pipe_to_file(int pipe_fd, int out_fd, off_t *offset, size_t length, int *file_error) {
+    char buffer[65536];
+    ssize_t read_bytes = read(pipe_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+    if (read_bytes <= 0) return -1;
+    for (ssize_t done = 0; done < read_bytes && *file_error == 0;) {
+        ssize_t written = pwrite(out_fd, buffer + done, read_bytes - done, *offset);
+        if (written < 0) {
+            if (errno != EINTR) *file_error = errno;
+            continue;
+        }
+        done += written;
+        *offset += written;
+    }
+    return read_bytes;
+}
+
+// Move length bytes from a socket or pipe into a file, with the pipe in between since splice needs one
+int splice_to_file(int in_fd, int out_fd, off_t *offset, size_t length, int pipe_fds[2], int *file_error) {
+    int copying = 0;
+
+    while (length > 0) {
+        ssize_t received = splice(in_fd, NULL, pipe_fds[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) {
+            if (received == 0) errno = EPROTO; // The input ended early
+            return -1;
+        }
+        length -= received;
+
+        // Empty the pipe into the file, or only empty it once the file failed
+        size_t pending = received;
+        while (pending > 0) {
+            ssize_t moved;
+            if (*file_error == 0 && !copying) {
+                moved = splice(pipe_fds[0], NULL, out_fd, (loff_t *)offset, pending, SPLICE_F_MOVE);
+                if (moved < 0 && errno == EINVAL) {
+                    copying = 1; // The file does not support splice
+                    continue;
+                }
+                if (moved == 0) errno = EIO;
+                if (moved <= 0 && errno != EINTR) *file_error = errno;
+            } else {
+                moved = copy_pipe_to_file(pipe_fds[0], out_fd, offset, pending, file_error);
+                if (moved < 0 && errno != EINTR) return -1;
+            }
+            if (moved > 0) pending -= moved;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef PIPEIO_H
+#define PIPEIO_H
+
+#include <sys/types.h>
+
+#define HIGH_THROUGHPUT_PIPE_SIZE (1024 * 1024) // Pipe capacity requested in high-throughput mode
+
+// Function to enable or disable the high-throughput pipe mode
+void set_high_throughput_mode(int enabled);
+
+// Function to check if the high-throughput pipe mode is enabled
+int is_high_throughput_mode(void);
+
+// Function to create a close-on-exec pipe, enlarged to HIGH_THROUGHPUT_PIPE_SIZE in high-throughput mode
+int create_pipe(int pipe_fds[2]);
+
+// Function to write the whole buffer to fd, retrying on short writes, returns 0 or -1 on an error
+int write_all(int fd, const void *data, size_t length);
+
+// Function to move exactly length bytes from a pipe to a file or socket with splice, returns 0 or -1
+int splice_from_pipe(int pipe_fd, int out_fd, size_t length);
+
+// Function to move exactly length bytes from a socket or pipe into a file at *offset through a pipe, advancing
+// *offset. The input is consumed even if the file fails, which sets *file_error and discards the rest.
+// Returns 0, or -1 if the input ended or failed first.
+int splice_to_file(int in_fd, int out_fd, off_t *offset, size_t length, int pipe_fds[2], int *file_error);
+
+#endif
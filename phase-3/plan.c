@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "plan.h"
+#include "parser.h"
+
+// A plan is the pipeline parse_pipeline makes of a command line, with each
+// command's executable looked up in PATH. Sessions sending the same line again share the cached plan
+// instead of parsing it again. Plans are immutable once cached and reference counted, so a plan evicted
+// while a session runs it is freed when that session releases it. The cache is split into shards by the
+// hash of the line, each with its own lock, buckets and least recently used list, and each shard evicts
+// its oldest plans once they take more than its share of PLAN_CACHE_BYTES. Lines with wildcards are not
+// cached, since what they expand to changes with the file system.
+
+#define PLAN_SHARD_BUCKETS 256
+#define DEFAULT_PATH "/bin:/usr/bin"   // Searched like execvp when there is no PATH
+
+struct CommandPlan {
+    uint64_t hash;
+    char *line;
+    ShellCommand *commands[MAX_PIPED_COMMANDS + 2];  // Into stages, as the executors take them
+    int command_count;
+    size_t size;                       // Bytes counted against the cache
+    time_t parsed_at;                  // Monotonic seconds
+    int references;                    // Updated atomically; the cache holds one while the plan is cached
+    struct CommandPlan *bucket_next;
+    struct CommandPlan *newer;         // Least recently used list of the shard
+    struct CommandPlan *older;
+    ShellCommand stages[];             // Only as many as the line has, unlike a Pipeline
+};
+
+// Structure to hold one independently locked part of the cache
+typedef struct {
+    pthread_mutex_t lock;
+    CommandPlan *buckets[PLAN_SHARD_BUCKETS];
+    CommandPlan *newest;
+    CommandPlan *oldest;
+    size_t bytes;
+} PlanShard;
+
+static PlanShard shards[PLAN_CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static uint64_t hits = 0;
+static uint64_t misses = 0;
+
+// Initialize the locks of the shards
+static void init_shards(void) {
+    for (int i = 0; i < PLAN_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+// Return the FNV-1a hash of a line
+static uint64_t hash_line(const char *line) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)line; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Return the current monotonic time in seconds
+static time_t monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+// Find the executable execvp would run for a command name, as a malloc'd path; NULL for names with a
+// '/', names not found, and a PATH with empty entries, which stand for the working directory
+static char *find_executable(const char *name) {
+    if (strchr(name, '/') != NULL || name[0] == '\0') return NULL;
+    const char *path = getenv("PATH");
+    if (path == NULL) path = DEFAULT_PATH;
+
+    size_t name_length = strlen(name);
+    for (const char *start = path;; start++) {
+        const char *end = strchr(start, ':');
+        size_t length = end != NULL ? (size_t)(end - start) : strlen(start);
+        if (length == 0) return NULL;
+
+        char *candidate = malloc(length + 1 + name_length + 1);
+        if (candidate == NULL) return NULL;
+        memcpy(candidate, start, length);
+        candidate[length] = '/';
+        memcpy(candidate + length + 1, name, name_length + 1);
+        if (access(candidate, X_OK) == 0) return candidate;
+        free(candidate);
+
+        if (end == NULL) return NULL;
+        start = end;
+    }
+}
+
+// Free a plan and its commands
+static void free_plan(CommandPlan *plan) {
+    for (int i = 0; i < plan->command_count; i++) {
+        free_shell_command(&plan->stages[i]);
+    }
+    free(plan->line);
+    free(plan);
+}
+
+// Parse a command line into a new plan holding one reference; *cacheable is cleared if the plan depends
+// on the file system
+static CommandPlan *build_plan(const char *command_line, uint64_t hash, int *cacheable) {
+    Pipeline pipeline;
+    int count = parse_pipeline(command_line, &pipeline);
+    if (count <= 0) return NULL;
+
+    size_t plan_size = sizeof(CommandPlan) + count * sizeof(ShellCommand);
+    CommandPlan *plan = calloc(1, plan_size);
+    if (plan == NULL || (plan->line = strdup(command_line)) == NULL) {
+        free(plan);
+        free_pipeline(&pipeline);
+        return NULL;
+    }
+    plan->hash = hash;
+    plan->references = 1;
+    plan->parsed_at = monotonic_seconds();
+    plan->size = plan_size + strlen(command_line) + 1;
+
+    *cacheable = 1;
+    for (int i = 0; i < count; i++) {
+        // The plan takes over the command's strings; arguments still in the inline array move along with it
+        ShellCommand *cmd = &plan->stages[i];
+        *cmd = pipeline.commands[i];
+        if (pipeline.commands[i].arguments == pipeline.commands[i].inline_arguments) {
+            cmd->arguments = cmd->inline_arguments;
+        }
+        plan->commands[i] = cmd;
+        plan->command_count++;
+        if (cmd->expanded) *cacheable = 0;
+
+        cmd->executable = find_executable(cmd->arguments[0]);
+        for (int j = 0; cmd->arguments[j] != NULL; j++) plan->size += strlen(cmd->arguments[j]) + 1;
+        if (cmd->arguments != cmd->inline_arguments) plan->size += cmd->argument_capacity * sizeof(char *);
+        if (cmd->input_file != NULL) plan->size += strlen(cmd->input_file) + 1;
+        if (cmd->output_file != NULL) plan->size += strlen(cmd->output_file) + 1;
+        if (cmd->error_file != NULL) plan->size += strlen(cmd->error_file) + 1;
+        if (cmd->executable != NULL) plan->size += strlen(cmd->executable) + 1;
+    }
+    plan->commands[count] = NULL;
+    return plan;
+}
+
+// Take a cached plan out of its shard's buckets and list, dropping the cache's reference; the shard's
+// lock must be held
+static void remove_plan(PlanShard *shard, CommandPlan *plan) {
+    CommandPlan **link = &shard->buckets[(plan->hash / PLAN_CACHE_SHARDS) % PLAN_SHARD_BUCKETS];
+    while (*link != plan) link = &(*link)->bucket_next;
+    *link = plan->bucket_next;
+
+    if (plan->newer != NULL) plan->newer->older = plan->older;
+    else shard->newest = plan->older;
+    if (plan->older != NULL) plan->older->newer = plan->newer;
+    else shard->oldest = plan->newer;
+
+    shard->bytes -= plan->size;
+    plan_release(plan);
+}
+
+// Put a plan at the newest end of its shard's list; the shard's lock must be held
+static void link_newest(PlanShard *shard, CommandPlan *plan) {
+    plan->newer = NULL;
+    plan->older = shard->newest;
+    if (shard->newest != NULL) shard->newest->newer = plan;
+    else shard->oldest = plan;
+    shard->newest = plan;
+}
+
+// Find the plan of a command line, parsing it and caching the result on a miss
+CommandPlan *plan_acquire(const char *command_line) {
+    pthread_once(&shards_once, init_shards);
+    uint64_t hash = hash_line(command_line);
+    PlanShard *shard = &shards[hash % PLAN_CACHE_SHARDS];
+    CommandPlan **bucket = &shard->buckets[(hash / PLAN_CACHE_SHARDS) % PLAN_SHARD_BUCKETS];
+
+    pthread_mutex_lock(&shard->lock);
+    for (CommandPlan *plan = *bucket; plan != NULL; plan = plan->bucket_next) {
+        if (plan->hash != hash || strcmp(plan->line, command_line) != 0) continue;
+        if (monotonic_seconds() - plan->parsed_at >= PLAN_CACHE_TTL_SECONDS) {
+            remove_plan(shard, plan);
+            break;
+        }
+
+        // Move the plan to the newest end of the list
+        if (shard->newest != plan) {
+            plan->newer->older = plan->older;
+            if (plan->older != NULL) plan->older->newer = plan->newer;
+            else shard->oldest = plan->newer;
+            link_newest(shard, plan);
+        }
+        __atomic_add_fetch(&plan->references, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->lock);
+        __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+        return plan;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+
+    // Parse outside the lock, so other lines of the shard are not held up
+    int cacheable = 0;
+    CommandPlan *plan = build_plan(command_line, hash, &cacheable);
+    if (plan == NULL || !cacheable || plan->size > PLAN_CACHE_BYTES / PLAN_CACHE_SHARDS) return plan;
+
+    pthread_mutex_lock(&shard->lock);
+    for (CommandPlan *other = *bucket; other != NULL; other = other->bucket_next) {
+        if (other->hash == hash && strcmp(other->line, command_line) == 0) {
+            // Another session cached the line meanwhile; this plan is only used once
+            pthread_mutex_unlock(&shard->lock);
+            return plan;
+        }
+    }
+    plan->references++;
+    plan->bucket_next = *bucket;
+    *bucket = plan;
+    link_newest(shard, plan);
+    shard->bytes += plan->size;
+    while (shard->bytes > PLAN_CACHE_BYTES / PLAN_CACHE_SHARDS) {
+        remove_plan(shard, shard->oldest);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return plan;
+}
+
+// Release a reference to a plan
+void plan_release(CommandPlan *plan) {
+    if (__atomic_sub_fetch(&plan->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_plan(plan);
+    }
+}
+
+// Get the commands of a plan's pipeline
+ShellCommand **plan_commands(CommandPlan *plan, int *command_count) {
+    *command_count = plan->command_count;
+    return plan->commands;
+}
+
+// Read the cache's hits, misses and the bytes its plans take
+uint64_t plan_cache_hits(void) {
+    return __atomic_load_n(&hits, __ATOMIC_RELAXED);
+}
+
+uint64_t plan_cache_misses(void) {
+    return __atomic_load_n(&misses, __ATOMIC_RELAXED);
+}
+
+uint64_t plan_cache_bytes(void) {
+    pthread_once(&shards_once, init_shards);
+    uint64_t bytes = 0;
+    for (int i = 0; i < PLAN_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        bytes += shards[i].bytes;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    return bytes;
+}
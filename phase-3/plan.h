@@ -0,0 +1,29 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+#include "shell.h"
+
+#define PLAN_CACHE_BYTES (4 * 1024 * 1024)   // Memory all cached plans may take together
+#define PLAN_CACHE_SHARDS 16                 // Independently locked parts of the cache
+#define PLAN_CACHE_TTL_SECONDS 30            // Age after which a plan is parsed again, to notice new executables
+
+typedef struct CommandPlan CommandPlan;
+
+// Function to find the plan of a command line, split on '|' and parsed, with the executables found in
+// PATH. Plans of lines without wildcards are cached; returns a reference to release with plan_release,
+// or NULL if the line does not parse.
+CommandPlan *plan_acquire(const char *command_line);
+
+// Function to release a reference to a plan
+void plan_release(CommandPlan *plan);
+
+// Function to get the commands of a plan's pipeline, shared with other sessions and never to be modified
+ShellCommand **plan_commands(CommandPlan *plan, int *command_count);
+
+// Functions to read the cache's hits, misses and the bytes its plans take, for metrics
+uint64_t plan_cache_hits(void);
+uint64_t plan_cache_misses(void);
+uint64_t plan_cache_bytes(void);
+
+#endif
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "protocol.h"
+#include "pipeio.h"
+
+// Fill a frame header
+void encode_frame_header(uint8_t *header, uint8_t type, uint32_t length) {
+    uint32_t network_length = htobe32(length);
+    header[0] = type;
+    memcpy(header + 1, &network_length, sizeof(network_length));
+}
+
+// Write all iovecs, retrying on short writes
+static int writev_all(int sock, struct iovec *iov, int iov_count) {
+    while (iov_count > 0) {
+        ssize_t written = writev(sock, iov, iov_count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Read exactly length bytes, returns 1 on success, 0 on EOF before any byte or -1 on error
+static int recv_all(int sock, void *buffer, size_t length) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t bytes = recv(sock, (char *)buffer + received, length - received, 0);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytes == 0) {
+            if (received == 0) return 0;
+            errno = EPROTO; // Connection closed in the middle of a frame
+            return -1;
+        }
+        received += bytes;
+    }
+    return 1;
+}
+
+// Send a complete frame; header and payload go out in one write so they share a segment
+int send_frame(int sock, uint8_t type, const void *payload, uint32_t length) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+
+    encode_frame_header(header, type, length);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = length;
+    return writev_all(sock, iov, length > 0 ? 2 : 1);
+}
+
+// Send whatever the pipe holds as one frame, moving the payload inside the kernel
+ssize_t splice_frame_from_pipe(int sock, uint8_t type, int pipe_fd) {
+    struct pollfd pfd = { .fd = pipe_fd, .events = POLLIN };
+    int available = 0;
+
+    // Wait until the pipe has data or the writer is gone
+    while (available == 0) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (ioctl(pipe_fd, FIONREAD, &available) < 0) return -1;
+        if (available == 0 && (pfd.revents & (POLLHUP | POLLERR))) return 0;
+    }
+    if (available > FRAME_MAX_PAYLOAD) available = FRAME_MAX_PAYLOAD;
+
+    // The header must announce the length, so only move what is already buffered
+    uint8_t header[FRAME_HEADER_SIZE];
+    encode_frame_header(header, type, (uint32_t)available);
+    struct iovec iov = { header, sizeof(header) };
+    if (writev_all(sock, &iov, 1) < 0) return -1;
+    if (splice_from_pipe(pipe_fd, sock, available) < 0) return -1;
+    return available;
+}
+
+// Receive a frame into the buffer
+int recv_frame(int sock, uint8_t *type, void *payload, uint32_t capacity, uint32_t *length) {
+    int status = recv_frame_header(sock, type, length);
+    if (status <= 0) return status;
+    if (*length > capacity) {
+        errno = EMSGSIZE; // The stream cannot be resynchronized after an oversized frame
+        return -1;
+    }
+    return recv_frame_payload(sock, payload, *length) < 0 ? -1 : 1;
+}
+
+// Receive the header of a frame
+int recv_frame_header(int sock, uint8_t *type, uint32_t *length) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    uint32_t network_length;
+
+    int status = recv_all(sock, header, sizeof(header));
+    if (status <= 0) return status;
+
+    memcpy(&network_length, header + 1, sizeof(network_length));
+    *type = header[0];
+    *length = be32toh(network_length);
+    return 1;
+}
+
+// Receive the payload of a frame
+int recv_frame_payload(int sock, void *payload, uint32_t length) {
+    int status = length > 0 ? recv_all(sock, payload, length) : 1;
+    if (status == 0) errno = EPROTO; // Connection closed between header and payload
+    return status <= 0 ? -1 : 0;
+}
+
+// Send part of a file as one frame; the payload goes from the page cache to the socket without a copy
+ssize_t send_file_frame(int sock, uint8_t type, int fd, off_t *offset, uint32_t length) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    encode_frame_header(header, type, length);
+    while (send(sock, header, sizeof(header), MSG_MORE | MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) return -1;
+    }
+
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t bytes = sendfile(sock, fd, offset, length - sent);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0) return -1;
+        if (bytes == 0) break;
+        sent += bytes;
+    }
+
+    // The header announced the length, so a file that shrank meanwhile leaves zeros in the frame
+    static const char zeros[4096];
+    for (size_t padded = sent; padded < length;) {
+        size_t chunk = length - padded < sizeof(zeros) ? length - padded : sizeof(zeros);
+        ssize_t bytes = send(sock, zeros, chunk, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0) return -1;
+        padded += bytes;
+    }
+    return (ssize_t)sent;
+}
+
+// Append a big-endian 64-bit value
+static uint8_t *put_u64(uint8_t *out, uint64_t value) {
+    value = htobe64(value);
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+}
+
+// Append a big-endian 32-bit value
+static uint8_t *put_u32(uint8_t *out, uint32_t value) {
+    value = htobe32(value);
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+}
+
+// Read a big-endian 64-bit value
+static const uint8_t *get_u64(const uint8_t *in, uint64_t *value) {
+    memcpy(value, in, sizeof(*value));
+    *value = be64toh(*value);
+    return in + sizeof(*value);
+}
+
+// Read a big-endian 32-bit value
+static const uint8_t *get_u32(const uint8_t *in, uint32_t *value) {
+    memcpy(value, in, sizeof(*value));
+    *value = be32toh(*value);
+    return in + sizeof(*value);
+}
+
+// Encode a CommandResult in network byte order
+void encode_command_result(const CommandResult *result, uint8_t *buffer) {
+    buffer = put_u32(buffer, (uint32_t)result->exit_code);
+    buffer = put_u32(buffer, (uint32_t)result->term_signal);
+    buffer = put_u64(buffer, result->queue_us);
+    buffer = put_u64(buffer, result->spawn_us);
+    buffer = put_u64(buffer, result->first_byte_us);
+    buffer = put_u64(buffer, result->complete_us);
+    buffer = put_u64(buffer, result->user_cpu_us);
+    buffer = put_u64(buffer, result->sys_cpu_us);
+    put_u64(buffer, result->max_rss_kb);
+}
+
+// Decode a CommandResult
+int decode_command_result(const uint8_t *buffer, uint32_t length, CommandResult *result) {
+    uint32_t exit_code, term_signal;
+    if (length != COMMAND_RESULT_SIZE) return -1;
+
+    buffer = get_u32(buffer, &exit_code);
+    buffer = get_u32(buffer, &term_signal);
+    buffer = get_u64(buffer, &result->queue_us);
+    buffer = get_u64(buffer, &result->spawn_us);
+    buffer = get_u64(buffer, &result->first_byte_us);
+    buffer = get_u64(buffer, &result->complete_us);
+    buffer = get_u64(buffer, &result->user_cpu_us);
+    buffer = get_u64(buffer, &result->sys_cpu_us);
+    get_u64(buffer, &result->max_rss_kb);
+    result->exit_code = (int32_t)exit_code;
+    result->term_signal = (int32_t)term_signal;
+    return 0;
+}
+
+// Encode a terminal window size
+void encode_window_size(uint16_t rows, uint16_t columns, uint8_t *buffer) {
+    uint16_t value = htobe16(rows);
+    memcpy(buffer, &value, sizeof(value));
+    value = htobe16(columns);
+    memcpy(buffer + 2, &value, sizeof(value));
+}
+
+// Decode a terminal window size
+int decode_window_size(const uint8_t *buffer, uint32_t length, uint16_t *rows, uint16_t *columns) {
+    if (length < WINDOW_SIZE_SIZE) return -1;
+    memcpy(rows, buffer, sizeof(*rows));
+    memcpy(columns, buffer + 2, sizeof(*columns));
+    *rows = be16toh(*rows);
+    *columns = be16toh(*columns);
+    return 0;
+}
+
+// Encode the session token frame
+void encode_session_frame(uint64_t token, uint64_t replay_offset, uint64_t journal_end, int running, uint8_t *buffer) {
+    buffer = put_u64(buffer, token);
+    buffer = put_u64(buffer, replay_offset);
+    buffer = put_u64(buffer, journal_end);
+    *buffer = running ? 1 : 0;
+}
+
+// Decode the session token frame
+int decode_session_frame(const uint8_t *buffer, uint32_t length, uint64_t *token, uint64_t *replay_offset,
+                         uint64_t *journal_end, int *running) {
+    if (length != SESSION_FRAME_SIZE) return -1;
+    buffer = get_u64(buffer, token);
+    buffer = get_u64(buffer, replay_offset);
+    buffer = get_u64(buffer, journal_end);
+    *running = *buffer != 0;
+    return 0;
+}
+
+// Encode a resume request
+void encode_resume_frame(uint64_t token, uint64_t received_offset, uint8_t *buffer) {
+    buffer = put_u64(buffer, token);
+    put_u64(buffer, received_offset);
+}
+
+// Decode a resume request
+int decode_resume_frame(const uint8_t *buffer, uint32_t length, uint64_t *token, uint64_t *received_offset) {
+    if (length != RESUME_FRAME_SIZE) return -1;
+    buffer = get_u64(buffer, token);
+    get_u64(buffer, received_offset);
+    return 0;
+}
+
+// Encode the run time allowed to the next command
+void encode_deadline_frame(uint32_t milliseconds, uint8_t *buffer) {
+    uint32_t value = htobe32(milliseconds);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+// Decode the run time allowed to the next command
+int decode_deadline_frame(const uint8_t *buffer, uint32_t length, uint32_t *milliseconds) {
+    if (length != DEADLINE_FRAME_SIZE) return -1;
+    memcpy(milliseconds, buffer, sizeof(*milliseconds));
+    *milliseconds = be32toh(*milliseconds);
+    return 0;
+}
+
+// Parse a deadline in seconds, which may have a fraction
+int parse_deadline_seconds(const char *text, uint32_t *milliseconds) {
+    char *end;
+    errno = 0;
+    double seconds = strtod(text, &end);
+    // The comparison also rejects NaN
+    if (end == text || *end != '\0' || errno != 0 || !(seconds >= 0 && seconds <= UINT32_MAX / 1000)) return -1;
+    *milliseconds = (uint32_t)(seconds * 1000);
+    return 0;
+}
+
+// Encode the start of a completion request or reply
+void encode_completion_header(uint32_t request_id, uint8_t kind_or_flags, uint8_t *buffer) {
+    uint32_t value = htobe32(request_id);
+    memcpy(buffer, &value, sizeof(value));
+    buffer[sizeof(value)] = kind_or_flags;
+}
+
+// Decode the start of a completion request or reply
+int decode_completion_header(const uint8_t *buffer, uint32_t length, uint32_t *request_id, uint8_t *kind_or_flags) {
+    if (length < COMPLETION_HEADER_SIZE) return -1;
+    memcpy(request_id, buffer, sizeof(*request_id));
+    *request_id = be32toh(*request_id);
+    *kind_or_flags = buffer[sizeof(*request_id)];
+    return 0;
+}
+
+// Encode a transfer request
+int encode_transfer_request(uint8_t flags, uint64_t size, const char *path, uint8_t *buffer, size_t capacity) {
+    size_t path_length = strlen(path);
+    if (TRANSFER_REQUEST_HEADER_SIZE + path_length + 1 > capacity) return -1;
+    buffer[0] = flags;
+    put_u64(buffer + 1, size);
+    memcpy(buffer + TRANSFER_REQUEST_HEADER_SIZE, path, path_length + 1);
+    return (int)(TRANSFER_REQUEST_HEADER_SIZE + path_length + 1);
+}
+
+// Decode a transfer request; the path must be null-terminated and not empty
+int decode_transfer_request(const uint8_t *buffer, uint32_t length, uint8_t *flags, uint64_t *size, const char **path) {
+    if (length < TRANSFER_REQUEST_HEADER_SIZE + 2 || buffer[length - 1] != '\0') return -1;
+    *flags = buffer[0];
+    get_u64(buffer + 1, size);
+    *path = (const char *)buffer + TRANSFER_REQUEST_HEADER_SIZE;
+    return 0;
+}
+
+// Encode a transfer reply
+void encode_transfer_reply(int32_t error, uint64_t size, uint64_t offset, uint8_t *buffer) {
+    uint8_t *out = put_u32(buffer, (uint32_t)error);
+    out = put_u64(out, size);
+    put_u64(out, offset);
+}
+
+// Decode a transfer reply
+int decode_transfer_reply(const uint8_t *buffer, uint32_t length, int32_t *error, uint64_t *size, uint64_t *offset) {
+    if (length != TRANSFER_REPLY_SIZE) return -1;
+    uint32_t value;
+    const uint8_t *in = get_u32(buffer, &value);
+    *error = (int32_t)value;
+    in = get_u64(in, size);
+    get_u64(in, offset);
+    return 0;
+}
+
+// Encode the flags and name that start an upload piece
+int encode_upload_header(uint8_t flags, const char *name, uint8_t *buffer) {
+    size_t name_length = strlen(name);
+    if (name_length > UPLOAD_NAME_MAX) return -1;
+    buffer[0] = flags;
+    memcpy(buffer + 1, name, name_length + 1);
+    return (int)(1 + name_length + 1);
+}
+
+// Decode the flags and name that start an upload piece
+int decode_upload_header(const uint8_t *buffer, uint32_t length, uint8_t *flags, const char **name,
+                         uint32_t *header_length) {
+    if (length < 2) return -1;
+    const uint8_t *end = memchr(buffer + 1, '\0', length - 1 < UPLOAD_NAME_MAX + 1 ? length - 1 : UPLOAD_NAME_MAX + 1);
+    if (end == NULL) return -1;
+    *flags = buffer[0];
+    *name = (const char *)buffer + 1;
+    *header_length = (uint32_t)(end - buffer) + 1;
+    return 0;
+}
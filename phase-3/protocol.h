@@ -0,0 +1,157 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Every message between client and server is a frame: a 1-byte type, a 4-byte big-endian
+// payload length, then the payload.
+#define FRAME_HEADER_SIZE 5
+#define FRAME_MAX_PAYLOAD (1024 * 1024) // Largest payload either side accepts
+
+// Frame types
+#define FRAME_COMMAND 1  // Client -> server: a command line to execute
+#define FRAME_STDOUT  2  // Server -> client: output of the running command
+#define FRAME_RESULT  3  // Server -> client: the command finished, payload is an encoded CommandResult
+#define FRAME_STDIN   4  // Client -> server: input for the running command, an empty payload closes its stdin
+#define FRAME_PTY_COMMAND 5 // Client -> server: window size, then a command line to run under a pseudo-terminal
+#define FRAME_WINSIZE 6  // Client -> server: the terminal of a pseudo-terminal command was resized
+#define FRAME_SESSION 7  // Server -> client: session token, replay start and end offsets, command running flag
+#define FRAME_RESUME  8  // Client -> server, first frame of a reconnection: session token and bytes received
+#define FRAME_STDERR  9  // Server -> client: error output of the running command, kept apart from FRAME_STDOUT
+#define FRAME_CANCEL  10 // Client -> server: signal number (one byte) to send to the running command's process group
+#define FRAME_DEADLINE 11 // Client -> server: run time allowed to the next command, in milliseconds
+#define FRAME_COMPLETE 12 // Client -> server: request id and kind, then the word to complete
+#define FRAME_COMPLETIONS 13 // Server -> client: request id and flags, then the candidates, each null-terminated
+#define FRAME_UPLOAD 14   // Client -> server: flags and a null-terminated name, then a piece of a file kept in server memory
+#define FRAME_GET     15 // Client -> server: transfer request for a file to download
+#define FRAME_PUT     16 // Client -> server: transfer request for a file to upload, its data follows the server's reply
+#define FRAME_TRANSFER 17 // Either way: transfer reply, with an error or the file size and the offset the data starts at
+#define FRAME_FILE_DATA 18 // Either way: a piece of the file being transferred
+#define FRAME_TRANSFER_DONE 19 // Server -> client: transfer reply with how the transfer ended and the offset it reached
+
+#define FRAME_STDIN_MAX (64 * 1024) // Largest input frame; the client sends its input in chunks of this size
+#define WINDOW_SIZE_SIZE 4          // Encoded window size: rows and columns as big-endian 16-bit values
+#define SESSION_FRAME_SIZE (8 + 8 + 8 + 1) // Encoded FRAME_SESSION payload
+#define RESUME_FRAME_SIZE (8 + 8)          // Encoded FRAME_RESUME payload
+#define CANCEL_FRAME_SIZE 1                // Encoded FRAME_CANCEL payload
+#define DEADLINE_FRAME_SIZE 4              // Encoded FRAME_DEADLINE payload
+#define COMPLETION_HEADER_SIZE (4 + 1)     // Encoded start of FRAME_COMPLETE and FRAME_COMPLETIONS payloads
+#define TRANSFER_REQUEST_HEADER_SIZE (1 + 8) // Encoded start of FRAME_GET and FRAME_PUT payloads, before the path
+#define TRANSFER_REPLY_SIZE (4 + 8 + 8)    // Encoded FRAME_TRANSFER and FRAME_TRANSFER_DONE payloads
+#define TRANSFER_CHUNK (1024 * 1024)       // Largest FRAME_FILE_DATA payload
+
+// What the word of a FRAME_COMPLETE is completed as
+#define COMPLETE_COMMAND 0       // A command name: an executable in the server's PATH or a builtin
+#define COMPLETE_PATH    1       // A file name, relative to the server's working directory
+
+#define COMPLETIONS_TRUNCATED 1  // Flag of a FRAME_COMPLETIONS that does not hold every candidate
+
+#define TRANSFER_RESUME 1        // Flag of a transfer request to continue from what the destination already holds
+
+// An upload named "" is the stdin of the next command; a named one is read by '<@name' redirections
+#define UPLOAD_NAME_MAX 64       // Longest upload name
+#define UPLOAD_FIRST 1           // Flag of the first piece of an upload, which replaces an upload of the same name
+#define UPLOAD_LAST  2           // Flag of the last piece, after which commands can read the upload
+
+// Structure to hold how a remote command finished and what it cost. Times are in
+// microseconds, measured from the moment the server received the command frame.
+typedef struct {
+    int32_t exit_code;       // Exit status of the command (of the last stage for pipelines)
+    int32_t term_signal;     // Signal that terminated the command, 0 if it exited normally
+    uint64_t queue_us;       // Until the server started spawning (parsing and setup)
+    uint64_t spawn_us;       // Until every process of the command was forked
+    uint64_t first_byte_us;  // Until the first output byte was read, 0 if there was no output
+    uint64_t complete_us;    // Until every process was reaped and the output was drained
+    uint64_t user_cpu_us;    // User CPU time of all processes
+    uint64_t sys_cpu_us;     // System CPU time of all processes
+    uint64_t max_rss_kb;     // Largest resident set size of any process
+} CommandResult;
+
+#define COMMAND_RESULT_SIZE (2 * 4 + 7 * 8) // Encoded size of a CommandResult
+
+// Function to fill the FRAME_HEADER_SIZE header of a frame
+void encode_frame_header(uint8_t *header, uint8_t type, uint32_t length);
+
+// Function to send a complete frame in a single write
+int send_frame(int sock, uint8_t type, const void *payload, uint32_t length);
+
+// Function to send a frame whose payload is moved from a pipe with splice, returns the payload length, 0 at EOF or -1
+ssize_t splice_frame_from_pipe(int sock, uint8_t type, int pipe_fd);
+
+// Function to receive a frame into the buffer, returns 1 on success, 0 if the peer closed the connection or -1 on error
+int recv_frame(int sock, uint8_t *type, void *payload, uint32_t capacity, uint32_t *length);
+
+// Function to receive only the header of a frame, returns 1 on success, 0 if the peer closed the connection or -1 on error
+int recv_frame_header(int sock, uint8_t *type, uint32_t *length);
+
+// Function to receive the payload of a frame whose header was received, returns 0 on success or -1 on error
+int recv_frame_payload(int sock, void *payload, uint32_t length);
+
+// Function to send length bytes of a file from *offset as one frame with sendfile, advancing *offset. Returns
+// the bytes taken from the file, fewer if it ended early, when zeros fill the frame; -1 on a socket error.
+ssize_t send_file_frame(int sock, uint8_t type, int fd, off_t *offset, uint32_t length);
+
+// Function to encode a CommandResult into COMMAND_RESULT_SIZE bytes in network byte order
+void encode_command_result(const CommandResult *result, uint8_t *buffer);
+
+// Function to decode a CommandResult, returns 0 on success or -1 if the payload has the wrong size
+int decode_command_result(const uint8_t *buffer, uint32_t length, CommandResult *result);
+
+// Function to encode a terminal window size into WINDOW_SIZE_SIZE bytes
+void encode_window_size(uint16_t rows, uint16_t columns, uint8_t *buffer);
+
+// Function to decode a window size, returns 0 on success or -1 if the payload is too short
+int decode_window_size(const uint8_t *buffer, uint32_t length, uint16_t *rows, uint16_t *columns);
+
+// Function to encode a FRAME_SESSION payload into SESSION_FRAME_SIZE bytes
+void encode_session_frame(uint64_t token, uint64_t replay_offset, uint64_t journal_end, int running, uint8_t *buffer);
+
+// Function to decode a FRAME_SESSION payload, returns 0 on success or -1 if it has the wrong size
+int decode_session_frame(const uint8_t *buffer, uint32_t length, uint64_t *token, uint64_t *replay_offset,
+                         uint64_t *journal_end, int *running);
+
+// Function to encode a FRAME_RESUME payload into RESUME_FRAME_SIZE bytes
+void encode_resume_frame(uint64_t token, uint64_t received_offset, uint8_t *buffer);
+
+// Function to decode a FRAME_RESUME payload, returns 0 on success or -1 if it has the wrong size
+int decode_resume_frame(const uint8_t *buffer, uint32_t length, uint64_t *token, uint64_t *received_offset);
+
+// Function to encode a FRAME_DEADLINE payload into DEADLINE_FRAME_SIZE bytes
+void encode_deadline_frame(uint32_t milliseconds, uint8_t *buffer);
+
+// Function to decode a FRAME_DEADLINE payload, returns 0 on success or -1 if it has the wrong size
+int decode_deadline_frame(const uint8_t *buffer, uint32_t length, uint32_t *milliseconds);
+
+// Function to parse a deadline given in seconds on the command line into milliseconds, returns 0 or -1 if it is
+// not a number, negative, or more than UINT32_MAX milliseconds
+int parse_deadline_seconds(const char *text, uint32_t *milliseconds);
+
+// Function to encode the COMPLETION_HEADER_SIZE start of a FRAME_COMPLETE (kind) or FRAME_COMPLETIONS (flags) payload
+void encode_completion_header(uint32_t request_id, uint8_t kind_or_flags, uint8_t *buffer);
+
+// Function to decode the start of a completion payload, returns 0 on success or -1 if the payload is too short
+int decode_completion_header(const uint8_t *buffer, uint32_t length, uint32_t *request_id, uint8_t *kind_or_flags);
+
+// Function to encode a FRAME_GET or FRAME_PUT payload: flags, the local size for a download or the file size for
+// an upload, and the remote path; returns its length or -1 if the path does not fit in capacity
+int encode_transfer_request(uint8_t flags, uint64_t size, const char *path, uint8_t *buffer, size_t capacity);
+
+// Function to decode a transfer request, pointing *path into it; returns 0 on success or -1 if it is malformed
+int decode_transfer_request(const uint8_t *buffer, uint32_t length, uint8_t *flags, uint64_t *size, const char **path);
+
+// Function to encode a FRAME_TRANSFER or FRAME_TRANSFER_DONE payload into TRANSFER_REPLY_SIZE bytes
+void encode_transfer_reply(int32_t error, uint64_t size, uint64_t offset, uint8_t *buffer);
+
+// Function to decode a transfer reply, returns 0 on success or -1 if it has the wrong size
+int decode_transfer_reply(const uint8_t *buffer, uint32_t length, int32_t *error, uint64_t *size, uint64_t *offset);
+
+// Function to encode the start of a FRAME_UPLOAD payload, returns its length or -1 if the name is too long
+int encode_upload_header(uint8_t flags, const char *name, uint8_t *buffer);
+
+// Function to decode the start of a FRAME_UPLOAD payload, pointing *name into it and setting the length of
+// the start; returns 0 on success or -1 if the payload is malformed
+int decode_upload_header(const uint8_t *buffer, uint32_t length, uint8_t *flags, const char **name,
+                         uint32_t *header_length);
+
+#endif
@@ -0,0 +1,49 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "pty.h"
+
+// Open a pseudo-terminal master. posix_openpt is used instead of forkpty so the master can be
+// close-on-exec from the start: children forked concurrently by other sessions must not hold it open.
+int open_pseudo_terminal(uint16_t rows, uint16_t columns, char *slave_path, size_t path_size) {
+    int master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master_fd < 0) {
+        return -1;
+    }
+
+    if (grantpt(master_fd) < 0 || unlockpt(master_fd) < 0 || ptsname_r(master_fd, slave_path, path_size) != 0 ||
+        resize_pseudo_terminal(master_fd, rows, columns) < 0) {
+        close(master_fd);
+        return -1;
+    }
+    return master_fd;
+}
+
+// Start a new session with the slave as its controlling terminal and standard streams
+int attach_pseudo_terminal(const char *slave_path) {
+    if (setsid() < 0) {
+        return -1;
+    }
+
+    int slave_fd = open(slave_path, O_RDWR);
+    if (slave_fd < 0 || ioctl(slave_fd, TIOCSCTTY, 0) < 0) {
+        return -1;
+    }
+
+    dup2(slave_fd, STDIN_FILENO);
+    dup2(slave_fd, STDOUT_FILENO);
+    dup2(slave_fd, STDERR_FILENO);
+    if (slave_fd > STDERR_FILENO) {
+        close(slave_fd);
+    }
+    return 0;
+}
+
+// Change the window size of a pseudo-terminal
+int resize_pseudo_terminal(int master_fd, uint16_t rows, uint16_t columns) {
+    struct winsize size = { .ws_row = rows, .ws_col = columns };
+    return ioctl(master_fd, TIOCSWINSZ, &size);
+}
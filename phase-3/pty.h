@@ -0,0 +1,16 @@
+#ifndef PTY_H
+#define PTY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Function to open a close-on-exec pseudo-terminal master with the given window size, returns its fd or -1
+int open_pseudo_terminal(uint16_t rows, uint16_t columns, char *slave_path, size_t path_size);
+
+// Function to make the slave the controlling terminal and stdin/stdout/stderr of a forked child, returns 0 or -1
+int attach_pseudo_terminal(const char *slave_path);
+
+// Function to change the window size of a pseudo-terminal; the kernel sends SIGWINCH to its foreground job
+int resize_pseudo_terminal(int master_fd, uint16_t rows, uint16_t columns);
+
+#endif
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "logger.h"
+#include "reaper.h"
+#include "trace.h"
+
+// One thread reaps every child of the server. Each child gets a pidfd, which becomes readable when
+// the child exits; the reaper waits on all of them with epoll and reaps exactly that child through
+// its pidfd, so no session can collect another session's child and no session thread blocks in
+// wait. Exit status and resource usage go to a callback, which for a ReapGroup wakes the session.
+
+#define REAPER_EVENTS 32            // Exits handled per epoll_wait
+
+// Structure to hold a watched child
+typedef struct {
+    int pidfd;
+    pid_t pid;
+    ReaperCallback callback;
+    void *context;
+} ReaperWatch;
+
+static int reaper_epoll_fd = -1;
+
+// Turn the siginfo of an exited child into a wait status, as waitpid would have returned it
+static int wait_status_from_siginfo(const siginfo_t *info) {
+    switch (info->si_code) {
+        case CLD_EXITED:
+            return (info->si_status & 0xff) << 8;
+        case CLD_KILLED:
+            return info->si_status & 0x7f;
+        case CLD_DUMPED:
+            return (info->si_status & 0x7f) | 0x80;
+        default:
+            return 0;
+    }
+}
+
+// Reap children as their pidfds become readable
+static void *reaper_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[REAPER_EVENTS];
+
+    while (1) {
+        int ready = epoll_wait(reaper_epoll_fd, events, REAPER_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "epoll_wait: %m");
+            return NULL;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            ReaperWatch *watch = (ReaperWatch *)events[i].data.ptr;
+
+            // The raw waitid also returns the child's resource usage
+            siginfo_t info;
+            struct rusage usage;
+            memset(&info, 0, sizeof(info));
+            memset(&usage, 0, sizeof(usage));
+            while (syscall(SYS_waitid, P_PIDFD, watch->pidfd, &info, WEXITED, &usage) < 0) {
+                if (errno != EINTR) {
+                    log_message(LOG_LEVEL_ERROR, "waitid on pid %d: %m", (int)watch->pid);
+                    break;
+                }
+            }
+            // An exit that could not be collected is reported as failed, like wait_for_commands does
+            int status = info.si_pid != 0 ? wait_status_from_siginfo(&info) : W_EXITCODE(127, 0);
+
+            epoll_ctl(reaper_epoll_fd, EPOLL_CTL_DEL, watch->pidfd, NULL);
+            close(watch->pidfd);
+            watch->callback(watch->pid, status, &usage, watch->context);
+            free(watch);
+        }
+    }
+}
+
+// Start the reaper thread
+int reaper_start(void) {
+    // Check that the kernel has pidfds before relying on them
+    int probe = (int)syscall(SYS_pidfd_open, getpid(), 0);
+    if (probe < 0) return -1;
+    close(probe);
+
+    reaper_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reaper_epoll_fd < 0) return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reaper_thread, NULL) != 0) {
+        close(reaper_epoll_fd);
+        reaper_epoll_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Watch a child until it exits
+int reaper_watch(pid_t pid, ReaperCallback callback, void *context) {
+    if (reaper_epoll_fd < 0) return -1;
+
+    ReaperWatch *watch = malloc(sizeof(ReaperWatch));
+    if (watch == NULL) return -1;
+
+    // A child that already exited is a zombie until reaped, so its pidfd is simply readable at once.
+    // pidfds are always close-on-exec.
+    watch->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (watch->pidfd < 0) {
+        free(watch);
+        return -1;
+    }
+    watch->pid = pid;
+    watch->callback = callback;
+    watch->context = context;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = watch };
+    if (epoll_ctl(reaper_epoll_fd, EPOLL_CTL_ADD, watch->pidfd, &event) < 0) {
+        close(watch->pidfd);
+        free(watch);
+        return -1;
+    }
+    return 0;
+}
+
+// Record a reaped child of a group and wake the session once the last one is in
+static void record_group_exit(pid_t pid, int status, const struct rusage *usage, void *context) {
+    ReapGroup *group = (ReapGroup *)context;
+
+    pthread_mutex_lock(&group->lock);
+    for (int i = 0; i < group->count; i++) {
+        if (group->pids[i] == pid) {
+            record_command_exit(&group->result, status, usage, i == group->count - 1);
+            group->reaped[i] = 1;
+            break;
+        }
+    }
+    int last = --group->watched == 0;
+    int done_fd = group->done_fd;
+    pthread_mutex_unlock(&group->lock);
+
+    // The session may release the group as soon as the eventfd is written, so the group is not touched
+    // after the lock is dropped
+    if (last) {
+        uint64_t one = 1;
+        if (write(done_fd, &one, sizeof(one)) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Waking a session failed: %m");
+        }
+    }
+}
+
+// Watch the processes of a command line
+void reap_group_start(ReapGroup *group, const pid_t *pids, int count) {
+    memset(group, 0, sizeof(*group));
+    pthread_mutex_init(&group->lock, NULL);
+    memcpy(group->pids, pids, count * sizeof(pid_t));
+    group->count = count;
+
+    // Without an eventfd nothing can wake the session, so it reaps every child itself
+    group->done_fd = eventfd(0, EFD_CLOEXEC);
+    if (group->done_fd < 0) return;
+
+    // Count every child first, so an early exit cannot complete the group while others are being added
+    group->watched = count;
+    for (int i = 0; i < count; i++) {
+        if (reaper_watch(pids[i], record_group_exit, group) < 0) {
+            pthread_mutex_lock(&group->lock);
+            group->watched--;
+            pthread_mutex_unlock(&group->lock);
+        } else {
+            group->signalled = 1;
+        }
+    }
+}
+
+// Get the eventfd the reaper writes once it reported every watched child. Only the eventfd tells that the
+// reaper is done with the group; watched reaching 0 does not, since the last callback writes the eventfd after it.
+int reap_group_fd(ReapGroup *group) {
+    return group->signalled ? group->done_fd : -1;
+}
+
+// Wait until the reaper has reported every watched child, then reap the rest directly
+void reap_group_wait(ReapGroup *group, ExecutionResult *result) {
+    if (group->signalled) {
+        struct pollfd done = { .fd = group->done_fd, .events = POLLIN };
+        while (poll(&done, 1, -1) < 0 && errno == EINTR);
+    }
+
+    // Children the reaper could not watch (no pidfd) are waited for here
+    for (int i = 0; i < group->count; i++) {
+        if (!group->reaped[i]) {
+            ExecutionResult single;
+            wait_for_commands(&group->pids[i], 1, &single);
+            record_command_exit(&group->result, single.status, &single.usage, i == group->count - 1);
+        } else {
+            trace_process_reaped(group->pids[i]); // Process tracks belong to the thread that started them
+        }
+    }
+
+    *result = group->result;
+    if (group->done_fd >= 0) close(group->done_fd);
+    pthread_mutex_destroy(&group->lock);
+}
@@ -0,0 +1,43 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "commands.h"
+#include "shell.h"
+
+// Function type of exit callbacks; they run on the reaper thread and must not block
+typedef void (*ReaperCallback)(pid_t pid, int status, const struct rusage *usage, void *context);
+
+// Structure to hold the children of one command line until the reaper has reaped all of them
+typedef struct {
+    pthread_mutex_t lock;
+    int done_fd;                    // eventfd, readable once every watched child was reaped, or -1
+    int watched;                    // Children the reaper still has to report
+    int signalled;                  // Whether the reaper watches any child, so it will write done_fd
+    pid_t pids[MAX_PIPED_COMMANDS + 1];
+    int reaped[MAX_PIPED_COMMANDS + 1];
+    int count;
+    ExecutionResult result;
+} ReapGroup;
+
+// Function to start the reaper thread, returns 0 or -1 if pidfds or epoll are unavailable
+int reaper_start(void);
+
+// Function to have callback called with the exit status and usage of pid once it exits, returns 0 or -1
+int reaper_watch(pid_t pid, ReaperCallback callback, void *context);
+
+// Function to watch the (at most MAX_PIPED_COMMANDS + 1) processes of a command line; children the
+// reaper cannot watch are reaped in reap_group_wait instead
+void reap_group_start(ReapGroup *group, const pid_t *pids, int count);
+
+// Function to get the descriptor that becomes readable once the reaper reported every watched child, to poll
+// along with others; -1 if the reaper watches none of them
+int reap_group_fd(ReapGroup *group);
+
+// Function to wait until every child of the group is reaped (without calling wait itself if the reaper runs),
+// fill result and release the group
+void reap_group_wait(ReapGroup *group, ExecutionResult *result);
+
+#endif
@@ -1,16 +1,58 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "affinity.h"
 #include "commands.h"
+#include "complete.h"
+#include "logger.h"
+#include "metrics.h"
 #include "parser.h"
+#include "pipeio.h"
+#include "plan.h"
+#include "protocol.h"
+#include "pty.h"
+#include "reaper.h"
+#include "session.h"
 #include "shell.h"
+#include "slab.h"
+#include "trace.h"
+#include "upload.h"
 #include "utilities.h"
+#include "wildcard.h"
 
 #define PORT 8080          // Port number to listen on
 #define BUFFER_SIZE 1024   // Buffer size for receiving data
+#define DEFAULT_GRACE_SECONDS 60               // How long a session waits for its client to reconnect
+#define DEFAULT_JOURNAL_SIZE (1024 * 1024)     // Output kept per session for reconnecting clients
+#define DEFAULT_BACKLOG SOMAXCONN              // Listen queue length; bursts beyond it are refused
+#define SESSION_STACK_SIZE (256 * 1024)        // Stack of a session thread; glibc reuses stacks of exited threads
+#define DEFAULT_KILL_AFTER_SECONDS 5           // From SIGTERM to SIGKILL for a command past its deadline or cancelled
+
+// Set by SIGINT/SIGTERM; the main thread then shuts the server down cleanly
+static volatile sig_atomic_t stop_requested = 0;
+static sigset_t original_signal_mask;
+
+// Settings of session resumption, from --grace and --journal-size
+static int grace_seconds = DEFAULT_GRACE_SECONDS;
+static size_t journal_size = DEFAULT_JOURNAL_SIZE;
+
+// Run time limits of commands, from --deadline and --kill-after
+static uint32_t default_deadline_ms = 0;       // 0 lets commands run until they finish
+static int kill_after_seconds = DEFAULT_KILL_AFTER_SECONDS;
 
 // Global client counter to assign unique IDs
 int client_counter = 0;
@@ -21,214 +63,1445 @@ typedef struct {
     int socket;
     int client_id;
     struct sockaddr_in client_addr;
+    int local;                      // Connected over the Unix socket, so client_addr is unused
+    uint64_t accepted_at;           // Monotonic time of the accept, in microseconds
 } ClientInfo;
 
+// Structure to hold an acceptor thread and its listening sockets
+typedef struct {
+    pthread_t thread;
+    int index;
+    int tcp_socket;                 // Own SO_REUSEPORT listener on PORT
+    int unix_socket;                // Unix domain listener, -1 except on the first acceptor
+} Acceptor;
+
+// Attributes of session threads
+static pthread_attr_t session_thread_attributes;
+
+// Written on shutdown; the read end stays readable, which wakes every acceptor
+static int acceptor_stop_fds[2] = { -1, -1 };
+
+// Pools of per-connection objects, so connection churn reuses memory instead of fragmenting the heap
+static SlabPool *client_info_pool;
+static SlabPool *frame_buffer_pool;     // FRAME_STDIN_MAX receive buffers, one per session
+static SlabPool *journal_pool;          // Output journals, NULL when resuming is off
+
+// Server metrics, exported with --metrics-port / --metrics-socket
+static MetricCounter *connections_total;
+static MetricCounter *sessions_active;
+static MetricCounter *sessions_detached;
+static MetricCounter *sessions_resumed_total;
+static MetricCounter *children_running;
+static MetricCounter *commands_total;
+static MetricCounter *commands_failed_total;
+static MetricCounter *bytes_out_total;
+static MetricCounter *commands_cancelled_total;
+static MetricCounter *commands_timed_out_total;
+static MetricCounter *commands_killed_total;
+static MetricCounter *completions_total;
+static MetricCounter *transfer_bytes_total;
+static MetricHistogram *accept_recv_latency;
+static MetricHistogram *parse_latency;
+static MetricHistogram *spawn_latency;
+static MetricHistogram *run_latency;
+static MetricHistogram *flush_latency;
+
+// Define the scrape-time readers of a pool's utilization
+#define SLAB_POOL_READERS(pool)                                                              \
+    static uint64_t read_##pool##_in_use(void) { return slab_objects_in_use(pool); }         \
+    static uint64_t read_##pool##_total(void) { return slab_objects_total(pool); }
+
+SLAB_POOL_READERS(client_info_pool)
+SLAB_POOL_READERS(frame_buffer_pool)
+SLAB_POOL_READERS(journal_pool)
+
+// Register the server's metrics
+static void register_server_metrics(void) {
+    static const char *phase_help = "Time spent per phase of a command, from accept to the completion frame";
+
+    connections_total = metrics_register_counter("rshell_connections_total", "Client connections accepted", 0);
+    sessions_active = metrics_register_counter("rshell_sessions_active", "Client sessions currently open", 1);
+    sessions_detached = metrics_register_counter("rshell_sessions_detached",
+                                                 "Sessions waiting for their client to reconnect", 1);
+    sessions_resumed_total = metrics_register_counter("rshell_sessions_resumed_total",
+                                                      "Sessions taken over by a reconnected client", 0);
+    children_running = metrics_register_counter("rshell_children_running", "Command processes currently running", 1);
+    commands_total = metrics_register_counter("rshell_commands_total", "Commands received", 0);
+    commands_failed_total = metrics_register_counter("rshell_commands_failed_total",
+                                                     "Commands that finished with a non-zero exit code", 0);
+    bytes_out_total = metrics_register_counter("rshell_bytes_out_total", "Command output bytes sent to clients", 0);
+    commands_cancelled_total = metrics_register_counter("rshell_commands_cancelled_total",
+                                                        "Commands signalled on the client's request", 0);
+    commands_timed_out_total = metrics_register_counter("rshell_commands_timed_out_total",
+                                                        "Commands terminated for running past their deadline", 0);
+    commands_killed_total = metrics_register_counter("rshell_commands_killed_total",
+                                                     "Commands killed after not exiting on SIGTERM or a cancel", 0);
+    completions_total = metrics_register_counter("rshell_completions_total", "Completion requests answered", 0);
+    transfer_bytes_total = metrics_register_counter("rshell_transfer_bytes_total",
+                                                    "File bytes moved by get and put", 0);
+    accept_recv_latency = metrics_register_histogram("rshell_phase_seconds", phase_help, "phase=\"accept_recv\"");
+    parse_latency = metrics_register_histogram("rshell_phase_seconds", phase_help, "phase=\"parse\"");
+    spawn_latency = metrics_register_histogram("rshell_phase_seconds", phase_help, "phase=\"spawn\"");
+    run_latency = metrics_register_histogram("rshell_phase_seconds", phase_help, "phase=\"run\"");
+    flush_latency = metrics_register_histogram("rshell_phase_seconds", phase_help, "phase=\"flush\"");
+    metrics_register_callback("rshell_log_dropped_lines_total", "Log lines dropped because a ring was full",
+                              0, logger_dropped_lines);
+    metrics_register_callback("rshell_slab_client_info_in_use", "Client info objects in use", 1, read_client_info_pool_in_use);
+    metrics_register_callback("rshell_slab_client_info_total", "Client info objects in all slabs", 1, read_client_info_pool_total);
+    metrics_register_callback("rshell_plan_cache_hits_total", "Command lines run from a cached plan", 0, plan_cache_hits);
+    metrics_register_callback("rshell_plan_cache_misses_total", "Command lines parsed", 0, plan_cache_misses);
+    metrics_register_callback("rshell_plan_cache_bytes", "Memory taken by cached plans", 1, plan_cache_bytes);
+    metrics_register_callback("rshell_slab_frame_buffer_in_use", "Session receive buffers in use", 1,
+                              read_frame_buffer_pool_in_use);
+    metrics_register_callback("rshell_slab_frame_buffer_total", "Session receive buffers in all slabs", 1,
+                              read_frame_buffer_pool_total);
+    if (journal_pool != NULL) {
+        metrics_register_callback("rshell_slab_journal_in_use", "Session output journals in use", 1, read_journal_pool_in_use);
+        metrics_register_callback("rshell_slab_journal_total", "Session output journals in all slabs", 1, read_journal_pool_total);
+    }
+}
+
+// Return the current monotonic time in microseconds
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Convert a timeval to microseconds
+static uint64_t timeval_us(struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+// Fill the exit status and resource usage of a result from how the processes finished
+static void fill_command_result(CommandResult *result, ExecutionResult *execution) {
+    if (WIFSIGNALED(execution->status)) {
+        result->exit_code = 128 + WTERMSIG(execution->status); // Same convention as other shells
+        result->term_signal = WTERMSIG(execution->status);
+    } else {
+        result->exit_code = WEXITSTATUS(execution->status);
+        result->term_signal = 0;
+    }
+    result->user_cpu_us = timeval_us(&execution->usage.ru_utime);
+    result->sys_cpu_us = timeval_us(&execution->usage.ru_stime);
+    result->max_rss_kb = execution->usage.ru_maxrss;
+}
+
+// Send the completion frame carrying the result of a command
+static int send_command_result(Session *session, CommandResult *result) {
+    uint8_t payload[COMMAND_RESULT_SIZE];
+    encode_command_result(result, payload);
+    return session_send_frame(session, FRAME_RESULT, payload, sizeof(payload));
+}
+
+// Answer a completion request; the reply is built in the frame buffer, which is free while no command runs
+static void answer_completion(Session *session, char *frame_buffer, uint32_t frame_length) {
+    uint32_t request_id;
+    uint8_t kind;
+    char word[PATH_MAX];
+    if (decode_completion_header((uint8_t *)frame_buffer, frame_length, &request_id, &kind) < 0 ||
+        frame_length - COMPLETION_HEADER_SIZE >= sizeof(word)) {
+        log_message(LOG_LEVEL_WARN, "Client ID %d sent a malformed completion request", session->client_id);
+        return;
+    }
+    size_t length = frame_length - COMPLETION_HEADER_SIZE;
+    memcpy(word, frame_buffer + COMPLETION_HEADER_SIZE, length);
+    word[length] = '\0';
+
+    int truncated;
+    size_t written = completion_find(kind, word, length, frame_buffer + COMPLETION_HEADER_SIZE,
+                                     FRAME_STDIN_MAX - COMPLETION_HEADER_SIZE, &truncated);
+    encode_completion_header(request_id, truncated ? COMPLETIONS_TRUNCATED : 0, (uint8_t *)frame_buffer);
+    session_send_frame(session, FRAME_COMPLETIONS, frame_buffer, COMPLETION_HEADER_SIZE + written);
+    metrics_add(completions_total, 1);
+}
+
+// Send a transfer reply of the given type
+static void send_transfer_reply(Session *session, uint8_t type, int32_t error, uint64_t size, uint64_t offset) {
+    uint8_t payload[TRANSFER_REPLY_SIZE];
+    encode_transfer_reply(error, size, offset, payload);
+    session_send_frame(session, type, payload, sizeof(payload));
+}
+
+// Decode a transfer request into its flags, size and a copy of its path; returns 0, or -1 if it is malformed
+static int decode_transfer(Session *session, const char *frame_buffer, uint32_t frame_length, uint8_t *flags,
+                           uint64_t *size, char *path, size_t path_capacity) {
+    const char *requested_path;
+    if (decode_transfer_request((const uint8_t *)frame_buffer, frame_length, flags, size, &requested_path) < 0 ||
+        strlen(requested_path) >= path_capacity) {
+        log_message(LOG_LEVEL_WARN, "Client ID %d sent a malformed transfer request", session->client_id);
+        return -1;
+    }
+    strcpy(path, requested_path);
+    return 0;
+}
+
+// Log how fast a transfer went
+static void log_transfer(Session *session, const char *direction, const char *path, uint64_t bytes, uint64_t offset,
+                         uint64_t started_at, int error) {
+    double seconds = (monotonic_us() - started_at) / 1e6;
+    double rate = seconds > 0 ? bytes / seconds / 1e6 : 0;
+    metrics_add(transfer_bytes_total, bytes);
+    if (error != 0) {
+        log_message(LOG_LEVEL_WARN, "Client ID %d %s \"%s\" stopped at offset %llu after %llu bytes: %s",
+                    session->client_id, direction, path, (unsigned long long)offset, (unsigned long long)bytes,
+                    strerror(error));
+    } else {
+        log_message(LOG_LEVEL_INFO, "Client ID %d %s \"%s\": %llu bytes in %.3f s (%.1f MB/s)", session->client_id,
+                    direction, path, (unsigned long long)bytes, seconds, rate);
+    }
+}
+
+// Send the file a FRAME_GET asks for from the offset the client already has: a FRAME_TRANSFER with its size,
+// the data in FRAME_FILE_DATA frames, then a FRAME_TRANSFER_DONE with the offset reached. The data goes from the
+// page cache to the socket with sendfile; a journaled session copies it through the frame buffer instead, since
+// everything it sends must pass through the journal.
+static void serve_get(Session *session, char *frame_buffer, uint32_t frame_length) {
+    uint8_t flags;
+    uint64_t offset;
+    char path[PATH_MAX];
+    if (decode_transfer(session, frame_buffer, frame_length, &flags, &offset, path, sizeof(path)) < 0) {
+        send_transfer_reply(session, FRAME_TRANSFER, EINVAL, 0, 0);
+        return;
+    }
+    uint64_t started_at = monotonic_us();
+
+    struct stat status;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int error = fd < 0 ? errno : 0;
+    if (error == 0 && fstat(fd, &status) < 0) error = errno;
+    if (error == 0 && !S_ISREG(status.st_mode)) error = S_ISDIR(status.st_mode) ? EISDIR : EINVAL;
+    if (error == 0 && offset > (uint64_t)status.st_size) error = ERANGE; // The client has more than there is
+    if (error != 0) {
+        send_transfer_reply(session, FRAME_TRANSFER, error, 0, 0);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    uint64_t size = status.st_size;
+    send_transfer_reply(session, FRAME_TRANSFER, 0, size, offset);
+
+    off_t position = offset;
+    while ((uint64_t)position < size && session->socket >= 0) {
+        uint64_t chunk = size - position;
+        ssize_t sent;
+        if (session->journal.capacity == 0) {
+            if (chunk > TRANSFER_CHUNK) chunk = TRANSFER_CHUNK;
+            sent = send_file_frame(session->socket, FRAME_FILE_DATA, fd, &position, (uint32_t)chunk);
+            if (sent < 0) {
+                session_detach(session);
+                break;
+            }
+        } else {
+            if (chunk > FRAME_STDIN_MAX) chunk = FRAME_STDIN_MAX;
+            sent = pread(fd, frame_buffer, chunk, position);
+            if (sent > 0) {
+                position += sent;
+                session_send_frame(session, FRAME_FILE_DATA, frame_buffer, sent);
+            }
+        }
+        if (sent < (ssize_t)chunk) {
+            error = sent < 0 ? errno : EIO; // The file shrank while it was sent
+            break;
+        }
+    }
+    close(fd);
+
+    send_transfer_reply(session, FRAME_TRANSFER_DONE, error, position - offset, position);
+    log_transfer(session, "downloaded", path, position - offset, position, started_at, error);
+}
+
+// Receive the file a FRAME_PUT announces: reply with FRAME_TRANSFER and the offset to send from, which with
+// TRANSFER_RESUME is the size of what an earlier upload left, then move the FRAME_FILE_DATA frames from the
+// socket into the file with splice and reply with FRAME_TRANSFER_DONE. A failing file does not stop the
+// frames, so the stream stays in step; the reply tells how far the file got.
+static void receive_put(Session *session, char *frame_buffer, uint32_t frame_length) {
+    uint8_t flags;
+    uint64_t size;
+    char path[PATH_MAX];
+    if (decode_transfer(session, frame_buffer, frame_length, &flags, &size, path, sizeof(path)) < 0) {
+        send_transfer_reply(session, FRAME_TRANSFER, EINVAL, 0, 0);
+        return;
+    }
+    uint64_t started_at = monotonic_us();
+
+    // An earlier upload is only continued if it is not longer than the file now sent
+    struct stat status;
+    int pipe_fds[2] = { -1, -1 };
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    int error = fd < 0 ? errno : 0;
+    if (error == 0 && fstat(fd, &status) < 0) error = errno;
+    off_t position = 0;
+    if (error == 0 && (flags & TRANSFER_RESUME) && (uint64_t)status.st_size <= size) position = status.st_size;
+    if (error == 0 && ftruncate(fd, position) < 0) error = errno;
+    if (error == 0 && create_pipe(pipe_fds) < 0) error = errno;
+    if (error != 0) {
+        send_transfer_reply(session, FRAME_TRANSFER, error, 0, 0);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    send_transfer_reply(session, FRAME_TRANSFER, 0, size, position);
+
+    uint64_t offset = position;
+    uint64_t remaining = size - offset;
+    while (remaining > 0) {
+        uint8_t frame_type;
+        uint32_t length;
+        if (recv_frame_header(session->socket, &frame_type, &length) <= 0 || frame_type != FRAME_FILE_DATA ||
+            length > remaining || splice_to_file(session->socket, fd, &position, length, pipe_fds, &error) < 0) {
+            // What arrived stays in the file, for the client to resume from
+            if (error == 0) error = EPROTO;
+            log_message(LOG_LEVEL_ERROR, "Upload from Client ID %d broke off: %m", session->client_id);
+            session_detach(session);
+            break;
+        }
+        remaining -= length;
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(fd);
+
+    if (session->socket >= 0) send_transfer_reply(session, FRAME_TRANSFER_DONE, error, position - offset, position);
+    log_transfer(session, "uploaded", path, position - offset, position, started_at, error);
+}
+
+// Structure to hold the client's input stream to the running command
+typedef struct {
+    int fd;                   // Where input is written: the stdin pipe or the terminal, -1 once closed
+    int terminal;             // Set when fd is a pseudo-terminal master, which also carries the output
+    const char *pending;      // Part of the last input frame not yet written
+    size_t pending_length;
+    int eof;                  // The client ended its input; close the pipe once pending is written
+} CommandInput;
+
+// Structure to hold how a running command is stopped: by the client's cancel or by its deadline
+typedef struct {
+    int client_id;
+    pid_t group;              // Process group of every process of the command, 0 until it is forked
+    uint64_t terminate_at;    // Monotonic time in microseconds to send SIGTERM, 0 for none
+    uint64_t kill_at;         // Monotonic time in microseconds to send SIGKILL, 0 for none
+} CommandControl;
+
+// Send a signal to every process of the command
+static void signal_command(CommandControl *control, int signal_number) {
+    if (control->group > 0 && kill(-control->group, signal_number) < 0 && errno != ESRCH) {
+        log_message(LOG_LEVEL_ERROR, "Signalling the command of Client ID %d failed: %m", control->client_id);
+    }
+}
+
+// Send the signals that are due, returns the milliseconds until the next one or -1 if none is left
+static int enforce_command_deadline(CommandControl *control) {
+    uint64_t now = monotonic_us();
+    if (control->terminate_at != 0 && now >= control->terminate_at) {
+        log_message(LOG_LEVEL_WARN, "The command of Client ID %d ran past its deadline, terminating it", control->client_id);
+        metrics_add(commands_timed_out_total, 1);
+        signal_command(control, SIGTERM);
+        control->terminate_at = 0;
+        if (control->kill_at == 0) control->kill_at = now + kill_after_seconds * 1000000ULL;
+    }
+    if (control->kill_at != 0 && now >= control->kill_at) {
+        log_message(LOG_LEVEL_WARN, "The command of Client ID %d did not exit, killing it", control->client_id);
+        metrics_add(commands_killed_total, 1);
+        signal_command(control, SIGKILL);
+        control->kill_at = 0;
+    }
+
+    uint64_t next = control->terminate_at;
+    if (next == 0 || (control->kill_at != 0 && control->kill_at < next)) next = control->kill_at;
+    if (next == 0) return -1;
+    return (int)((next - now + 999) / 1000); // Round up, so the poll does not wake just before it is due
+}
+
+// Signal the command as the client asked; unless that kills it, SIGKILL follows if it has not exited in time
+static void cancel_command(CommandControl *control, int signal_number) {
+    log_message(LOG_LEVEL_INFO, "Client ID %d cancelled its command with signal %d", control->client_id, signal_number);
+    metrics_add(commands_cancelled_total, 1);
+    signal_command(control, signal_number);
+    if (signal_number != SIGKILL && control->kill_at == 0) {
+        control->kill_at = monotonic_us() + kill_after_seconds * 1000000ULL;
+    }
+}
+
+// Stop writing input; a pipe is closed so the command sees end of input
+static void close_command_input(CommandInput *input) {
+    if (input->fd >= 0 && !input->terminal) {
+        close(input->fd);
+    }
+    input->fd = -1;
+    input->pending_length = 0;
+}
+
+// Write as much pending input as the pipe or terminal takes without blocking
+static void write_command_input(CommandInput *input) {
+    while (input->pending_length > 0) {
+        ssize_t written = write(input->fd, input->pending, input->pending_length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return; // Pipe full; poll for POLLOUT
+            close_command_input(input);  // EPIPE: the command does not read its input
+            return;
+        }
+        input->pending += written;
+        input->pending_length -= written;
+    }
+    if (input->eof) {
+        close_command_input(input);
+    }
+}
+
+// Receive one frame from the client while a command runs, returns -1 once the client stops sending
+static int receive_command_input(Session *session, CommandInput *input, CommandControl *control, char *frame_buffer) {
+    uint8_t frame_type;
+    uint32_t frame_length;
+    int client_id = session->client_id;
+    int status = recv_frame(session->socket, &frame_type, frame_buffer, FRAME_STDIN_MAX, &frame_length);
+    if (status == 0) {
+        // Half-closed (the client ended its input with an empty frame first) or gone; output still goes out
+        return -1;
+    } else if (status < 0) {
+        log_message(LOG_LEVEL_ERROR, "Receive failed from Client ID %d: %m", client_id);
+        if (session->journal.capacity == 0) {
+            close_command_input(input);
+        }
+        session_detach(session);
+        return -1;
+    }
+
+    if (frame_type == FRAME_WINSIZE) {
+        uint16_t rows, columns;
+        if (input->terminal && input->fd >= 0 &&
+            decode_window_size((uint8_t *)frame_buffer, frame_length, &rows, &columns) == 0) {
+            resize_pseudo_terminal(input->fd, rows, columns);
+        }
+        return 0;
+    } else if (frame_type == FRAME_CANCEL) {
+        uint8_t signal_number = frame_length == CANCEL_FRAME_SIZE ? (uint8_t)frame_buffer[0] : 0;
+        if (signal_number > 0 && signal_number < NSIG) {
+            cancel_command(control, signal_number);
+        } else {
+            log_message(LOG_LEVEL_WARN, "Client ID %d sent a malformed cancel", client_id);
+        }
+        return 0;
+    } else if (frame_type != FRAME_STDIN) {
+        log_message(LOG_LEVEL_WARN, "Client ID %d sent frame type %d while a command was running", client_id, frame_type);
+        return 0;
+    }
+
+    if (input->fd < 0) {
+        return 0; // The command's input is closed already
+    } else if (frame_length == 0) {
+        if (input->terminal) {
+            // A terminal cannot be half-closed; type the end-of-file character (Ctrl+D) instead
+            frame_buffer[0] = '\004';
+            frame_length = 1;
+        } else {
+            input->eof = 1;
+        }
+    }
+    input->pending = frame_buffer;
+    input->pending_length = frame_length;
+    write_command_input(input);
+    return 0;
+}
+
+// Structure to hold the pipes between a command and its session thread
+typedef struct {
+    int input[2];    // The client's input, read by the command as stdin
+    int output[2];   // The command's stdout
+    int error[2];    // The command's stderr, relayed separately so neither stream waits on the other
+} CommandPipes;
+
+// Create the input, output and error pipes of a command, returns 0 or -1 with none left open
+static int open_command_pipes(CommandPipes *pipes) {
+    int *ends[3] = { pipes->input, pipes->output, pipes->error };
+    for (int i = 0; i < 3; i++) {
+        if (create_pipe(ends[i]) < 0) {
+            for (int j = 0; j < i; j++) {
+                close(ends[j][0]);
+                close(ends[j][1]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Close every end of the command's pipes still held by this process
+static void close_command_pipes(CommandPipes *pipes) {
+    int *ends[3] = { pipes->input, pipes->output, pipes->error };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (ends[i][j] >= 0) close(ends[i][j]);
+            ends[i][j] = -1;
+        }
+    }
+}
+
+// Close the ends the command uses after forking, handing the input and both output streams to the relay
+static void connect_command_pipes(CommandPipes *pipes, CommandInput *input, int output_fds[2]) {
+    close(pipes->input[0]);
+    close(pipes->output[1]);
+    close(pipes->error[1]);
+    pipes->input[0] = pipes->output[1] = pipes->error[1] = -1;
+
+    // Input is written without blocking so output keeps flowing
+    input->fd = pipes->input[1];
+    input->terminal = 0;
+    pipes->input[1] = -1;
+    fcntl(input->fd, F_SETFL, O_NONBLOCK);
+
+    output_fds[0] = pipes->output[0];
+    output_fds[1] = pipes->error[0];
+}
+
+// Relay the client's input to a command and its stdout and stderr back until the command closes both.
+// Each stream has its own pipe and is sent in its own frames, so a flood on one never holds back the other.
+// If the connection drops, output goes on into the journal until a client resumes the session.
+// The command's deadline is enforced throughout. Returns whether the client may still send frames.
+static int relay_command_io(Session *session, const int output_fds[2], CommandInput *input, CommandControl *control,
+                             CommandResult *result, uint64_t received_at, char *frame_buffer) {
+    static const uint8_t frame_types[2] = { FRAME_STDOUT, FRAME_STDERR };
+    int streams[2] = { output_fds[0], output_fds[1] }; // A stream is set to -1 once it is closed
+    int receiving = 1;
+
+    while (streams[0] >= 0 || streams[1] >= 0) {
+        int socket = session->socket;
+        struct pollfd fds[5 + MAX_PIPED_COMMANDS + 1] = {
+            { .fd = streams[0], .events = POLLIN },
+            { .fd = streams[1], .events = POLLIN },
+            // Take the next frame only once the previous input is written; cancels still come after the input ended
+            { .fd = receiving && input->pending_length == 0 ? socket : -1, .events = POLLIN },
+            { .fd = input->pending_length > 0 ? input->fd : -1, .events = POLLOUT },
+            { .fd = session->wake_fds[0], .events = POLLIN },
+        };
+        // With tracing, the exec timing pipes of the children wake the loop too, to record when they exec
+        int exec_count = trace_exec_poll_fds(fds + 5, MAX_PIPED_COMMANDS + 1);
+        if (poll(fds, 5 + exec_count, enforce_command_deadline(control)) < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "poll: %m");
+            break;
+        }
+        if (exec_count > 0) trace_exec_check();
+
+        if (fds[4].revents && session_take_over(session)) {
+            metrics_add(sessions_resumed_total, 1);
+            receiving = 1; // The resumed client can send input again
+        }
+        if (fds[3].revents) {
+            write_command_input(input);
+        }
+        if (fds[2].revents && session->socket == socket && receive_command_input(session, input, control, frame_buffer) < 0) {
+            receiving = 0;
+        }
+
+        for (int stream = 0; stream < 2; stream++) {
+            if (fds[stream].revents == 0) continue;
+
+            ssize_t read_bytes;
+            if (stream == 0 && is_high_throughput_mode() && !input->terminal && session->journal.capacity == 0) {
+                // Move the output from the pipe straight into the socket; journaled output has to be copied
+                read_bytes = splice_frame_from_pipe(session->socket, FRAME_STDOUT, streams[stream]);
+                if (read_bytes < 0) return 0;
+            } else {
+                // A terminal master reports EIO once the last process using the terminal has exited
+                char output_buffer[BUFFER_SIZE];
+                read_bytes = read(streams[stream], output_buffer, sizeof(output_buffer));
+                if (read_bytes < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+                if (read_bytes > 0 && session_send_frame(session, frame_types[stream], output_buffer, read_bytes) < 0) {
+                    return 0; // Nobody receives the output any more
+                }
+            }
+            if (read_bytes <= 0) {
+                streams[stream] = -1;
+                continue;
+            }
+            metrics_add(bytes_out_total, read_bytes);
+            if (result->first_byte_us == 0) {
+                result->first_byte_us = monotonic_us() - received_at;
+            }
+        }
+    }
+    return receiving;
+}
+
+// Wait for the reaper to report every process of the command. Processes that closed their output can run on,
+// so the deadline is still enforced and the client can still cancel them.
+static void wait_for_command(Session *session, ReapGroup *children, CommandInput *input, CommandControl *control,
+                             int receiving, ExecutionResult *execution, char *frame_buffer) {
+    int done_fd = reap_group_fd(children);
+    while (done_fd >= 0) {
+        int socket = session->socket;
+        struct pollfd fds[3] = {
+            { .fd = done_fd, .events = POLLIN },
+            { .fd = receiving ? socket : -1, .events = POLLIN },
+            { .fd = session->wake_fds[0], .events = POLLIN },
+        };
+        if (poll(fds, 3, enforce_command_deadline(control)) < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "poll: %m");
+            break;
+        }
+        if (fds[0].revents) break;
+
+        if (fds[2].revents && session_take_over(session)) {
+            metrics_add(sessions_resumed_total, 1);
+            receiving = 1;
+        }
+        if (fds[1].revents && session->socket == socket && receive_command_input(session, input, control, frame_buffer) < 0) {
+            receiving = 0;
+        }
+    }
+    reap_group_wait(children, execution);
+}
+
+// Execute a single command, streaming the client's input to it and its output back as it is produced.
+// With a window size the command runs under a pseudo-terminal, which carries stdin, stdout and stderr;
+// otherwise each of them is a pipe of its own. Either way the command leads a process group of its own.
+static void run_single_command(Session *session, ShellCommand *cmd, int input_fd, CommandControl *control,
+                               CommandResult *result, uint64_t received_at, const struct winsize *terminal_size,
+                               char *frame_buffer) {
+    // Create the pipes for the command's input and output, or the terminal for all of them
+    CommandPipes pipes = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+    int terminal_fd = -1;
+    char slave_path[64];
+    if (terminal_size != NULL) {
+        terminal_fd = open_pseudo_terminal(terminal_size->ws_row, terminal_size->ws_col, slave_path, sizeof(slave_path));
+        if (terminal_fd < 0) {
+            log_message(LOG_LEVEL_ERROR, "posix_openpt: %m");
+            result->exit_code = 1;
+            return;
+        }
+    } else if (open_command_pipes(&pipes) < 0) {
+        log_message(LOG_LEVEL_ERROR, "pipe: %m");
+        result->exit_code = 1;
+        return;
+    }
+
+    result->queue_us = monotonic_us() - received_at;
+    trace_span("queue", received_at, received_at + result->queue_us, NULL);
+
+    // A terminal command leads its group only once it has called setsid, which the parent cannot do for it;
+    // the child writes to this pipe after setsid, and the group is published only then, so no cancel misses it.
+    // A byte is sent rather than the pipe closed, since children other threads fork may hold copies of it.
+    int session_fds[2] = { -1, -1 };
+    if (terminal_size != NULL && pipe2(session_fds, O_CLOEXEC) < 0) {
+        log_message(LOG_LEVEL_ERROR, "pipe: %m");
+        close(terminal_fd);
+        result->exit_code = 1;
+        return;
+    }
+
+    int exec_fds[2];
+    trace_exec_pipe(exec_fds);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process
+        if (terminal_size != NULL) {
+            // The terminal becomes the controlling terminal and stdin, stdout and stderr
+            close(terminal_fd);
+            close(session_fds[0]);
+            int attached = attach_pseudo_terminal(slave_path);
+            char byte = 0;
+            while (write(session_fds[1], &byte, 1) < 0 && errno == EINTR);
+            close(session_fds[1]);
+            if (attached < 0) {
+                perror("Attach Terminal Error");
+                _exit(EXIT_FAILURE);
+            }
+            if (input_fd >= 0) dup2(input_fd, STDIN_FILENO);
+        } else {
+            // Read stdin from the client or an upload, write stdout and stderr to their own pipes
+            setpgid(0, 0);
+            dup2(input_fd >= 0 ? input_fd : pipes.input[0], STDIN_FILENO);
+            dup2(pipes.output[1], STDOUT_FILENO);
+            dup2(pipes.error[1], STDERR_FILENO);
+            close_command_pipes(&pipes);
+        }
+
+        // Execute the command
+        if (!is_built_in_command(cmd)) {
+            run_command_in_child(cmd);
+        }
+        _exit(EXIT_SUCCESS);
+    } else if (pid < 0) {
+        log_message(LOG_LEVEL_ERROR, "fork: %m");
+        trace_exec_started(exec_fds, -1, 0);
+        close_command_pipes(&pipes);
+        if (terminal_fd >= 0) close(terminal_fd);
+        if (session_fds[0] >= 0) {
+            close(session_fds[0]);
+            close(session_fds[1]);
+        }
+        result->exit_code = 1;
+        return;
+    }
+
+    // Parent process; a terminal command becomes a session leader, and with it a group leader, by itself
+    if (terminal_size == NULL) {
+        setpgid(pid, pid);
+    } else {
+        // The child writes right after setsid, or closes its end by exiting before
+        char byte;
+        close(session_fds[1]);
+        while (read(session_fds[0], &byte, 1) < 0 && errno == EINTR);
+        close(session_fds[0]);
+    }
+    control->group = pid;
+    result->spawn_us = monotonic_us() - received_at;
+    metrics_add(children_running, 1);
+    trace_span("fork", received_at + result->queue_us, received_at + result->spawn_us, cmd->arguments[0]);
+    trace_process_started(pid, cmd->arguments[0]);
+
+    // The reaper collects the child; this thread is only woken once it has exited
+    ReapGroup children;
+    reap_group_start(&children, &pid, 1);
+
+    // Close the child's ends of the pipes; a terminal is both the input and the only output stream
+    CommandInput input = { .fd = terminal_fd, .terminal = 1 };
+    int output_fds[2] = { terminal_fd, -1 };
+    if (terminal_size == NULL) {
+        connect_command_pipes(&pipes, &input, output_fds);
+    } else {
+        fcntl(terminal_fd, F_SETFL, O_NONBLOCK);
+    }
+    trace_exec_started(exec_fds, pid, received_at + result->spawn_us);
+
+    // Relay input from the client and output from the child until the child closes its output
+    uint64_t relay_started = trace_now_us();
+    int receiving = relay_command_io(session, output_fds, &input, control, result, received_at, frame_buffer);
+
+    // Close the read ends of the output pipes and whatever is left of the input
+    close_command_input(&input);
+    close_command_pipes(&pipes);
+    if (terminal_fd >= 0) close(terminal_fd);
+    uint64_t relay_finished = trace_now_us();
+    trace_span("relay", relay_started, relay_finished, NULL);
+
+    // Wait for the reaper to report the child's exit
+    ExecutionResult execution;
+    wait_for_command(session, &children, &input, control, receiving, &execution, frame_buffer);
+    metrics_add(children_running, -1);
+    trace_span("wait", relay_finished, trace_now_us(), NULL);
+    fill_command_result(result, &execution);
+}
+
+// Execute a series of piped commands. The client's input goes to the first stage, the output of the
+// last stage and the error output of every stage come back as they are produced, as for a single command.
+// The stages share one process group, so a cancel or deadline reaches all of them.
+static void run_piped_commands(Session *session, ShellCommand **commands, int command_count, int input_fd,
+                               CommandControl *control, CommandResult *result, uint64_t received_at,
+                               char *frame_buffer) {
+    pid_t pids[MAX_PIPED_COMMANDS + 1];
+
+    CommandPipes pipes;
+    if (open_command_pipes(&pipes) < 0) {
+        log_message(LOG_LEVEL_ERROR, "pipe: %m");
+        result->exit_code = 1;
+        return;
+    }
+    result->queue_us = monotonic_us() - received_at;
+
+    int stdio_fds[3] = { input_fd >= 0 ? input_fd : pipes.input[0], pipes.output[1], pipes.error[1] };
+    int started = spawn_piped_commands(commands, command_count, pids, stdio_fds, 1);
+    if (started > 0) control->group = pids[0];
+    result->spawn_us = monotonic_us() - received_at;
+    metrics_add(children_running, started);
+    trace_span("spawn", received_at + result->queue_us, received_at + result->spawn_us, NULL);
+
+    ReapGroup children;
+    reap_group_start(&children, pids, started);
+
+    // Relay until every stage has closed its output; a pipeline that failed to start just ends its streams
+    CommandInput input = { .fd = -1 };
+    int output_fds[2];
+    connect_command_pipes(&pipes, &input, output_fds);
+    uint64_t relay_started = trace_now_us();
+    int receiving = relay_command_io(session, output_fds, &input, control, result, received_at, frame_buffer);
+    close_command_input(&input);
+    close_command_pipes(&pipes);
+    uint64_t relay_finished = trace_now_us();
+    trace_span("relay", relay_started, relay_finished, NULL);
+
+    ExecutionResult execution;
+    wait_for_command(session, &children, &input, control, receiving, &execution, frame_buffer);
+    metrics_add(children_running, -started);
+    trace_span("wait", relay_finished, trace_now_us(), NULL);
+    fill_command_result(result, &execution);
+    if (started < command_count) {
+        result->exit_code = 1;
+    }
+}
+
+// Open the upload a command reads as its stdin: the one a '<@name' redirection names, otherwise the upload
+// sent for the next command's stdin, which only this command gets. Returns -1 if the command reads the
+// client's input or a file. Plans are shared, so a redirection from an upload is taken off a copy of the
+// command, which *cmd then points to.
+static int open_command_upload(Session *session, ShellCommand **cmd, ShellCommand *copy) {
+    const char *input_file = (*cmd)->input_file;
+    if (input_file != NULL && input_file[0] == '@' && input_file[1] != '\0') {
+        int fd = upload_open(&session->uploads, input_file + 1);
+        if (fd >= 0) {
+            *copy = **cmd;
+            copy->input_file = NULL;
+            *cmd = copy;
+        }
+        return fd;
+    }
+
+    int fd = upload_open(&session->uploads, "");
+    upload_remove(&session->uploads, "");
+    return fd;
+}
+
+// Receive the next frame of a session. A failed connection is waited out for the grace period,
+// and a resumed connection takes over; returns 1 with a frame or 0 once the session is over.
+static int receive_session_frame(Session *session, uint8_t *frame_type, char *frame_buffer, uint32_t *frame_length) {
+    while (1) {
+        if (session->socket < 0) {
+            if (session->journal.capacity == 0) return 0;
+
+            log_message(LOG_LEVEL_INFO, "Keeping the session of Client ID %d for %d s", session->client_id, grace_seconds);
+            metrics_add(sessions_detached, 1);
+            int resumed = session_wait_for_resume(session, grace_seconds);
+            metrics_add(sessions_detached, -1);
+            if (!resumed) return 0;
+            metrics_add(sessions_resumed_total, 1);
+            continue;
+        }
+
+        struct pollfd fds[2] = {
+            { .fd = session->socket, .events = POLLIN },
+            { .fd = session->wake_fds[0], .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "poll: %m");
+            return 0;
+        }
+        if (fds[1].revents) {
+            if (session_take_over(session)) metrics_add(sessions_resumed_total, 1);
+            continue;
+        }
+
+        int status = recv_frame(session->socket, frame_type, frame_buffer, FRAME_STDIN_MAX, frame_length);
+        if (status > 0) return 1;
+        if (status == 0) {
+            // Client has closed the connection between commands, so it is done with the session
+            log_message(LOG_LEVEL_INFO, "Client ID %d disconnected.", session->client_id);
+            return 0;
+        }
+
+        // A connection that failed may come back
+        log_message(LOG_LEVEL_ERROR, "Receive failed from Client ID %d: %m", session->client_id);
+        session_detach(session);
+    }
+}
+
 // Function to handle each client in a separate thread
 void *handle_client_thread(void *arg) {
     ClientInfo *client_info = (ClientInfo *)arg;
     int client_socket = client_info->socket;
     int client_id = client_info->client_id;
 
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(client_info->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-    int client_port = ntohs(client_info->client_addr.sin_port);
+    // Clients on the Unix socket have no address to show
+    char client_ip[INET_ADDRSTRLEN] = "local";
+    int client_port = 0;
+    if (!client_info->local) {
+        inet_ntop(AF_INET, &(client_info->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+        client_port = ntohs(client_info->client_addr.sin_port);
+    }
 
-    printf("Client connected: ID = %d, IP = %s, Port = %d\n", client_id, client_ip, client_port);
+    log_message(LOG_LEVEL_INFO, "Client connected: ID = %d, IP = %s, Port = %d", client_id, client_ip, client_port);
 
     char buffer[BUFFER_SIZE];
+    int first_command = 1;
 
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE); // Clear the buffer
+    // Commands and input frames for the running command are received here
+    char *frame_buffer = slab_alloc(frame_buffer_pool);
+    if (frame_buffer == NULL) {
+        log_message(LOG_LEVEL_ERROR, "Malloc failed: %m");
+        close(client_socket);
+        slab_free(client_info_pool, client_info);
+        return NULL;
+    }
 
-        // Receive command from the client
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received < 0) {
-            perror("Receive failed");
-            break;
-        } else if (bytes_received == 0) {
-            // Client has closed the connection
-            printf("Client ID %d (IP = %s, Port = %d) disconnected.\n", client_id, client_ip, client_port);
+    // The first frame tells a reconnecting client from a new session
+    uint8_t frame_type;
+    uint32_t frame_length;
+    int status = recv_frame(client_socket, &frame_type, frame_buffer, FRAME_STDIN_MAX, &frame_length);
+    int have_frame = status > 0;
+    if (status > 0 && frame_type == FRAME_RESUME) {
+        uint64_t token, received_offset;
+        if (decode_resume_frame((uint8_t *)frame_buffer, frame_length, &token, &received_offset) == 0 &&
+            session_hand_over(token, client_socket, received_offset) == 0) {
+            // The session's own thread carries on with this connection
+            log_message(LOG_LEVEL_INFO, "Client ID %d resumes an earlier session", client_id);
+            slab_free(frame_buffer_pool, frame_buffer);
+            slab_free(client_info_pool, client_info);
+            return NULL;
+        }
+        log_message(LOG_LEVEL_INFO, "Client ID %d presented an unknown session, starting a new one", client_id);
+        have_frame = 0;
+    } else if (status <= 0) {
+        log_message(LOG_LEVEL_INFO, "Client ID %d (IP = %s, Port = %d) disconnected.", client_id, client_ip, client_port);
+        close(client_socket);
+        slab_free(frame_buffer_pool, frame_buffer);
+        slab_free(client_info_pool, client_info);
+        return NULL;
+    }
+
+    // Journal the output only when sessions can be resumed
+    Session *session = session_create(client_socket, client_id, journal_pool);
+    if (session == NULL) {
+        log_message(LOG_LEVEL_ERROR, "Creating a session failed: %m");
+        close(client_socket);
+        slab_free(frame_buffer_pool, frame_buffer);
+        slab_free(client_info_pool, client_info);
+        return NULL;
+    }
+    if (session->journal.capacity > 0) {
+        session_send_token(session, 0); // The client needs the token only if it can resume
+    }
+    metrics_add(sessions_active, 1);
+    trace_name_thread("session %d (%s:%d)", client_id, client_ip, client_port);
+
+    uint32_t requested_deadline_ms = 0;   // From a FRAME_DEADLINE, for the next command only
+    while (have_frame || receive_session_frame(session, &frame_type, frame_buffer, &frame_length)) {
+        have_frame = 0;
+        if (frame_type == FRAME_DEADLINE) {
+            if (decode_deadline_frame((uint8_t *)frame_buffer, frame_length, &requested_deadline_ms) < 0) {
+                log_message(LOG_LEVEL_WARN, "Client ID %d sent a malformed deadline", client_id);
+            }
+            continue;
+        } else if (frame_type == FRAME_COMPLETE) {
+            answer_completion(session, frame_buffer, frame_length);
+            continue;
+        } else if (frame_type == FRAME_GET) {
+            serve_get(session, frame_buffer, frame_length);
+            continue;
+        } else if (frame_type == FRAME_PUT) {
+            receive_put(session, frame_buffer, frame_length);
+            continue;
+        } else if (frame_type == FRAME_UPLOAD) {
+            if (upload_receive(&session->uploads, (uint8_t *)frame_buffer, frame_length) < 0) {
+                log_message(LOG_LEVEL_WARN, "Dropping an upload piece from Client ID %d: %m", client_id);
+            }
+            continue;
+        } else if (frame_type == FRAME_CANCEL) {
+            // The command finished before the cancel arrived
+            log_message(LOG_LEVEL_DEBUG, "Dropping a cancel from Client ID %d, no command is running", client_id);
+            continue;
+        } else if (frame_type == FRAME_STDIN) {
+            // Input that arrived after its command finished
+            log_message(LOG_LEVEL_DEBUG, "Dropping %u input bytes from Client ID %d, no command is running",
+                        frame_length, client_id);
+            continue;
+        } else if (frame_type != FRAME_COMMAND && frame_type != FRAME_PTY_COMMAND) {
+            log_message(LOG_LEVEL_WARN, "Client ID %d sent an unexpected frame type %d", client_id, frame_type);
+            continue;
+        }
+
+        // A pseudo-terminal command starts with the client's window size
+        const char *command_text = frame_buffer;
+        struct winsize terminal_size, *use_terminal = NULL;
+        if (frame_type == FRAME_PTY_COMMAND) {
+            if (decode_window_size((uint8_t *)frame_buffer, frame_length, &terminal_size.ws_row, &terminal_size.ws_col) < 0) {
+                log_message(LOG_LEVEL_ERROR, "Client ID %d sent a malformed terminal command", client_id);
+                break;
+            }
+            terminal_size.ws_xpixel = terminal_size.ws_ypixel = 0;
+            use_terminal = &terminal_size;
+            command_text += WINDOW_SIZE_SIZE;
+            frame_length -= WINDOW_SIZE_SIZE;
+        }
+        if (frame_length >= BUFFER_SIZE) {
+            log_message(LOG_LEVEL_ERROR, "Client ID %d sent a command of %u bytes", client_id, frame_length);
             break;
         }
 
-        buffer[bytes_received] = '\0';  // Null-terminate the received data
-        printf("Received command from Client ID %d: \"%s\"\n", client_id, buffer);
+        uint64_t received_at = monotonic_us();
+        if (first_command) {
+            metrics_observe(accept_recv_latency, received_at - client_info->accepted_at);
+            trace_span("accept_recv", client_info->accepted_at, received_at, NULL);
+            first_command = 0;
+        }
+        metrics_add(commands_total, 1);
+        memcpy(buffer, command_text, frame_length);
+        buffer[frame_length] = '\0';  // Null-terminate the received data
+        log_message(LOG_LEVEL_INFO, "Received command from Client ID %d: \"%s\"", client_id, buffer);
+
+        // Keep the text for the trace, cut to what a span holds
+        char traced_command[TRACE_DETAIL_MAX] = "";
+        if (trace_is_enabled()) snprintf(traced_command, sizeof(traced_command), "%.*s", TRACE_DETAIL_MAX - 1, buffer);
 
         // If the client sends 'exit', terminate the connection
         if (strcmp(buffer, "exit") == 0) {
-            printf("Client ID %d requested to close the connection.\n", client_id);
+            log_message(LOG_LEVEL_INFO, "Client ID %d requested to close the connection.", client_id);
             break;
         }
 
-        // Parse and execute the received command
-        char *piped_commands[MAX_PIPED_COMMANDS + 1];
-        int piped_command_count = split_piped_commands(buffer, piped_commands, MAX_PIPED_COMMANDS + 1);
+        // Resuming clients are told whether a command is still running
+        session->running = 1;
 
-        // Check for parsing errors
-        if (piped_command_count == -1) {
-            // Send end-of-output signal
-            send(client_socket, "__END__", strlen("__END__"), 0);
-            continue;
+        // Interactive commands run on the isolated CPUs, if any were reserved
+        affinity_set_latency_sensitive(use_terminal != NULL);
+
+        // The client may shorten the server's deadline, but not extend it
+        uint32_t deadline_ms = requested_deadline_ms;
+        if (deadline_ms == 0 || (default_deadline_ms != 0 && default_deadline_ms < deadline_ms)) {
+            deadline_ms = default_deadline_ms;
         }
+        requested_deadline_ms = 0;
+        CommandControl control = { .client_id = client_id };
+        if (deadline_ms > 0) control.terminate_at = received_at + deadline_ms * 1000ULL;
+
+        // Parse errors are reported like a shell syntax error
+        CommandResult result;
+        memset(&result, 0, sizeof(result));
+        result.exit_code = 2;
+
+        // Parse and execute the received command, or run the plan cached for the same line
+        CommandPlan *plan = plan_acquire(buffer);
+        uint64_t parsed_at = monotonic_us();
+        metrics_observe(parse_latency, parsed_at - received_at);
+        trace_span("parse", received_at, parsed_at, NULL);
+
+        if (plan != NULL) {
+            int command_count;
+            ShellCommand **commands = plan_commands(plan, &command_count);
+
+            // The first stage may read an upload instead of the client's input
+            ShellCommand first_command;
+            ShellCommand *stages[MAX_PIPED_COMMANDS + 2];
+            memcpy(stages, commands, (command_count + 1) * sizeof(ShellCommand *));
+            int input_fd = open_command_upload(session, &stages[0], &first_command);
 
-        // Create a pipe for capturing command output
-        int pipe_fds[2];
-        if (pipe(pipe_fds) == -1) {
-            perror("pipe");
+            if (command_count == 1) {
+                run_single_command(session, stages[0], input_fd, &control, &result, received_at, use_terminal,
+                                   frame_buffer);
+            } else {
+                run_piped_commands(session, stages, command_count, input_fd, &control, &result, received_at,
+                                   frame_buffer);
+            }
+            if (input_fd >= 0) close(input_fd);
+            plan_release(plan);
+        }
+
+        // Send the completion frame to the client
+        result.complete_us = monotonic_us() - received_at;
+        int sent = send_command_result(session, &result);
+        session->running = 0;
+        if (trace_is_enabled()) {
+            uint64_t sent_at = monotonic_us();
+            trace_span("send_result", received_at + result.complete_us, sent_at, NULL);
+            trace_span("command", received_at, sent_at, traced_command);
+        }
+
+        if (result.spawn_us > 0) {
+            metrics_observe(spawn_latency, result.spawn_us - result.queue_us);
+            metrics_observe(run_latency, result.complete_us - result.spawn_us);
+            metrics_observe(flush_latency, monotonic_us() - received_at - result.complete_us);
+        }
+        if (result.exit_code != 0) {
+            metrics_add(commands_failed_total, 1);
+        }
+
+        if (sent < 0) {
+            log_message(LOG_LEVEL_ERROR, "Send failed to Client ID %d: %m", client_id);
             break;
         }
+    }
 
-        if (piped_command_count == 1) {
-            // Handle a single command
-            ShellCommand cmd;
-            parse_shell_command(piped_commands[0], &cmd);
+    metrics_add(sessions_active, -1);
+    slab_free(frame_buffer_pool, frame_buffer);
 
-            if (cmd.arguments[0] == NULL) {
-                // No command to execute
-                send(client_socket, "__END__", strlen("__END__"), 0);
-                continue;
-            }
+    // Clean up: close the session's connection and free client info structure
+    session_destroy(session);
+    wildcard_clear_cache();                      // The directory listings the session's commands expanded
+    slab_free(client_info_pool, client_info);    // Free the client info structure
+    return NULL;          // Exit the thread
+}
 
-            pid_t pid = fork();
-            if (pid == 0) {
-                // Child process
+// Request a clean shutdown
+static void handle_shutdown_signal(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
 
-                // Close the read end of the pipe
-                close(pipe_fds[0]);
+// Restore the signal mask and SIGPIPE in forked children, so commands behave as in any other shell
+static void restore_signals_in_child(void) {
+    signal(SIGPIPE, SIG_DFL);
+    pthread_sigmask(SIG_SETMASK, &original_signal_mask, NULL);
+}
 
-                // Redirect stdout and stderr to the write end of the pipe
-                dup2(pipe_fds[1], STDOUT_FILENO);
-                dup2(pipe_fds[1], STDERR_FILENO);
-                close(pipe_fds[1]);
+// Block SIGINT/SIGTERM in every thread; the main thread unblocks them only while it waits in sigsuspend
+static void install_signal_handlers(void) {
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &original_signal_mask);
+    pthread_atfork(NULL, NULL, restore_signals_in_child);
 
-                // Execute the command
-                if (!is_built_in_command(&cmd)) {
-                    execute_single_command(&cmd);
-                }
-                exit(EXIT_SUCCESS);
-            } else if (pid > 0) {
-                // Parent process
+    // A client that disconnects, or a command that stops reading its input, must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
-                // Close the write end of the pipe
-                close(pipe_fds[1]);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_shutdown_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
 
-                // Read output from the child process and send to client
-                char output_buffer[BUFFER_SIZE];
-                ssize_t read_bytes;
-                while ((read_bytes = read(pipe_fds[0], output_buffer, sizeof(output_buffer) - 1)) > 0) {
-                    output_buffer[read_bytes] = '\0'; // Null-terminate
-                    send(client_socket, output_buffer, read_bytes, 0); // Send output to client
-                }
+// Start a session thread for an accepted connection
+static void start_client_session(int client_socket, const struct sockaddr_in *client_addr, int local) {
+    // Completion frames and terminal echo are small writes that must not wait for delayed ACKs
+    if (!local) disable_nagle(client_socket);
 
-                // Close the read end of the pipe
-                close(pipe_fds[0]);
+    // Increment and assign a unique client ID
+    pthread_mutex_lock(&counter_mutex);
+    int client_id = ++client_counter;
+    pthread_mutex_unlock(&counter_mutex);
 
-                // Wait for the child process to finish
-                waitpid(pid, NULL, 0);
+    log_message(LOG_LEVEL_DEBUG, "Accepted new connection: Client ID %d", client_id);
 
-                // Send end-of-output signal to the client
-                send(client_socket, "__END__", strlen("__END__"), 0);
-            } else {
-                perror("fork");
-                close(pipe_fds[0]);
-                close(pipe_fds[1]);
-            }
-        } else {
-            // Handle multiple piped commands
-            ShellCommand *commands[MAX_PIPED_COMMANDS + 1];
-            for (int i = 0; i < piped_command_count; i++) {
-                commands[i] = malloc(sizeof(ShellCommand));
-                if (commands[i] == NULL) {
-                    perror("Malloc failed");
-                    send(client_socket, "__END__", strlen("__END__"), 0);
-                    close(pipe_fds[0]);
-                    close(pipe_fds[1]);
-                    return NULL;
-                }
-                parse_shell_command(piped_commands[i], commands[i]);
-            }
+    // Allocate and set up client info
+    ClientInfo *client_info = slab_alloc(client_info_pool);
+    if (client_info == NULL) {
+        log_message(LOG_LEVEL_ERROR, "Malloc failed: %m");
+        close(client_socket);
+        return;
+    }
+
+    client_info->socket = client_socket;
+    client_info->client_id = client_id;
+    client_info->client_addr = *client_addr;
+    client_info->local = local;
+    client_info->accepted_at = monotonic_us();
+    metrics_add(connections_total, 1);
 
-            // Execute piped commands
-            execute_piped_commands(commands, piped_command_count);
+    // Create a thread to handle the new client; it starts detached, with a small stack
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, &session_thread_attributes, handle_client_thread, client_info) != 0) {
+        log_message(LOG_LEVEL_ERROR, "Thread creation failed");
+        close(client_socket);
+        slab_free(client_info_pool, client_info);
+    }
+}
 
-            // Free allocated ShellCommand structures
-            for (int i = 0; i < piped_command_count; i++) {
-                for (int j = 0; commands[i]->arguments[j] != NULL; j++) {
-                    free(commands[i]->arguments[j]);
+// Accept connections on one acceptor's listeners until the server stops
+static void *acceptor_thread(void *arg) {
+    Acceptor *acceptor = (Acceptor *)arg;
+    trace_name_thread("acceptor %d", acceptor->index);
+
+    while (1) {
+        struct pollfd fds[3] = {
+            { .fd = acceptor->tcp_socket, .events = POLLIN },
+            { .fd = acceptor->unix_socket, .events = POLLIN },
+            { .fd = acceptor_stop_fds[0], .events = POLLIN },
+        };
+        if (poll(fds, 3, -1) < 0) {
+            if (errno != EINTR) log_message(LOG_LEVEL_ERROR, "poll: %m");
+            continue;
+        }
+        if (fds[2].revents) break;
+
+        // The listeners are non-blocking, so a burst is drained before polling again
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            while (1) {
+                struct sockaddr_in client_addr = { 0 };
+                socklen_t addr_len = sizeof(client_addr);
+                int local = i == 1;
+                int client_socket = accept4(fds[i].fd, local ? NULL : (struct sockaddr*)&client_addr,
+                                            local ? NULL : &addr_len, SOCK_CLOEXEC);
+                if (client_socket < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) log_message(LOG_LEVEL_ERROR, "Accept failed: %m");
+                    break;
                 }
-                free(commands[i]);
+                start_client_session(client_socket, &client_addr, local);
             }
-
-            // Send end-of-output signal to the client
-            send(client_socket, "__END__", strlen("__END__"), 0);
         }
     }
+    return NULL;
+}
 
-    // Clean up: close the client socket and free client info structure
-    close(client_socket); // Close the client socket
-    free(client_info);    // Free the client info structure
-    return NULL;          // Exit the thread
+// Parse the CPU list of an option, exiting if it is invalid; returns 1
+static int parse_cpu_option(const char *list, cpu_set_t *cpus) {
+    if (parse_cpu_list(list, cpus) < 0) {
+        fprintf(stderr, "Invalid CPU list '%s'\n", list);
+        exit(EXIT_FAILURE);
+    }
+    return 1;
+}
+
+// Print the command-line options of the server
+static void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --high-throughput      enlarge pipes and splice command output into the socket\n"
+            "  --log-level LEVEL      lowest level logged: debug, info, warn or error (default info)\n"
+            "  --log-sample N         log only one in N debug and info lines\n"
+            "  --log-file PATH        append the log to PATH instead of stdout\n"
+            "  --socket PATH          also accept clients on a Unix domain socket at PATH\n"
+            "  --acceptors N          accept on N threads, each with its own SO_REUSEPORT socket\n"
+            "                         (default one per online CPU)\n"
+            "  --backlog N            length of each listen queue (default SOMAXCONN)\n"
+            "  --cpus LIST            run server threads on these CPUs, e.g. 0-3,8\n"
+            "  --command-cpus LIST    run commands on these CPUs\n"
+            "  --place-commands WHERE run each command on the 'core' or NUMA 'node' of the thread\n"
+            "                         reading its output, or 'any' of its CPUs (default any)\n"
+            "  --isolated-cpus LIST   reserve these CPUs for interactive (pseudo-terminal) commands\n"
+            "  --metrics-port PORT    serve Prometheus metrics on 127.0.0.1:PORT\n"
+            "  --metrics-socket PATH  serve Prometheus metrics on a Unix socket\n"
+            "  --grace SECONDS        keep a session this long for its client to reconnect, 0 disables\n"
+            "                         resuming and journaling (default 60)\n"
+            "  --journal-size BYTES   output kept per session for reconnecting clients (default 1 MB)\n"
+            "  --deadline SECONDS     terminate commands running longer than this; clients may ask for\n"
+            "                         less (default no limit)\n"
+            "  --kill-after SECONDS   kill a command this long after SIGTERM or a cancel if it has not\n"
+            "                         exited (default 5)\n"
+            "  --trace PATH           record per-command spans and write them to PATH as Chrome\n"
+            "                         trace-event JSON when the server stops (SIGINT or SIGTERM)\n",
+            program);
 }
 
-int main(void) {
-    int server_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+int main(int argc, char *argv[]) {
+    struct sockaddr_in server_addr;
+    int acceptor_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int backlog = DEFAULT_BACKLOG;
+    int log_level = LOG_LEVEL_INFO;
+    int log_fd = STDOUT_FILENO;
+    int metrics_port = 0;
+    const char *metrics_socket = NULL;
+    const char *trace_path = NULL;
+    const char *socket_path = NULL;
+    cpu_set_t server_cpus, command_cpus, isolated_cpus;
+    int have_server_cpus = 0, have_command_cpus = 0, have_isolated_cpus = 0;
+    int placement = PLACE_ANY;
 
-    // Create the server socket
-    server_socket = create_server_socket(PORT, &server_addr);
-    if (server_socket < 0) {
-        fprintf(stderr, "Failed to create server socket.\n");
+    // Parse command-line options
+    static const struct option options[] = {
+        { "high-throughput", no_argument, NULL, 'T' },
+        { "log-level", required_argument, NULL, 'l' },
+        { "log-sample", required_argument, NULL, 's' },
+        { "log-file", required_argument, NULL, 'f' },
+        { "metrics-port", required_argument, NULL, 'm' },
+        { "metrics-socket", required_argument, NULL, 'M' },
+        { "trace", required_argument, NULL, 't' },
+        { "grace", required_argument, NULL, 'g' },
+        { "journal-size", required_argument, NULL, 'j' },
+        { "socket", required_argument, NULL, 'u' },
+        { "acceptors", required_argument, NULL, 'a' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "cpus", required_argument, NULL, 'c' },
+        { "command-cpus", required_argument, NULL, 'C' },
+        { "place-commands", required_argument, NULL, 'p' },
+        { "isolated-cpus", required_argument, NULL, 'i' },
+        { "deadline", required_argument, NULL, 'd' },
+        { "kill-after", required_argument, NULL, 'k' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'T':
+                set_high_throughput_mode(1);
+                break;
+            case 'l':
+                if ((log_level = logger_parse_level(optarg)) < 0) {
+                    fprintf(stderr, "Unknown log level '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's': {
+                char *end;
+                errno = 0;
+                long every_n = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || errno != 0 || every_n <= 0 || every_n > INT_MAX) {
+                    fprintf(stderr, "Invalid log sampling '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                logger_set_sampling(LOG_LEVEL_DEBUG, (unsigned)every_n);
+                logger_set_sampling(LOG_LEVEL_INFO, (unsigned)every_n);
+                break;
+            }
+            case 'f':
+                if ((log_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+                    perror("Open Log File Error");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                metrics_port = atoi(optarg);
+                break;
+            case 'M':
+                metrics_socket = optarg;
+                break;
+            case 't':
+                trace_path = optarg;
+                trace_enable();
+                break;
+            case 'g':
+                grace_seconds = atoi(optarg);
+                break;
+            case 'j':
+                journal_size = strtoul(optarg, NULL, 10);
+                if (journal_size == 0) grace_seconds = 0;
+                break;
+            case 'u':
+                socket_path = optarg;
+                break;
+            case 'a':
+                acceptor_count = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'c':
+                have_server_cpus = parse_cpu_option(optarg, &server_cpus);
+                break;
+            case 'C':
+                have_command_cpus = parse_cpu_option(optarg, &command_cpus);
+                break;
+            case 'i':
+                have_isolated_cpus = parse_cpu_option(optarg, &isolated_cpus);
+                break;
+            case 'p':
+                if ((placement = parse_placement(optarg)) < 0) {
+                    fprintf(stderr, "Unknown placement '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                if (parse_deadline_seconds(optarg, &default_deadline_ms) < 0) {
+                    fprintf(stderr, "Invalid deadline '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                kill_after_seconds = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc || acceptor_count <= 0 || backlog <= 0 || kill_after_seconds < 0) {
+        print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    // Set up the server socket (binding and listening)
-    if (setup_server_socket(server_socket, &server_addr, 5) < 0) {
-        fprintf(stderr, "Failed to set up server socket.\n");
+    // Only the main thread takes SIGINT/SIGTERM, so blocking calls in other threads are not interrupted
+    install_signal_handlers();
+
+    // Pin the main thread before any other starts, so every server thread inherits its CPUs
+    if ((have_server_cpus || have_isolated_cpus) &&
+        affinity_set_server_cpus(have_server_cpus ? &server_cpus : NULL, have_isolated_cpus ? &isolated_cpus : NULL) < 0) {
+        perror("Failed to set the server CPUs");
         exit(EXIT_FAILURE);
     }
+    affinity_set_command_cpus(have_command_cpus ? &command_cpus : NULL, placement);
+    affinity_install_fork_handlers();
 
-    printf("Server is listening on port %d...\n", PORT);
+    // Children are reaped through pidfds on one thread; without pidfds each session reaps its own
+    if (reaper_start() < 0) {
+        fprintf(stderr, "pidfds are unavailable, sessions will wait for their own children\n");
+    }
 
-    // Continuously accept and handle client connections
-    while (1) {
-        // Accept a new client connection
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue;
+    // Command names and directory listings for completion are indexed once and kept fresh by inotify
+    if (completion_start() < 0) {
+        fprintf(stderr, "inotify is unavailable, completion will check directories for changes on every request\n");
+    }
+
+    // Start the background log writer; session threads never block on the log
+    if (logger_start(log_fd, log_level) < 0) {
+        fprintf(stderr, "Failed to start the logger.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Per-connection objects come from pools; journals only exist if sessions can be resumed
+    client_info_pool = slab_pool_create("client_info", sizeof(ClientInfo), 64);
+    frame_buffer_pool = slab_pool_create("frame_buffer", FRAME_STDIN_MAX, 4);
+    if (grace_seconds > 0) journal_pool = slab_pool_create("journal", journal_size, 1);
+    pthread_attr_init(&session_thread_attributes);
+    pthread_attr_setdetachstate(&session_thread_attributes, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&session_thread_attributes, SESSION_STACK_SIZE);
+
+    // Serve metrics on their own local endpoint, away from the command port
+    register_server_metrics();
+    if (metrics_start_server(metrics_port, metrics_socket) < 0) {
+        perror("Failed to start the metrics endpoint");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each acceptor has its own SO_REUSEPORT listener, so connection bursts are spread over them
+    Acceptor *acceptors = calloc(acceptor_count, sizeof(Acceptor));
+    if (acceptors == NULL || pipe2(acceptor_stop_fds, O_CLOEXEC) < 0) {
+        perror("Failed to set up the acceptors");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < acceptor_count; i++) {
+        acceptors[i].index = i;
+        acceptors[i].unix_socket = -1;
+        acceptors[i].tcp_socket = create_server_socket(PORT, &server_addr);
+        if (acceptors[i].tcp_socket < 0) {
+            fprintf(stderr, "Failed to create server socket.\n");
+            exit(EXIT_FAILURE);
         }
 
-        // Increment and assign a unique client ID
-        pthread_mutex_lock(&counter_mutex);
-        int client_id = ++client_counter;
-        pthread_mutex_unlock(&counter_mutex);
+        // Set up the server socket (binding and listening)
+        if (setup_server_socket(acceptors[i].tcp_socket, &server_addr, backlog, 1) < 0) {
+            fprintf(stderr, "Failed to set up server socket.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    log_message(LOG_LEVEL_INFO, "Server is listening on port %d with %d acceptor(s), backlog %d...",
+                PORT, acceptor_count, backlog);
 
-        printf("Accepted new connection: Client ID %d\n", client_id);
+    // Same-host clients can skip the TCP stack; the first acceptor serves the Unix socket too
+    if (socket_path != NULL) {
+        if ((acceptors[0].unix_socket = create_unix_server_socket(socket_path, backlog)) < 0) {
+            fprintf(stderr, "Failed to set up the Unix socket.\n");
+            exit(EXIT_FAILURE);
+        }
+        log_message(LOG_LEVEL_INFO, "Server is listening on %s...", socket_path);
+    }
 
-        // Allocate and set up client info
-        ClientInfo *client_info = malloc(sizeof(ClientInfo));
-        if (client_info == NULL) {
-            perror("Malloc failed");
-            close(client_socket);
-            continue;
+    for (int i = 0; i < acceptor_count; i++) {
+        if (pthread_create(&acceptors[i].thread, NULL, acceptor_thread, &acceptors[i]) != 0) {
+            fprintf(stderr, "Failed to start acceptor %d.\n", i);
+            exit(EXIT_FAILURE);
         }
+    }
 
-        client_info->socket = client_socket;
-        client_info->client_id = client_id;
-        client_info->client_addr = client_addr;
+    // Wait with the shutdown signals unblocked until one arrives
+    while (!stop_requested) {
+        sigsuspend(&original_signal_mask);
+    }
 
-        // Create a thread to handle the new client
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client_thread, client_info) != 0) {
-            perror("Thread creation failed");
-            close(client_socket);
-            free(client_info);
+    // The stop pipe stays readable, so one byte wakes every acceptor
+    if (write(acceptor_stop_fds[1], "", 1) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Stopping the acceptors failed: %m");
+    }
+    for (int i = 0; i < acceptor_count; i++) {
+        pthread_join(acceptors[i].thread, NULL);
+        close(acceptors[i].tcp_socket);
+        if (acceptors[i].unix_socket >= 0) close(acceptors[i].unix_socket);
+    }
+    if (socket_path != NULL) unlink(socket_path);
+    free(acceptors);
+
+    log_message(LOG_LEVEL_INFO, "Server shutting down.");
+    if (trace_path != NULL) {
+        if (trace_write_file(trace_path) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to write the trace to %s: %m", trace_path);
         } else {
-            pthread_detach(thread_id); // Detach thread
+            log_message(LOG_LEVEL_INFO, "Trace written to %s", trace_path);
         }
     }
-
-    close(server_socket);
+    logger_stop();
     return 0;
 }
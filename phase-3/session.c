@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include "logger.h"
+#include "protocol.h"
+#include "session.h"
+
+// A session belongs to the thread that created it. When its connection drops, the thread keeps
+// running the command and journaling its output. A reconnecting client presents the token to a
+// fresh connection thread, which hands the socket over through the registry and exits; the session
+// thread picks it up, replays the journal from the client's offset and carries on.
+
+static Session *session_registry = NULL;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Append bytes to the journal, dropping the oldest bytes once it is full
+static void journal_append(OutputJournal *journal, const void *data, size_t length) {
+    const char *bytes = (const char *)data;
+    if (length > journal->capacity) {
+        // Only the newest capacity bytes can be kept
+        bytes += length - journal->capacity;
+        journal->end += length - journal->capacity;
+        length = journal->capacity;
+    }
+
+    size_t position = journal->end % journal->capacity;
+    size_t first = journal->capacity - position < length ? journal->capacity - position : length;
+    memcpy(journal->data + position, bytes, first);
+    memcpy(journal->data, bytes + first, length - first);
+    journal->end += length;
+    if (journal->end - journal->start > journal->capacity) {
+        journal->start = journal->end - journal->capacity;
+    }
+}
+
+// Write the journal from offset to its end, returns 0 or -1 on a write error
+static int journal_replay(OutputJournal *journal, uint64_t offset, int socket) {
+    while (offset < journal->end) {
+        size_t position = offset % journal->capacity;
+        size_t length = journal->end - offset;
+        if (length > journal->capacity - position) length = journal->capacity - position;
+
+        ssize_t written = send(socket, journal->data + position, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        offset += written;
+    }
+    return 0;
+}
+
+// Create and register a session
+Session *session_create(int socket, int client_id, SlabPool *journal_pool) {
+    Session *session = calloc(1, sizeof(Session));
+    if (session == NULL) return NULL;
+
+    // Journals are large, so they are recycled through a pool instead of mapped for every connection
+    if (journal_pool != NULL && (session->journal.data = slab_alloc(journal_pool)) == NULL) {
+        free(session);
+        return NULL;
+    }
+    if (pipe2(session->wake_fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+        if (journal_pool != NULL) slab_free(journal_pool, session->journal.data);
+        free(session);
+        return NULL;
+    }
+
+    // The token is the only credential for resuming, so it must not be guessable
+    while (session->token == 0) {
+        if (getrandom(&session->token, sizeof(session->token), 0) < 0 && errno != EINTR) {
+            session->token = ((uint64_t)rand() << 32) ^ (uint64_t)time(NULL) ^ (uint64_t)client_id;
+        }
+    }
+    session->journal.capacity = journal_pool != NULL ? slab_object_size(journal_pool) : 0;
+    session->journal_pool = journal_pool;
+    session->client_id = client_id;
+    session->socket = socket;
+    session->resumed_socket = -1;
+    upload_set_init(&session->uploads);
+    pthread_mutex_init(&session->lock, NULL);
+
+    pthread_mutex_lock(&registry_lock);
+    session->next = session_registry;
+    session_registry = session;
+    pthread_mutex_unlock(&registry_lock);
+    return session;
+}
+
+// Unregister a session and close its connections
+void session_destroy(Session *session) {
+    pthread_mutex_lock(&registry_lock);
+    for (Session **link = &session_registry; *link != NULL; link = &(*link)->next) {
+        if (*link == session) {
+            *link = session->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    // No thread can find the session any more, so a connection handed over late is closed here
+    if (session->resumed_socket >= 0) close(session->resumed_socket);
+    if (session->socket >= 0) close(session->socket);
+    close(session->wake_fds[0]);
+    close(session->wake_fds[1]);
+    pthread_mutex_destroy(&session->lock);
+    upload_set_clear(&session->uploads);
+    if (session->journal_pool != NULL) slab_free(session->journal_pool, session->journal.data);
+    free(session);
+}
+
+// Send the session token; it is not journaled, since every connection gets its own
+int session_send_token(Session *session, uint64_t replay_offset) {
+    uint8_t payload[SESSION_FRAME_SIZE];
+    encode_session_frame(session->token, replay_offset, session->journal.end, session->running, payload);
+    return send_frame(session->socket, FRAME_SESSION, payload, sizeof(payload));
+}
+
+// Journal a frame and send it to the client if it is connected
+int session_send_frame(Session *session, uint8_t type, const void *payload, uint32_t length) {
+    if (session->journal.capacity > 0) {
+        uint8_t header[FRAME_HEADER_SIZE];
+        encode_frame_header(header, type, length);
+        journal_append(&session->journal, header, sizeof(header));
+        journal_append(&session->journal, payload, length);
+    }
+    if (session->socket < 0) {
+        return session->journal.capacity > 0 ? 0 : -1;
+    }
+
+    if (send_frame(session->socket, type, payload, length) < 0) {
+        if (session->journal.capacity == 0) return -1;
+
+        // The frame is in the journal; the client gets it when it resumes
+        log_message(LOG_LEVEL_INFO, "Client ID %d lost its connection (%m), keeping the session", session->client_id);
+        session_detach(session);
+    }
+    return 0;
+}
+
+// Close the session's connection
+void session_detach(Session *session) {
+    if (session->socket >= 0) {
+        close(session->socket);
+        session->socket = -1;
+    }
+}
+
+// Hand a resuming connection over to its session
+int session_hand_over(uint64_t token, int socket, uint64_t received_offset) {
+    int found = -1;
+
+    pthread_mutex_lock(&registry_lock);
+    for (Session *session = session_registry; session != NULL; session = session->next) {
+        if (session->token != token || session->journal.capacity == 0) continue;
+
+        pthread_mutex_lock(&session->lock);
+        if (session->resumed_socket >= 0) close(session->resumed_socket); // An older attempt lost the race
+        session->resumed_socket = socket;
+        session->resumed_offset = received_offset;
+        pthread_mutex_unlock(&session->lock);
+
+        // Wake the session thread wherever it is waiting
+        char byte = 1;
+        if (write(session->wake_fds[1], &byte, 1) < 0 && errno != EAGAIN) {
+            log_message(LOG_LEVEL_ERROR, "Waking session of Client ID %d failed: %m", session->client_id);
+        }
+        found = 0;
+        break;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return found;
+}
+
+// Switch to the handed-over connection and replay the frames it missed
+int session_take_over(Session *session) {
+    char drain[16];
+    while (read(session->wake_fds[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&session->lock);
+    int socket = session->resumed_socket;
+    uint64_t offset = session->resumed_offset;
+    session->resumed_socket = -1;
+    pthread_mutex_unlock(&session->lock);
+    if (socket < 0) return 0;
+
+    // The new connection replaces the old one, even if the old one still looks alive
+    session_detach(session);
+    session->socket = socket;
+
+    // Frames older than the journal are lost; the token frame tells the client where replay starts
+    OutputJournal *journal = &session->journal;
+    if (offset < journal->start || offset > journal->end) {
+        log_message(LOG_LEVEL_WARN, "Client ID %d resumed at offset %llu, journal holds %llu-%llu",
+                    session->client_id, (unsigned long long)offset,
+                    (unsigned long long)journal->start, (unsigned long long)journal->end);
+        offset = offset > journal->end ? journal->end : journal->start;
+    }
+    log_message(LOG_LEVEL_INFO, "Client ID %d resumed its session, replaying %llu bytes",
+                session->client_id, (unsigned long long)(journal->end - offset));
+
+    if (session_send_token(session, offset) < 0 || journal_replay(journal, offset, socket) < 0) {
+        session_detach(session);
+    }
+    return 1;
+}
+
+// Wait while detached until a client resumes or the grace period ends
+int session_wait_for_resume(Session *session, int grace_seconds) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    time_t deadline = now.tv_sec + grace_seconds;
+
+    while (session->socket < 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec >= deadline) return 0;
+
+        struct pollfd wake = { .fd = session->wake_fds[0], .events = POLLIN };
+        int ready = poll(&wake, 1, (int)(deadline - now.tv_sec) * 1000);
+        if (ready < 0 && errno != EINTR) return 0;
+        if (ready > 0) session_take_over(session);
+    }
+    return 1;
+}
@@ -0,0 +1,60 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "slab.h"
+#include "upload.h"
+
+// Structure to hold the output journal of a session: the newest capacity bytes of the framed
+// stream sent to the client, addressed by their offset since the session started
+typedef struct {
+    char *data;
+    size_t capacity;             // 0 when resuming is disabled
+    uint64_t start;              // Offset of the oldest byte still held
+    uint64_t end;                // Offset just past the newest byte
+} OutputJournal;
+
+// Structure to hold a client session, which can outlive its connection for a grace period
+typedef struct Session {
+    uint64_t token;              // Presented by a reconnecting client to resume the session
+    int client_id;
+    int socket;                  // Current connection, -1 while detached
+    int running;                 // Set while a command runs, reported to resuming clients
+    int wake_fds[2];             // Readable once a resumed connection has been handed over
+    OutputJournal journal;
+    SlabPool *journal_pool;      // Pool the journal's data came from
+    UploadSet uploads;           // Files the client uploaded into memory for its commands to read
+    pthread_mutex_t lock;        // Protects the handover fields below
+    int resumed_socket;          // Connection waiting to take over the session, -1 if none
+    uint64_t resumed_offset;     // Offset the resuming client has received up to
+    struct Session *next;        // Next session in the registry
+} Session;
+
+// Function to create and register a session for a new connection; its journal is taken from
+// journal_pool, whose object size is the journal size (NULL disables resuming)
+Session *session_create(int socket, int client_id, SlabPool *journal_pool);
+
+// Function to unregister a session and close its connections
+void session_destroy(Session *session);
+
+// Function to send the session token to the client, with the offset the following frames start at
+int session_send_token(Session *session, uint64_t replay_offset);
+
+// Function to journal a frame and send it if connected; returns -1 only if the frame is lost for good
+int session_send_frame(Session *session, uint8_t type, const void *payload, uint32_t length);
+
+// Function to close the session's connection; the session itself lives on
+void session_detach(Session *session);
+
+// Function to hand a resuming connection over to the session with the token, returns 0 if it exists
+int session_hand_over(uint64_t token, int socket, uint64_t received_offset);
+
+// Function to switch to a handed-over connection and replay what it missed, returns 1 if one was pending
+int session_take_over(Session *session);
+
+// Function to wait while detached until a client resumes (returns 1) or the grace period ends (returns 0)
+int session_wait_for_resume(Session *session, int grace_seconds);
+
+#endif
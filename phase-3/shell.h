@@ -5,13 +5,18 @@
 #define MAX_COMMAND_LENGTH 1024 // Maximum length of a single command line input
 #define MAX_ARGUMENTS 100       // Maximum number of arguments a command can have
 #define MAX_PIPED_COMMANDS 3    // Maximum number of piped commands that can be handled
+#define MAX_PARALLEL_JOBS 16    // Maximum number of concurrent jobs the parallel builtin may run
 
 typedef struct {
-    char *arguments[MAX_ARGUMENTS];  // Command arguments
+    char **arguments;                // Command arguments, NULL-terminated
+    char *inline_arguments[MAX_ARGUMENTS]; // Where arguments points, unless wildcards expanded to more
+    int argument_capacity;           // Length of the array arguments points to
     char *input_file;                // Input redirection file
     char *output_file;               // Output redirection file
     char *error_file;                // Error redirection file
     int append_output;               // Flag for output append mode
+    int expanded;                    // Whether arguments had wildcards, so they depend on the file system
+    char *executable;                // Path of arguments[0] found in PATH ahead of time, NULL to search on exec
 } ShellCommand;
 
 #endif
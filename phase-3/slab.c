@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "slab.h"
+
+// Objects are carved out of slabs that are never returned to the allocator, so connection churn
+// reuses the same memory instead of fragmenting the heap. Each thread keeps a small cache of free
+// objects per pool and only takes the pool's lock to move half a cache at a time. A thread's cache
+// goes back to the pools when the thread exits. Free objects are linked through their first word.
+
+#define SLAB_ALIGNMENT 16
+
+// Structure to hold a slab; its objects follow the header
+typedef struct Slab {
+    struct Slab *next;
+    char padding[SLAB_ALIGNMENT - sizeof(struct Slab *)];
+} Slab;
+
+// Structure to hold a pool and its shared free list
+struct SlabPool {
+    const char *name;
+    size_t object_size;
+    size_t objects_per_slab;
+    int cache_limit;            // Free objects a thread may cache, fewer for large objects
+    int index;                  // Slot of this pool in every thread's caches
+    pthread_mutex_t lock;       // Protects free_list, slabs and total
+    void *free_list;
+    Slab *slabs;
+    uint64_t total;
+    uint64_t in_use;            // Updated atomically, outside the lock
+};
+
+// Structure to hold a thread's free objects of one pool
+typedef struct {
+    void *objects[SLAB_CACHE_OBJECTS];
+    int count;
+} SlabCache;
+
+static SlabPool pools[SLAB_MAX_POOLS];
+static int pool_count = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+
+static __thread SlabCache thread_caches[SLAB_MAX_POOLS];
+static __thread int caches_registered = 0;
+
+// Return every object a thread cached to its pool; runs when the thread exits
+static void flush_thread_caches(void *caches) {
+    SlabCache *cache = (SlabCache *)caches;
+    for (int i = 0; i < pool_count; i++) {
+        pthread_mutex_lock(&pools[i].lock);
+        while (cache[i].count > 0) {
+            void *object = cache[i].objects[--cache[i].count];
+            *(void **)object = pools[i].free_list;
+            pools[i].free_list = object;
+        }
+        pthread_mutex_unlock(&pools[i].lock);
+    }
+}
+
+// Create a pool
+SlabPool *slab_pool_create(const char *name, size_t object_size, size_t objects_per_slab) {
+    pthread_mutex_lock(&pools_lock);
+    if (pool_count == SLAB_MAX_POOLS || (pool_count == 0 && pthread_key_create(&cache_key, flush_thread_caches) != 0)) {
+        pthread_mutex_unlock(&pools_lock);
+        return NULL;
+    }
+
+    // Every object must hold the free-list link and keep the next one aligned
+    if (object_size < sizeof(void *)) object_size = sizeof(void *);
+    object_size = (object_size + SLAB_ALIGNMENT - 1) & ~(size_t)(SLAB_ALIGNMENT - 1);
+
+    SlabPool *pool = &pools[pool_count];
+    pool->name = name;
+    pool->object_size = object_size;
+    pool->objects_per_slab = objects_per_slab > 0 ? objects_per_slab : 1;
+    pool->cache_limit = SLAB_CACHE_BYTES / object_size;
+    if (pool->cache_limit > SLAB_CACHE_OBJECTS) pool->cache_limit = SLAB_CACHE_OBJECTS;
+    if (pool->cache_limit < 1) pool->cache_limit = 1;
+    pool->index = pool_count;
+    pthread_mutex_init(&pool->lock, NULL);
+    __atomic_store_n(&pool_count, pool_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+// Register the calling thread's caches, so they are flushed when it exits
+static inline void register_thread_caches(void) {
+    if (!caches_registered) {
+        pthread_setspecific(cache_key, thread_caches);
+        caches_registered = 1;
+    }
+}
+
+// Add a slab to the pool's free list; called with the pool locked
+static int grow_pool(SlabPool *pool) {
+    Slab *slab = malloc(sizeof(Slab) + pool->object_size * pool->objects_per_slab);
+    if (slab == NULL) return -1;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    char *objects = (char *)(slab + 1);
+    for (size_t i = pool->objects_per_slab; i-- > 0;) {
+        void *object = objects + i * pool->object_size;
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+    }
+    pool->total += pool->objects_per_slab;
+    return 0;
+}
+
+// Take an object, refilling half the thread's cache from the pool when it is empty
+void *slab_alloc(SlabPool *pool) {
+    SlabCache *cache = &thread_caches[pool->index];
+    register_thread_caches();
+    if (cache->count == 0) {
+        pthread_mutex_lock(&pool->lock);
+        while (cache->count == 0 || cache->count < pool->cache_limit / 2) {
+            if (pool->free_list == NULL && grow_pool(pool) < 0) break;
+            void *object = pool->free_list;
+            pool->free_list = *(void **)object;
+            cache->objects[cache->count++] = object;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (cache->count == 0) return NULL;
+    }
+
+    __atomic_fetch_add(&pool->in_use, 1, __ATOMIC_RELAXED);
+    return cache->objects[--cache->count];
+}
+
+// Give an object back, returning half of a full cache to the pool
+void slab_free(SlabPool *pool, void *object) {
+    if (object == NULL) return;
+    SlabCache *cache = &thread_caches[pool->index];
+    register_thread_caches();
+    if (cache->count == pool->cache_limit) {
+        pthread_mutex_lock(&pool->lock);
+        while (cache->count > pool->cache_limit / 2) {
+            void *cached = cache->objects[--cache->count];
+            *(void **)cached = pool->free_list;
+            pool->free_list = cached;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    cache->objects[cache->count++] = object;
+    __atomic_fetch_sub(&pool->in_use, 1, __ATOMIC_RELAXED);
+}
+
+// Return the size of the objects
+size_t slab_object_size(SlabPool *pool) {
+    return pool->object_size;
+}
+
+// Return the objects handed out
+uint64_t slab_objects_in_use(SlabPool *pool) {
+    return __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED);
+}
+
+// Return the objects in all slabs
+uint64_t slab_objects_total(SlabPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    uint64_t total = pool->total;
+    pthread_mutex_unlock(&pool->lock);
+    return total;
+}
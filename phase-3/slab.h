@@ -0,0 +1,31 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_MAX_POOLS 8        // Pools a program can create
+#define SLAB_CACHE_OBJECTS 32   // Most free objects a thread keeps per pool before returning some to the pool
+#define SLAB_CACHE_BYTES (64 * 1024) // Large objects are cached only up to this many bytes (but at least one)
+
+typedef struct SlabPool SlabPool;
+
+// Function to create a pool of fixed-size objects, carved out of slabs of objects_per_slab objects
+SlabPool *slab_pool_create(const char *name, size_t object_size, size_t objects_per_slab);
+
+// Function to take an object from the pool (its contents are undefined), returns NULL if memory runs out
+void *slab_alloc(SlabPool *pool);
+
+// Function to give an object back to the pool it came from
+void slab_free(SlabPool *pool, void *object);
+
+// Function to return the size of the pool's objects (the requested size, rounded up for alignment)
+size_t slab_object_size(SlabPool *pool);
+
+// Function to return the number of objects handed out and not yet given back
+uint64_t slab_objects_in_use(SlabPool *pool);
+
+// Function to return the number of objects in all slabs of the pool
+uint64_t slab_objects_total(SlabPool *pool);
+
+#endif
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "trace.h"
+
+// Every thread appends spans to its own chain of chunks, so recording never takes a lock. Chunks
+// are published with a release store and only ever appended to, which lets the dump read them
+// while sessions are still running. Child processes get their own track, keyed by their pid, so
+// every pipeline stage shows up as a separate row in the viewer.
+
+#define TRACE_PROCESS_SLOTS 8   // Children a thread can have running at once while traced
+
+// Structure to hold one recorded span ('X') or track name ('M')
+typedef struct {
+    const char *name;
+    uint64_t start_us;
+    uint64_t duration_us;
+    pid_t track;                        // Thread id of the session thread or pid of the child
+    char phase;
+    char detail[TRACE_DETAIL_MAX];
+} TraceEvent;
+
+// Structure to hold a chunk of a thread's events
+typedef struct TraceChunk {
+    TraceEvent events[TRACE_CHUNK_EVENTS];
+    uint32_t count;                     // Published with release, read with acquire
+    struct TraceChunk *next;
+} TraceChunk;
+
+// Structure to hold one thread's events and its running children
+typedef struct TraceBuffer {
+    TraceChunk *first;
+    TraceChunk *current;
+    pid_t tid;
+    struct {
+        pid_t pid;
+        uint64_t started_at;
+        int exec_fd;                    // Read end of the exec timing pipe until it closes, or -1
+        uint64_t forked_at;
+    } processes[TRACE_PROCESS_SLOTS];
+    struct TraceBuffer *next;           // Next buffer in the registry
+} TraceBuffer;
+
+static int trace_enabled = 0;
+static TraceBuffer *buffer_registry = NULL;    // Lock-free list of all buffers, pushed at the head
+static __thread TraceBuffer *thread_buffer = NULL;
+static uint64_t total_events = 0;              // Events recorded over all threads
+static uint64_t dropped_events = 0;            // Events dropped after TRACE_MAX_EVENTS
+
+// Turn tracing on
+void trace_enable(void) {
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+}
+
+// Check whether tracing is on
+int trace_is_enabled(void) {
+    return __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED);
+}
+
+// Return the current monotonic time in microseconds
+uint64_t trace_now_us(void) {
+    if (!trace_is_enabled()) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Return the calling thread's buffer, registering a new one on first use
+static TraceBuffer *get_thread_buffer(void) {
+    if (thread_buffer != NULL) return thread_buffer;
+
+    TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+    if (buffer == NULL) return NULL;
+    buffer->tid = gettid();
+
+    // Buffers outlive their threads: the spans are needed until the trace is written
+    buffer->next = __atomic_load_n(&buffer_registry, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&buffer_registry, &buffer->next, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    thread_buffer = buffer;
+    return buffer;
+}
+
+// Append an event to the calling thread's buffer
+static void append_event(char phase, const char *name, uint64_t start_us, uint64_t end_us, pid_t track, const char *detail) {
+    TraceBuffer *buffer = get_thread_buffer();
+    if (buffer == NULL) return;
+
+    if (__atomic_fetch_add(&total_events, 1, __ATOMIC_RELAXED) >= TRACE_MAX_EVENTS) {
+        __atomic_fetch_add(&dropped_events, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Start a new chunk when the current one is full
+    TraceChunk *chunk = buffer->current;
+    if (chunk == NULL || chunk->count == TRACE_CHUNK_EVENTS) {
+        TraceChunk *next = calloc(1, sizeof(TraceChunk));
+        if (next == NULL) return;
+        if (chunk == NULL) {
+            __atomic_store_n(&buffer->first, next, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&chunk->next, next, __ATOMIC_RELEASE);
+        }
+        buffer->current = chunk = next;
+    }
+
+    TraceEvent *event = &chunk->events[chunk->count];
+    event->name = name;
+    event->start_us = start_us;
+    event->duration_us = end_us > start_us ? end_us - start_us : 0;
+    event->track = track != 0 ? track : buffer->tid;
+    event->phase = phase;
+    snprintf(event->detail, sizeof(event->detail), "%s", detail != NULL ? detail : "");
+    __atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_RELEASE); // Publish the event to the dump
+}
+
+// Record a span on the calling thread's track
+void trace_span(const char *name, uint64_t start_us, uint64_t end_us, const char *detail) {
+    if (!trace_is_enabled()) return;
+    append_event('X', name, start_us, end_us, 0, detail);
+}
+
+// Name the calling thread's track
+void trace_name_thread(const char *format, ...) {
+    if (!trace_is_enabled()) return;
+
+    char name[TRACE_DETAIL_MAX];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(name, sizeof(name), format, args);
+    va_end(args);
+    append_event('M', "thread_name", 0, 0, 0, name);
+}
+
+// Remember when a child was forked and name its track
+void trace_process_started(pid_t pid, const char *command) {
+    if (!trace_is_enabled()) return;
+    TraceBuffer *buffer = get_thread_buffer();
+    if (buffer == NULL) return;
+
+    for (int i = 0; i < TRACE_PROCESS_SLOTS; i++) {
+        if (buffer->processes[i].pid == 0) {
+            buffer->processes[i].pid = pid;
+            buffer->processes[i].started_at = trace_now_us();
+            buffer->processes[i].exec_fd = -1;
+            break;
+        }
+    }
+
+    char name[TRACE_DETAIL_MAX];
+    snprintf(name, sizeof(name), "pid %d: %s", (int)pid, command);
+    append_event('M', "thread_name", 0, 0, pid, name);
+}
+
+// Record the exec span of a child once its exec timing pipe reports end of file; the child never writes
+// to it, so a read either ends the file or would block
+static void check_exec_pipe(TraceBuffer *buffer, int slot) {
+    char byte;
+    ssize_t read_bytes;
+    while ((read_bytes = read(buffer->processes[slot].exec_fd, &byte, 1)) < 0 && errno == EINTR);
+    if (read_bytes < 0 && errno == EAGAIN) return;
+
+    pid_t pid = buffer->processes[slot].pid;
+    char detail[TRACE_DETAIL_MAX];
+    snprintf(detail, sizeof(detail), "pid %d", (int)pid);
+    append_event('X', "exec", buffer->processes[slot].forked_at, trace_now_us(), pid, detail);
+    close(buffer->processes[slot].exec_fd);
+    buffer->processes[slot].exec_fd = -1;
+}
+
+// Record the lifetime of a reaped child on its own track
+void trace_process_reaped(pid_t pid) {
+    if (!trace_is_enabled()) return;
+    TraceBuffer *buffer = get_thread_buffer();
+    if (buffer == NULL) return;
+
+    for (int i = 0; i < TRACE_PROCESS_SLOTS; i++) {
+        if (buffer->processes[i].pid == pid) {
+            // A child that exited without exec, or whose pipe lives on in its own children, has no exec span
+            if (buffer->processes[i].exec_fd >= 0) {
+                check_exec_pipe(buffer, i);
+                if (buffer->processes[i].exec_fd >= 0) close(buffer->processes[i].exec_fd);
+                buffer->processes[i].exec_fd = -1;
+            }
+
+            char detail[TRACE_DETAIL_MAX];
+            snprintf(detail, sizeof(detail), "pid %d", (int)pid);
+            append_event('X', "process", buffer->processes[i].started_at, trace_now_us(), pid, detail);
+            buffer->processes[i].pid = 0;
+            break;
+        }
+    }
+}
+
+// Create the exec timing pipe, or mark it unused when tracing is off
+void trace_exec_pipe(int fds[2]) {
+    fds[0] = fds[1] = -1;
+    if (trace_is_enabled() && pipe2(fds, O_CLOEXEC) < 0) {
+        fds[0] = fds[1] = -1;
+    }
+}
+
+// Keep the read end of a child's exec timing pipe, to be checked without blocking
+void trace_exec_started(int fds[2], pid_t pid, uint64_t forked_at) {
+    if (fds[0] < 0) return;
+    close(fds[1]);
+
+    TraceBuffer *buffer = pid > 0 ? get_thread_buffer() : NULL;
+    for (int i = 0; buffer != NULL && i < TRACE_PROCESS_SLOTS; i++) {
+        if (buffer->processes[i].pid == pid) {
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            buffer->processes[i].exec_fd = fds[0];
+            buffer->processes[i].forked_at = forked_at;
+            check_exec_pipe(buffer, i);  // The child may have exec'd already
+            return;
+        }
+    }
+    close(fds[0]);
+}
+
+// Add the open exec timing pipes to a poll set
+int trace_exec_poll_fds(struct pollfd *fds, int max) {
+    if (!trace_is_enabled() || thread_buffer == NULL) return 0;
+
+    int count = 0;
+    for (int i = 0; i < TRACE_PROCESS_SLOTS && count < max; i++) {
+        if (thread_buffer->processes[i].pid != 0 && thread_buffer->processes[i].exec_fd >= 0) {
+            fds[count].fd = thread_buffer->processes[i].exec_fd;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Record the exec spans of children whose exec timing pipes closed
+void trace_exec_check(void) {
+    if (!trace_is_enabled() || thread_buffer == NULL) return;
+    for (int i = 0; i < TRACE_PROCESS_SLOTS; i++) {
+        if (thread_buffer->processes[i].pid != 0 && thread_buffer->processes[i].exec_fd >= 0) {
+            check_exec_pipe(thread_buffer, i);
+        }
+    }
+}
+
+// Write a string as a JSON string literal
+static void write_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Write every recorded event as Chrome trace-event JSON
+int trace_write_file(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) return -1;
+
+    int pid = (int)getpid();
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (TraceBuffer *buffer = __atomic_load_n(&buffer_registry, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+        for (TraceChunk *chunk = __atomic_load_n(&buffer->first, __ATOMIC_ACQUIRE); chunk != NULL;
+             chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+            uint32_t count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+            for (uint32_t i = 0; i < count; i++) {
+                TraceEvent *event = &chunk->events[i];
+                fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d",
+                        first ? "" : ",\n", event->name, event->phase, pid, (int)event->track);
+                if (event->phase == 'M') {
+                    fprintf(out, ",\"args\":{\"name\":");
+                } else {
+                    fprintf(out, ",\"ts\":%llu,\"dur\":%llu,\"args\":{\"detail\":",
+                            (unsigned long long)event->start_us, (unsigned long long)event->duration_us);
+                }
+                write_json_string(out, event->detail);
+                fprintf(out, "}}");
+                first = 0;
+            }
+        }
+    }
+
+    fprintf(out, "\n],\"otherData\":{\"dropped_events\":%llu}}\n",
+            (unsigned long long)__atomic_load_n(&dropped_events, __ATOMIC_RELAXED));
+    return fclose(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,49 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#define TRACE_CHUNK_EVENTS 512      // Events per buffer chunk; a thread allocates chunks as it needs them
+#define TRACE_MAX_EVENTS 1000000    // Events kept over all threads before new ones are dropped
+#define TRACE_DETAIL_MAX 64         // Longest detail string kept per event
+
+// Function to turn tracing on; until then every trace call returns immediately
+void trace_enable(void);
+
+// Function to check whether tracing is on
+int trace_is_enabled(void);
+
+// Function to return the current monotonic time in microseconds (0 when tracing is off)
+uint64_t trace_now_us(void);
+
+// Function to record a span on the calling thread's track; name must be a string literal, detail may be NULL
+void trace_span(const char *name, uint64_t start_us, uint64_t end_us, const char *detail);
+
+// Function to name the calling thread's track in the trace viewer
+void trace_name_thread(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Function to note that a child process was forked; it gets its own track, named after the command
+void trace_process_started(pid_t pid, const char *command);
+
+// Function to note that a child process was reaped, recording its lifetime on its track
+void trace_process_reaped(pid_t pid);
+
+// Function to create the pipe used to time exec; its write end closes in the child on exec (or exit)
+void trace_exec_pipe(int fds[2]);
+
+// Function to hand the exec timing pipe of a child forked by the calling thread to the tracer, which records
+// the exec span once the pipe closes; pid -1 just closes the pipe. Never waits for the child.
+void trace_exec_started(int fds[2], pid_t pid, uint64_t forked_at);
+
+// Function to add the calling thread's exec timing pipes still open to a poll set, returns how many were added
+int trace_exec_poll_fds(struct pollfd *fds, int max);
+
+// Function to record the exec spans of the calling thread's children whose exec timing pipes closed
+void trace_exec_check(void);
+
+// Function to write every recorded span to path as Chrome trace-event JSON (for Perfetto or chrome://tracing)
+int trace_write_file(const char *path);
+
+#endif
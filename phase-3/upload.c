@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "upload.h"
+
+// Uploads live in memfds, so nothing of them reaches the disk and a command given one as its stdin
+// can mmap it like any regular file. Once its last piece arrived an upload is sealed against writes
+// and size changes, and every command gets a descriptor of its own from /proc, starting at offset 0,
+// so one command reading it does not move another's position.
+
+#define UPLOAD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+// Find the upload with a name, NULL if there is none
+static Upload *find_upload(UploadSet *set, const char *name) {
+    for (int i = 0; i < UPLOAD_MAX_FILES; i++) {
+        if (set->files[i].fd >= 0 && strcmp(set->files[i].name, name) == 0) return &set->files[i];
+    }
+    return NULL;
+}
+
+// Close an upload and free its slot
+static void close_upload(UploadSet *set, Upload *upload) {
+    close(upload->fd);
+    set->bytes -= upload->size;
+    upload->fd = -1;
+    upload->complete = 0;
+    upload->size = 0;
+}
+
+// Initialize an empty set of uploads
+void upload_set_init(UploadSet *set) {
+    memset(set, 0, sizeof(*set));
+    for (int i = 0; i < UPLOAD_MAX_FILES; i++) {
+        set->files[i].fd = -1;
+    }
+}
+
+// Close every upload of a set
+void upload_set_clear(UploadSet *set) {
+    for (int i = 0; i < UPLOAD_MAX_FILES; i++) {
+        if (set->files[i].fd >= 0) close_upload(set, &set->files[i]);
+    }
+}
+
+// Add a piece to its upload, starting a new memfd for a first piece
+int upload_receive(UploadSet *set, const uint8_t *payload, uint32_t length) {
+    uint8_t flags;
+    const char *name;
+    uint32_t header_length;
+    if (decode_upload_header(payload, length, &flags, &name, &header_length) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    Upload *upload = find_upload(set, name);
+    if (flags & UPLOAD_FIRST) {
+        // A new upload replaces the old one of the same name
+        if (upload != NULL) close_upload(set, upload);
+        for (int i = 0; i < UPLOAD_MAX_FILES && upload == NULL; i++) {
+            if (set->files[i].fd < 0) upload = &set->files[i];
+        }
+        if (upload == NULL) {
+            errno = EMFILE;
+            return -1;
+        }
+
+        char memfd_name[UPLOAD_NAME_MAX + 16];
+        snprintf(memfd_name, sizeof(memfd_name), "upload:%s", name);
+        upload->fd = memfd_create(memfd_name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (upload->fd < 0) return -1;
+        strcpy(upload->name, name);
+    } else if (upload == NULL || upload->complete) {
+        // The upload was dropped, or this piece does not belong to one
+        errno = ENOENT;
+        return -1;
+    }
+
+    // An upload that would take more than the session's share of memory is dropped as a whole
+    const uint8_t *data = payload + header_length;
+    size_t data_length = length - header_length;
+    if (set->bytes + data_length > UPLOAD_MAX_BYTES) {
+        close_upload(set, upload);
+        errno = EFBIG;
+        return -1;
+    }
+    while (data_length > 0) {
+        ssize_t written = write(upload->fd, data, data_length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            int saved_errno = errno;
+            close_upload(set, upload);
+            errno = saved_errno;
+            return -1;
+        }
+        data += written;
+        data_length -= written;
+        upload->size += written;
+        set->bytes += written;
+    }
+
+    if (flags & UPLOAD_LAST) {
+        fcntl(upload->fd, F_ADD_SEALS, UPLOAD_SEALS);
+        upload->complete = 1;
+    }
+    return 0;
+}
+
+// Open a complete upload for a command to read
+int upload_open(UploadSet *set, const char *name) {
+    Upload *upload = find_upload(set, name);
+    if (upload == NULL || !upload->complete) return -1;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", upload->fd);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // Without /proc the descriptor shares its position with the upload, so rewind it
+        fd = fcntl(upload->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd >= 0) lseek(fd, 0, SEEK_SET);
+    }
+    return fd;
+}
+
+// Close an upload by name
+void upload_remove(UploadSet *set, const char *name) {
+    Upload *upload = find_upload(set, name);
+    if (upload != NULL) close_upload(set, upload);
+}
@@ -0,0 +1,39 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+#define UPLOAD_MAX_FILES 16                    // Uploads a session may hold at once
+#define UPLOAD_MAX_BYTES (256 * 1024 * 1024)   // Memory all uploads of a session may take together
+
+// Structure to hold a file the client uploaded into a memfd
+typedef struct {
+    char name[UPLOAD_NAME_MAX + 1];  // "" for the stdin of the next command
+    int fd;                          // -1 for a free slot
+    int complete;                    // Sealed after its last piece, so commands can read it
+    uint64_t size;
+} Upload;
+
+// Structure to hold the uploads of a session
+typedef struct {
+    Upload files[UPLOAD_MAX_FILES];
+    uint64_t bytes;                  // Sum of the sizes of all uploads
+} UploadSet;
+
+// Function to initialize an empty set of uploads
+void upload_set_init(UploadSet *set);
+
+// Function to close every upload of a set
+void upload_set_clear(UploadSet *set);
+
+// Function to add a FRAME_UPLOAD piece to its upload; returns 0, or -1 with errno set if the upload was dropped
+int upload_receive(UploadSet *set, const uint8_t *payload, uint32_t length);
+
+// Function to open a new read-only descriptor positioned at the start of a complete upload, -1 if there is none
+int upload_open(UploadSet *set, const char *name);
+
+// Function to close an upload and free its memory
+void upload_remove(UploadSet *set, const char *name);
+
+#endif
@@ -1,29 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <ctype.h>
 #include "utilities.h"
-#include "shell.h"
-
-// Shell Utilities
-
-// Display the shell prompt
-void display_shell_prompt() {
-    printf("my_shell> ");
-    fflush(stdout); // Ensure the prompt is displayed immediately
-}
-
-// Read user input from stdin into the provided buffer
-int read_user_input(char *command_line) {
-    if (!fgets(command_line, MAX_COMMAND_LENGTH, stdin)) {
-        return 0; // Return 0 on EOF (end of file) or error
-    }
-    command_line[strcspn(command_line, "\n")] = '\0'; // Remove the trailing newline character
-    return 1;
-}
-
 
 // Socket Utilities
 
@@ -56,15 +40,22 @@ int create_client_socket(int port, const char *ip, struct sockaddr_in *server_ad
         return -1;
     }
 
+    disable_nagle(sock);
     return sock;
 }
 
+// Send small frames (keystrokes, completion frames) immediately instead of waiting for an ACK
+int disable_nagle(int sock) {
+    int opt = 1;
+    return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
 // Create a server socket and configures the sockaddr_in structure
 int create_server_socket(int port, struct sockaddr_in *server_addr) {
     int sock;
 
-    // Create a TCP socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    // Create a TCP socket; it is non-blocking, so an acceptor can drain its backlog and go back to poll
+    if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("Server Socket creation failed");
         return -1;
     }
@@ -79,7 +70,7 @@ int create_server_socket(int port, struct sockaddr_in *server_addr) {
 }
 
 // Bind the server socket to the specified address and starts listening
-int setup_server_socket(int server_socket, struct sockaddr_in *server_addr, int backlog) {
+int setup_server_socket(int server_socket, struct sockaddr_in *server_addr, int backlog, int reuse_port) {
     // Allow reuse of address and port
     int opt = 1;
     if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
@@ -88,6 +79,13 @@ int setup_server_socket(int server_socket, struct sockaddr_in *server_addr, int
         return -1;
     }
 
+    // Every socket bound with SO_REUSEPORT gets its own accept queue, and the kernel spreads connections over them
+    if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(server_socket);
+        return -1;
+    }
+
     // Bind the socket to the specified address and port
     if (bind(server_socket, (struct sockaddr*)server_addr, sizeof(*server_addr)) < 0) {
         perror("Bind failed");
@@ -104,3 +102,69 @@ int setup_server_socket(int server_socket, struct sockaddr_in *server_addr, int
 
     return 0;
 }
+
+// Fill in the address of a Unix domain socket, returns -1 if the path does not fit
+static int make_unix_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Create and connect a client socket to a Unix domain socket; same-host clients skip the TCP stack
+int create_unix_client_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (make_unix_address(path, &addr) < 0) return -1;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Connection Failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Create a Unix domain socket, bind it to path and start listening
+int create_unix_server_socket(const char *path, int backlog) {
+    struct sockaddr_un addr;
+    if (make_unix_address(path, &addr) < 0) return -1;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Server Socket creation failed");
+        return -1;
+    }
+
+    // A socket file left by a previous run would make bind fail
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Bind failed");
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, backlog) < 0) {
+        perror("Listen failed");
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+    return sock;
+}
+
+// Return the current monotonic time in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
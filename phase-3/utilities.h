@@ -1,21 +1,28 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <stdint.h>
 #include <netinet/in.h>
 
-// Function to display the shell prompt
-void display_shell_prompt();
-
-// Function to read user input from stdin
-int read_user_input(char *command_line);
-
 // Function to create and connect a client socket
 int create_client_socket(int port, const char *ip, struct sockaddr_in *server_addr);
 
-// Function to create a server socket
+// Function to set TCP_NODELAY so small writes go out immediately
+int disable_nagle(int sock);
+
+// Function to create a non-blocking server socket
 int create_server_socket(int port, struct sockaddr_in *server_addr);
 
-// Function to bind and listen on the server socket
-int setup_server_socket(int server_socket, struct sockaddr_in *server_addr, int backlog);
+// Function to bind and listen on the server socket; with reuse_port several sockets can share the port
+int setup_server_socket(int server_socket, struct sockaddr_in *server_addr, int backlog, int reuse_port);
+
+// Function to create and connect a client socket to a Unix domain socket at path
+int create_unix_client_socket(const char *path);
+
+// Function to create, bind and listen on a non-blocking Unix domain socket at path, replacing a stale one
+int create_unix_server_socket(const char *path, int backlog);
+
+// Function to return the current monotonic time in nanoseconds
+uint64_t now_ns(void);
 
 #endif
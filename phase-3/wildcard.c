@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "listing.h"
+#include "wildcard.h"
+
+// Patterns are expanded one path component at a time: each component is matched against the sorted
+// listing of every directory the previous components matched, starting from a binary search for its
+// literal prefix. Listings are cached by the thread that read them, which on the server is the thread
+// of one session. A cached listing is used again while the modification time
+// of its directory is unchanged; one read within a second or two of its directory changing may have
+// missed a change with the same timestamp, so it is read again next time.
+
+#define RACY_MTIME_SECONDS 2       // A listing read this soon after its directory changed is not trusted
+
+// Structure to hold a thread's cache slot: a listing and the identity and timestamp that validate it
+typedef struct {
+    dev_t device;                // Identify the directory, so a listing survives changes of directory
+    ino_t inode;
+    struct timespec mtime;       // Modification time of the directory when read
+    int trusted;                 // Whether the listing may be used again while mtime is unchanged
+    SortedListing entries;
+    uint64_t last_used;          // 0 for an empty slot
+} CachedListing;
+
+// Structure to hold a growing array of malloc'd paths
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} PathList;
+
+static __thread CachedListing cached_listings[WILDCARD_CACHE_DIRECTORIES];
+static __thread uint64_t use_counter = 0;
+
+// Add a malloc'd path to a list, which takes ownership of it even on failure
+static int add_path(PathList *list, char *path) {
+    if (path == NULL) return -1;
+    if (list->count + 1 >= list->capacity) {
+        size_t capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            free(path);
+            return -1;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->count++] = path;
+    return 0;
+}
+
+// Free the paths of a list and the list itself
+static void free_paths(PathList *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->paths[i]);
+    free(list->paths);
+    memset(list, 0, sizeof(*list));
+}
+
+// Join a directory prefix ("" for the working directory) and a name into a malloc'd path
+static char *join_path(const char *prefix, const char *name) {
+    size_t prefix_length = strlen(prefix);
+    size_t name_length = strlen(name);
+    int separator = prefix_length > 0 && prefix[prefix_length - 1] != '/';
+    char *path = malloc(prefix_length + separator + name_length + 1);
+    if (path == NULL) return NULL;
+    memcpy(path, prefix, prefix_length);
+    if (separator) path[prefix_length] = '/';
+    memcpy(path + prefix_length + separator, name, name_length + 1);
+    return path;
+}
+
+// Free the listing in a cache slot
+static void free_listing(CachedListing *listing) {
+    free_sorted_listing(&listing->entries);
+    memset(listing, 0, sizeof(*listing));
+}
+
+// Find the listing of a directory, reading it unless a cached one is still current
+static CachedListing *find_listing(const char *path) {
+    struct stat status;
+    if (stat(path, &status) != 0 || !S_ISDIR(status.st_mode)) return NULL;
+
+    CachedListing *slot = NULL;
+    for (int i = 0; i < WILDCARD_CACHE_DIRECTORIES; i++) {
+        CachedListing *listing = &cached_listings[i];
+        if (listing->last_used != 0 && listing->device == status.st_dev && listing->inode == status.st_ino) {
+            slot = listing;
+            break;
+        }
+    }
+    if (slot != NULL && slot->trusted && slot->mtime.tv_sec == status.st_mtim.tv_sec &&
+        slot->mtime.tv_nsec == status.st_mtim.tv_nsec) {
+        slot->last_used = ++use_counter;
+        return slot;
+    }
+
+    // Otherwise take an empty slot, or evict the least recently used listing
+    if (slot == NULL) {
+        slot = &cached_listings[0];
+        for (int i = 1; i < WILDCARD_CACHE_DIRECTORIES && slot->last_used != 0; i++) {
+            if (cached_listings[i].last_used < slot->last_used) slot = &cached_listings[i];
+        }
+    }
+    free_listing(slot);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    int result = read_sorted_listing(fd, 0, &slot->entries);
+    close(fd);
+    if (result < 0) return NULL;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->device = status.st_dev;
+    slot->inode = status.st_ino;
+    slot->mtime = status.st_mtim;
+    slot->trusted = now.tv_sec >= status.st_mtim.tv_sec + RACY_MTIME_SECONDS;
+    slot->last_used = ++use_counter;
+    return slot;
+}
+
+// Check whether an entry is a directory, from its type when the listing has it
+static int is_directory(const char *path, unsigned char type, int follow_links) {
+    if (type == DT_DIR) return 1;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow_links)) return 0;
+    struct stat status;
+    int result = follow_links ? stat(path, &status) : lstat(path, &status);
+    return result == 0 && S_ISDIR(status.st_mode);
+}
+
+// Check whether a component contains an unescaped '*', '?' or '['
+static int has_wildcards(const char *component) {
+    for (const char *p = component; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') p++;
+        else if (*p == '*' || *p == '?' || *p == '[') return 1;
+    }
+    return 0;
+}
+
+// Copy a component without its escaping backslashes, up to its first wildcard; returns the length copied
+static size_t literal_prefix(const char *component, char *buffer) {
+    size_t length = 0;
+    for (const char *p = component; *p != '\0'; p++) {
+        if (*p == '*' || *p == '?' || *p == '[') break;
+        if (*p == '\\' && p[1] != '\0') p++;
+        buffer[length++] = *p;
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+// Match a character against the bracket expression at *pattern and move past it; returns 1 on a match,
+// 0 on none, or -1 if the bracket is not closed and '[' stands for itself
+static int match_bracket(const char **pattern, unsigned char c) {
+    const char *p = *pattern + 1;
+    int negate = 0, matched = 0;
+    if (*p == '!' || *p == '^') {
+        negate = 1;
+        p++;
+    }
+
+    // A ']' right after the opening bracket is a member, not the end
+    const char *first = p;
+    while (*p != '\0' && (*p != ']' || p == first)) {
+        unsigned char low = (unsigned char)*p;
+        if (low == '\\' && p[1] != '\0') low = (unsigned char)*++p;
+        p++;
+        unsigned char high = low;
+        if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+            p++;
+            high = (unsigned char)*p;
+            if (high == '\\' && p[1] != '\0') high = (unsigned char)*++p;
+            p++;
+        }
+        if (low <= c && c <= high) matched = 1;
+    }
+    if (*p != ']') return -1;
+    *pattern = p + 1;
+    return matched != negate;
+}
+
+// Match a name against one component of a pattern; a leading dot is only matched by a literal one
+static int match_component(const char *pattern, const char *name) {
+    const char *p = pattern, *n = name;
+    const char *star_pattern = NULL, *star_name = NULL;
+    if (*n == '.' && *p != '.' && !(p[0] == '\\' && p[1] == '.')) return 0;
+
+    while (*n != '\0') {
+        if (*p == '*') {
+            while (*p == '*') p++;
+            star_pattern = p;
+            star_name = n;
+            continue;
+        }
+
+        int matched = -1;
+        if (*p == '?') {
+            matched = 1;
+            p++;
+        } else if (*p == '[') {
+            matched = match_bracket(&p, (unsigned char)*n);
+        }
+        if (matched < 0) {
+            if (*p == '\\' && p[1] != '\0') p++;
+            matched = *p != '\0' && *p == *n;
+            if (*p != '\0') p++;
+        }
+        if (matched) {
+            n++;
+            continue;
+        }
+
+        // On a mismatch, let the last '*' take one more character
+        if (star_pattern == NULL) return 0;
+        p = star_pattern;
+        n = ++star_name;
+    }
+    while (*p == '*') p++;
+    return *p == '\0';
+}
+
+// Add the entries of each directory in current that match a component to next; unless the component is
+// the last, only directories are kept
+static int expand_wildcards(const PathList *current, const char *component, int last, PathList *next) {
+    char prefix[strlen(component) + 1];
+    size_t prefix_length = literal_prefix(component, prefix);
+
+    for (size_t i = 0; i < current->count; i++) {
+        const char *directory = current->paths[i];
+        CachedListing *listing = find_listing(directory[0] != '\0' ? directory : ".");
+        if (listing == NULL) continue;
+
+        // Names sharing the literal prefix are adjacent, starting at the first not below it
+        const SortedListing *entries = &listing->entries;
+        size_t first = find_prefix(entries->names, entries->count, prefix, prefix_length);
+        for (size_t j = first; j < entries->count && strncmp(entries->names[j], prefix, prefix_length) == 0; j++) {
+            const char *name = entries->names[j];
+            if (!match_component(component, name)) continue;
+            char *path = join_path(directory, name);
+            if (path != NULL && !last && !is_directory(path, (unsigned char)name[-1], 1)) {
+                free(path);
+                continue;
+            }
+            if (add_path(next, path) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Add the visible entries below a directory to next, recursively; directories only unless include_files.
+// Symbolic links to directories are not followed, so a link cannot lead the walk in circles.
+static int walk_directory(const char *directory, int include_files, PathList *next) {
+    CachedListing *listing = find_listing(directory[0] != '\0' ? directory : ".");
+    if (listing == NULL) return 0;
+
+    // Reading the subdirectories may evict this listing, so collect them before descending
+    PathList subdirectories = {0};
+    for (size_t i = 0; i < listing->entries.count; i++) {
+        const char *name = listing->entries.names[i];
+        if (name[0] == '.') continue;
+        char *path = join_path(directory, name);
+        if (path == NULL) goto fail;
+        int directory_entry = is_directory(path, (unsigned char)name[-1], 0);
+        if (directory_entry && add_path(&subdirectories, strdup(path)) < 0) {
+            free(path);
+            goto fail;
+        }
+        if (directory_entry || include_files) {
+            if (add_path(next, path) < 0) goto fail;
+        } else {
+            free(path);
+        }
+    }
+
+    for (size_t i = 0; i < subdirectories.count; i++) {
+        if (walk_directory(subdirectories.paths[i], include_files, next) < 0) goto fail;
+    }
+    free_paths(&subdirectories);
+    return 0;
+
+fail:
+    free_paths(&subdirectories);
+    return -1;
+}
+
+// Add what a "**" component matches below each directory in current to next: everything when it is the
+// last component, otherwise the directory itself and every visible directory below it
+static int expand_globstar(const PathList *current, int last, PathList *next) {
+    for (size_t i = 0; i < current->count; i++) {
+        if (!last && add_path(next, strdup(current->paths[i])) < 0) return -1;
+        if (walk_directory(current->paths[i], last, next) < 0) return -1;
+    }
+    return 0;
+}
+
+// Add each path in current followed by a literal component to next; a last one must exist
+static int expand_literal(const PathList *current, const char *component, int last, PathList *next) {
+    char name[strlen(component) + 1];
+    literal_prefix(component, name);
+
+    for (size_t i = 0; i < current->count; i++) {
+        char *path;
+        if (name[0] == '\0') {
+            // An empty component, from a trailing or doubled '/', keeps only directories
+            path = join_path(current->paths[i], "");
+            size_t length = path != NULL ? strlen(path) : 0;
+            if (length > 0 && path[length - 1] != '/') {
+                char *with_slash = realloc(path, length + 2);
+                if (with_slash == NULL) {
+                    free(path);
+                    return -1;
+                }
+                path = with_slash;
+                memcpy(path + length, "/", 2);
+            }
+            if (path != NULL && last && !is_directory(path, DT_UNKNOWN, 1)) {
+                free(path);
+                continue;
+            }
+        } else {
+            path = join_path(current->paths[i], name);
+            struct stat status;
+            if (path != NULL && last && lstat(path, &status) != 0) {
+                free(path);
+                continue;
+            }
+        }
+        if (add_path(next, path) < 0) return -1;
+    }
+    return 0;
+}
+
+// Expand a pattern into the sorted paths that match it
+int wildcard_expand(const char *pattern, char ***matches) {
+    PathList current = {0}, next = {0};
+    *matches = NULL;
+
+    // An absolute pattern starts from the root, a relative one from the working directory
+    const char *p = pattern;
+    if (add_path(&current, strdup(*p == '/' ? "/" : "")) < 0) return -1;
+    while (*p == '/') p++;
+
+    char *components = strdup(p);
+    if (components == NULL) goto fail;
+    char *component = components;
+    for (;;) {
+        char *slash = strchr(component, '/');
+        int last = slash == NULL;
+        if (slash != NULL) *slash = '\0';
+
+        int status;
+        if (strcmp(component, "**") == 0) status = expand_globstar(&current, last, &next);
+        else if (has_wildcards(component)) status = expand_wildcards(&current, component, last, &next);
+        else status = expand_literal(&current, component, last, &next);
+        if (status < 0) goto fail;
+
+        free_paths(&current);
+        current = next;
+        memset(&next, 0, sizeof(next));
+        if (last || current.count == 0) break;
+        component = slash + 1;
+    }
+    free(components);
+    components = NULL;
+
+    // The array always has room for the terminating NULL
+    if (current.paths == NULL) {
+        current.paths = malloc(sizeof(char *));
+        if (current.paths == NULL) goto fail;
+    }
+    qsort(current.paths, current.count, sizeof(char *), compare_names);
+    current.paths[current.count] = NULL;
+    *matches = current.paths;
+    return (int)current.count;
+
+fail:
+    free(components);
+    free_paths(&current);
+    free_paths(&next);
+    return -1;
+}
+
+// Free the directory listings cached by the calling thread
+void wildcard_clear_cache(void) {
+    for (int i = 0; i < WILDCARD_CACHE_DIRECTORIES; i++) {
+        free_listing(&cached_listings[i]);
+    }
+}
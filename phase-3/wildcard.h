@@ -0,0 +1,14 @@
+#ifndef WILDCARD_H
+#define WILDCARD_H
+
+#define WILDCARD_CACHE_DIRECTORIES 32   // Directory listings each thread keeps, least recently used evicted first
+
+// Function to expand a pattern of '*', '?', "[...]" and "**" components, in which a backslash makes the next
+// character literal, into the matching paths in byte order. Stores a malloc'd NULL-terminated array of
+// malloc'd paths in *matches and returns their number, or -1 on error.
+int wildcard_expand(const char *pattern, char ***matches);
+
+// Function to free the directory listings cached by the calling thread
+void wildcard_clear_cache(void);
+
+#endif